@@ -0,0 +1,616 @@
+// Throughput benchmarks for the JSON server.
+// Every scenario runs against a freshly forked server process, so that different server options can be compared
+// within one run.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <fmt/core.h>
+
+#include "nlohmann/json.hpp"
+#include "json_server.hpp"
+#include "json_client.hpp"
+#include "model.hpp"
+
+
+namespace
+{
+
+using client = json_client::EndpointConnection;
+
+const std::filesystem::path BENCH_DATA_FILE = "bench_data.json";
+const std::filesystem::path BENCH_SOCK_FILE = "/tmp/json_server_bench.sock";
+constexpr auto BENCH_DURATION = std::chrono::milliseconds(1500);
+// Number of top level subtrees written by independent clients
+constexpr std::size_t NUM_SUBTREES = 64;
+
+// A server running in a forked child process.
+class ForkedServer
+{
+public:
+    explicit ForkedServer(json_server::Options options)
+    {
+        options.socket_file = BENCH_SOCK_FILE;
+        std::filesystem::remove(BENCH_SOCK_FILE);
+
+        m_pid = ::fork();
+        if (m_pid == 0)
+        {
+            json_server::init(BENCH_DATA_FILE, options);
+            while (true)
+            {
+                ::pause();
+            }
+        }
+
+        // Wait until the server accepts connections
+        while (true)
+        {
+            try
+            {
+                client("/basic/int", false, BENCH_SOCK_FILE);
+                return;
+            }
+            catch (const json_server::RuntimeException &)
+            {
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            }
+        }
+    }
+    ForkedServer(const ForkedServer &) = delete;
+    ForkedServer &operator=(const ForkedServer &) = delete;
+    ~ForkedServer()
+    {
+        ::kill(m_pid, SIGKILL);
+        ::waitpid(m_pid, nullptr, 0);
+    }
+
+    // Read a field (e.g. "VmRSS" or "Threads") from the server process status.
+    [[nodiscard]] std::string status(const std::string_view field) const
+    {
+        std::ifstream fs(fmt::format("/proc/{}/status", m_pid));
+        std::string line;
+        while (std::getline(fs, line))
+        {
+            if (line.rfind(field, 0) == 0)
+            {
+                const auto pos = line.find_first_not_of(" \t", field.size() + 1);
+                return line.substr(pos);
+            }
+        }
+        return "?";
+    }
+
+private:
+    pid_t m_pid{-1};
+};
+
+// Body of a benchmark client thread: runs operations until `stop` is set and returns the number of operations.
+using client_body = std::function<uint64_t(const std::atomic<bool> &stop)>;
+
+// Run `body` on `num_clients` threads concurrently and return the total throughput in operations per second.
+double measure(const std::size_t num_clients, const client_body &body)
+{
+    std::atomic<bool> stop{false};
+    std::atomic<uint64_t> total_ops{0};
+    std::vector<std::thread> threads;
+
+    const auto start = std::chrono::steady_clock::now();
+    for (std::size_t i = 0; i < num_clients; ++i)
+    {
+        threads.emplace_back([&]() { total_ops += body(stop); });
+    }
+    std::this_thread::sleep_for(BENCH_DURATION);
+    stop = true;
+    for (auto &thr: threads)
+    {
+        thr.join();
+    }
+    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    return static_cast<double>(total_ops) / elapsed.count();
+}
+
+void report(const std::string_view scenario, const std::string_view config, const std::size_t num_clients,
+            const double ops_per_sec)
+{
+    fmt::print("{:<28} {:<24} {:>5} clients {:>12.0f} ops/s\n", scenario, config, num_clients, ops_per_sec);
+}
+
+void write_bench_data()
+{
+    nlohmann::json data;
+    data["basic"]["int"] = 3;
+    data["basic"]["string"] = "DEBUG";
+    for (std::size_t i = 0; i < NUM_SUBTREES; ++i)
+    {
+        data[fmt::format("subtree{}", i)]["int"] = 0;
+    }
+    std::ofstream(BENCH_DATA_FILE) << data;
+}
+
+//
+// Scenarios
+//
+
+// Short-lived endpoints: connect, get a scalar, close.
+uint64_t connect_get_close(const std::atomic<bool> &stop)
+{
+    uint64_t ops = 0;
+    while (!stop)
+    {
+        [[maybe_unused]] volatile auto val = client("/basic/int", false, BENCH_SOCK_FILE).get<int64_t>();
+        ++ops;
+    }
+    return ops;
+}
+
+// Short-lived endpoints on pooled connections: borrow a connection, get a scalar, return it.
+uint64_t pooled_get(const std::atomic<bool> &stop)
+{
+    auto &pool = json_client::ConnectionPool::shared(BENCH_SOCK_FILE);
+    uint64_t ops = 0;
+    while (!stop)
+    {
+        [[maybe_unused]] volatile auto val = pool.endpoint("/basic/int").get<int64_t>();
+        ++ops;
+    }
+    return ops;
+}
+
+// Long-lived endpoint: get a scalar in a loop.
+uint64_t persistent_get(const std::atomic<bool> &stop)
+{
+    auto endpoint = client("/basic/int", false, BENCH_SOCK_FILE);
+    uint64_t ops = 0;
+    while (!stop)
+    {
+        [[maybe_unused]] volatile auto val = endpoint.get<int64_t>();
+        ++ops;
+    }
+    return ops;
+}
+
+// Long-lived endpoints on the same path: 95% gets, 5% sets.
+uint64_t mixed_get_set(const std::atomic<bool> &stop)
+{
+    auto endpoint = client("/basic/int", false, BENCH_SOCK_FILE);
+    uint64_t ops = 0;
+    while (!stop)
+    {
+        if (ops % 20 == 19)
+        {
+            endpoint.set(static_cast<int64_t>(ops));
+        }
+        else
+        {
+            [[maybe_unused]] volatile auto val = endpoint.get<int64_t>();
+        }
+        ++ops;
+    }
+    return ops;
+}
+
+// Long-lived endpoints, each setting a scalar in its own top level subtree.
+uint64_t disjoint_set(const std::atomic<bool> &stop)
+{
+    static std::atomic<std::size_t> next_subtree{0};
+    auto endpoint = client(fmt::format("/subtree{}/int", next_subtree++ % NUM_SUBTREES), false, BENCH_SOCK_FILE);
+    uint64_t ops = 0;
+    while (!stop)
+    {
+        endpoint.set(static_cast<int64_t>(ops));
+        ++ops;
+    }
+    return ops;
+}
+
+// Shared counter incremented under the client lock: lock, get, set, unlock.
+uint64_t locked_increment(const std::atomic<bool> &stop)
+{
+    auto endpoint = client("/basic/int", false, BENCH_SOCK_FILE);
+    uint64_t ops = 0;
+    while (!stop)
+    {
+        endpoint.lock();
+        endpoint.set(endpoint.get<int64_t>() + 1);
+        endpoint.unlock();
+        ++ops;
+    }
+    return ops;
+}
+
+// Shared counter incremented by the server in one request.
+uint64_t atomic_increment(const std::atomic<bool> &stop)
+{
+    auto endpoint = client("/basic/int", false, BENCH_SOCK_FILE);
+    uint64_t ops = 0;
+    while (!stop)
+    {
+        endpoint.fetch_add<int64_t>(1);
+        ++ops;
+    }
+    return ops;
+}
+
+// Consistent read of a subtree under a lock of `mode`: lock, get, unlock.
+client_body locked_get(const details::lock_mode mode)
+{
+    return [mode](const std::atomic<bool> &stop)
+    {
+        auto endpoint = client("/basic", false, BENCH_SOCK_FILE);
+        auto value = client("/basic/int", false, BENCH_SOCK_FILE);
+        uint64_t ops = 0;
+        while (!stop)
+        {
+            endpoint.lock(mode);
+            static_cast<void>(value.get<int64_t>());
+            endpoint.unlock();
+            ++ops;
+        }
+        return ops;
+    };
+}
+
+// Shared counter incremented with an optimistic transaction: get, then set if unchanged, retried on conflicts.
+uint64_t transaction_increment(const std::atomic<bool> &stop)
+{
+    auto endpoint = client("/basic/int", false, BENCH_SOCK_FILE);
+    json_client::Transaction transaction(BENCH_SOCK_FILE);
+    uint64_t ops = 0;
+    while (!stop)
+    {
+        const auto value = endpoint.get<int64_t>();
+        transaction.clear();
+        transaction.check_equals("/basic/int", value);
+        transaction.set("/basic/int", value + 1);
+        if (transaction.commit())
+        {
+            ++ops;
+        }
+    }
+    return ops;
+}
+
+// Long-lived pipeline: get a scalar in a loop with up to `depth` requests in flight.
+client_body pipelined_get(const std::size_t depth)
+{
+    return [depth](const std::atomic<bool> &stop)
+    {
+        json_client::Pipeline pipeline(BENCH_SOCK_FILE);
+        uint64_t ops = 0;
+        while (!stop)
+        {
+            while (pipeline.in_flight() < depth)
+            {
+                pipeline.get("/basic/int");
+            }
+            pipeline.receive();
+            [[maybe_unused]] volatile auto val = pipeline.result<int64_t>();
+            ++ops;
+        }
+        while (pipeline.in_flight() > 0)
+        {
+            pipeline.receive();
+        }
+        return ops;
+    };
+}
+
+void bench_worker_pool()
+{
+    std::vector<std::size_t> worker_counts{1, 4, std::max(1U, std::thread::hardware_concurrency())};
+    std::sort(worker_counts.begin(), worker_counts.end());
+    worker_counts.erase(std::unique(worker_counts.begin(), worker_counts.end()), worker_counts.end());
+
+    for (const auto workers: worker_counts)
+    {
+        json_server::Options options;
+        options.worker_threads = workers;
+        const ForkedServer server(options);
+
+        const auto config = fmt::format("{} workers", workers);
+        for (const std::size_t clients: {1, 4, 16, 64})
+        {
+            report("connect+get+close", config, clients, measure(clients, connect_get_close));
+        }
+        for (const std::size_t clients: {1, 4, 16, 64})
+        {
+            report("get", config, clients, measure(clients, persistent_get));
+        }
+    }
+}
+
+// Throughput of a few busy clients while many other connections are idle.
+void bench_idle_connections()
+{
+    json_server::Options options;
+    const ForkedServer server(options);
+
+    std::vector<client> idle;
+    for (const std::size_t num_idle: {0, 1000, 5000})
+    {
+        while (idle.size() < num_idle)
+        {
+            idle.emplace_back("/basic/int", false, BENCH_SOCK_FILE);
+        }
+        const auto config = fmt::format("{} idle connections", num_idle);
+        report("get", config, 4, measure(4, persistent_get));
+        fmt::print("{:<28} {:<24} server RSS {}, threads {}\n", "", "", server.status("VmRSS"),
+                   server.status("Threads"));
+    }
+}
+
+// Throughput of the I/O backends.
+void bench_io_backends()
+{
+    for (const auto backend: {json_server::io_backend::epoll, json_server::io_backend::io_uring})
+    {
+        json_server::Options options;
+        options.backend = backend;
+        const ForkedServer server(options);
+
+        const auto *const config = backend == json_server::io_backend::epoll ? "epoll" : "io_uring";
+        for (const std::size_t clients: {1, 4, 16, 64})
+        {
+            report("get", config, clients, measure(clients, persistent_get));
+        }
+    }
+}
+
+// Throughput of a single connection and of a few ones versus the number of requests in flight per connection.
+void bench_pipelining()
+{
+    json_server::Options options;
+    const ForkedServer server(options);
+
+    for (const std::size_t clients: {1, 4})
+    {
+        for (const std::size_t depth: {1, 2, 4, 8, 16, 32, 64, 128})
+        {
+            report("get (pipelined)", fmt::format("depth {}", depth), clients, measure(clients, pipelined_get(depth)));
+        }
+    }
+}
+
+// One-shot gets with a new connection each and with pooled connections.
+void bench_connection_pool()
+{
+    json_server::Options options;
+    const ForkedServer server(options);
+
+    for (const std::size_t clients: {1, 4, 16, 64})
+    {
+        report("one-shot get", "new connection", clients, measure(clients, connect_get_close));
+        report("one-shot get", "connection pool", clients, measure(clients, pooled_get));
+    }
+}
+
+// Clients with a connection each versus clients sharing a single session.
+void bench_session()
+{
+    json_server::Options options;
+    const ForkedServer server(options);
+
+    for (const std::size_t clients: {1, 4, 16, 64})
+    {
+        report("get", "connection per client", clients, measure(clients, persistent_get));
+
+        json_client::Session session(BENCH_SOCK_FILE);
+        const auto endpoint = session.endpoint("/basic/int");
+        const auto shared_get = [&endpoint](const std::atomic<bool> &stop)
+        {
+            uint64_t ops = 0;
+            while (!stop)
+            {
+                [[maybe_unused]] volatile auto val = endpoint.get<int64_t>();
+                ++ops;
+            }
+            return ops;
+        };
+        report("get", "shared session", clients, measure(clients, shared_get));
+    }
+}
+
+// A counter shared by all clients, incremented under the client lock versus with a transaction or fetch_add.
+void bench_counter()
+{
+    json_server::Options options;
+    const ForkedServer server(options);
+
+    for (const std::size_t clients: {1, 4, 16})
+    {
+        report("increment", "lock, get, set, unlock", clients, measure(clients, locked_increment));
+        report("increment", "get, transaction", clients, measure(clients, transaction_increment));
+        report("increment", "fetch_add", clients, measure(clients, atomic_increment));
+    }
+}
+
+// Readers locking the same subtree in exclusive versus shared mode.
+void bench_locks()
+{
+    json_server::Options options;
+    const ForkedServer server(options);
+
+    for (const std::size_t clients: {1, 4, 16})
+    {
+        report("locked get", "exclusive", clients, measure(clients, locked_get(details::lock_mode::exclusive)));
+        report("locked get", "shared", clients, measure(clients, locked_get(details::lock_mode::shared)));
+    }
+}
+
+// Writers of disjoint subtrees while a client watches the whole model: keeping up, rate limited or never reading.
+void bench_watch()
+{
+    constexpr std::size_t NUM_WRITERS = 4;
+    json_server::Options options;
+    const ForkedServer server(options);
+
+    report("set", "no watcher", NUM_WRITERS, measure(NUM_WRITERS, disjoint_set));
+    for (const auto min_interval: {std::chrono::microseconds(0), std::chrono::microseconds(1000)})
+    {
+        std::atomic<uint64_t> num_notifications{0};
+        json_client::AsyncConnection watcher(BENCH_SOCK_FILE);
+        watcher.watch_version(
+            "", [&num_notifications](json_server::error_code, uint64_t) { ++num_notifications; }, min_interval);
+        const auto config = fmt::format("watcher, {} us interval", min_interval.count());
+        report("set", config, NUM_WRITERS, measure(NUM_WRITERS, disjoint_set));
+        fmt::print("{:<28} {:<24} {} notifications\n", "", "", num_notifications.load());
+    }
+
+    // The server holds back the notifications of a client which does not read instead of buffering all of them
+    fmt::print("{:<28} {:<24} server RSS {}\n", "", "", server.status("VmRSS"));
+    json_client::AsyncConnection stalled(BENCH_SOCK_FILE, details::transport::stream, false);
+    stalled.watch_version("", [](json_server::error_code, uint64_t) {});
+    report("set", "stalled watcher", NUM_WRITERS, measure(NUM_WRITERS, disjoint_set));
+    fmt::print("{:<28} {:<24} server RSS {}\n", "", "", server.status("VmRSS"));
+}
+
+// Contention on the model with a read-mostly workload.
+void bench_read_write_mix()
+{
+    json_server::Options options;
+    const ForkedServer server(options);
+
+    for (const std::size_t clients: {1, 4, 16, 64})
+    {
+        report("95% get / 5% set", "default", clients, measure(clients, mixed_get_set));
+    }
+}
+
+// Writers of disjoint subtrees with a single model lock and with lock striping per top level key.
+void bench_lock_striping()
+{
+    for (const std::size_t depth: {0, 1})
+    {
+        json_server::Options options;
+        options.lock_stripe_depth = depth;
+        const ForkedServer server(options);
+
+        const auto config = fmt::format("stripe depth {}", depth);
+        for (const std::size_t clients: {1, 4, 16, 64})
+        {
+            report("set (disjoint subtrees)", config, clients, measure(clients, disjoint_set));
+        }
+    }
+}
+
+// Microbenchmark of server side path lookups: nlohmann::json with a parsed JSON pointer (as the server used to look up
+// paths), the path index and resolved path handles. Every level of the model has 32 members.
+void bench_path_lookup()
+{
+    constexpr std::size_t MAX_DEPTH = 20;
+    constexpr std::size_t NUM_MEMBERS = 32;
+    constexpr uint32_t ITERS = 200000;
+
+    nlohmann::json doc = 0;
+    for (std::size_t depth = 0; depth < MAX_DEPTH; ++depth)
+    {
+        nlohmann::json level;
+        for (std::size_t i = 0; i < NUM_MEMBERS; ++i)
+        {
+            level[fmt::format("member{:02}", i)] = i;
+        }
+        level["member17"] = std::move(doc);
+        doc = std::move(level);
+    }
+    json_server::impl::Model model;
+    model.reset(doc, 1);
+
+    const auto time_per_lookup = [](const auto &lookup)
+    {
+        const auto start = std::chrono::steady_clock::now();
+        for (uint32_t i = 0; i < ITERS; ++i)
+        {
+            lookup();
+        }
+        const std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+        return elapsed.count() / ITERS;
+    };
+
+    std::string path;
+    for (std::size_t depth = 1; depth <= MAX_DEPTH; ++depth)
+    {
+        path += "/member17";
+        json_server::impl::PathHandle handle(path);
+        const auto root = model.snapshot();
+
+        const auto json_ns = time_per_lookup(
+            [&]() { [[maybe_unused]] volatile const auto *ptr = &doc.at(nlohmann::json_pointer<std::string>(path)); });
+        const auto index_ns = time_per_lookup([&]() { [[maybe_unused]] volatile auto node = model.find(path).get(); });
+        const auto handle_ns = time_per_lookup([&]() { [[maybe_unused]] volatile auto *node = &handle.find(*root); });
+        fmt::print("{:<28} {:<24} json_pointer {:>7.0f} ns, index {:>5.0f} ns, handle {:>5.0f} ns\n", "path lookup",
+                   fmt::format("depth {}", depth), json_ns, index_ns, handle_ns);
+    }
+}
+
+// Scaling of the sharded event loops with the number of cores.
+void bench_scaling()
+{
+    const std::size_t num_cores = std::max(1U, std::thread::hardware_concurrency());
+    std::vector<std::size_t> worker_counts;
+    for (std::size_t workers = 1; workers < num_cores; workers *= 2)
+    {
+        worker_counts.push_back(workers);
+    }
+    worker_counts.push_back(num_cores);
+
+    for (const auto backend: {json_server::io_backend::epoll, json_server::io_backend::io_uring})
+    {
+        for (const auto workers: worker_counts)
+        {
+            json_server::Options options;
+            options.backend = backend;
+            options.worker_threads = workers;
+            const ForkedServer server(options);
+
+            const auto config = fmt::format("{} x {}", workers,
+                                            backend == json_server::io_backend::epoll ? "epoll" : "io_uring");
+            for (const std::size_t clients: {64, 256})
+            {
+                report("get", config, clients, measure(clients, persistent_get));
+            }
+        }
+    }
+}
+
+} // namespace
+
+
+int main()
+{
+    // Lots of idle connections need lots of file descriptors
+    rlimit limit{};
+    ::getrlimit(RLIMIT_NOFILE, &limit);
+    limit.rlim_cur = limit.rlim_max;
+    ::setrlimit(RLIMIT_NOFILE, &limit);
+
+    write_bench_data();
+    bench_path_lookup();
+    bench_worker_pool();
+    bench_idle_connections();
+    bench_io_backends();
+    bench_scaling();
+    bench_pipelining();
+    bench_session();
+    bench_connection_pool();
+    bench_watch();
+    bench_counter();
+    bench_locks();
+    bench_read_write_mix();
+    bench_lock_striping();
+    return 0;
+}
@@ -0,0 +1,163 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "sockpp/unix_stream_socket.h"
+
+#include "model.hpp"
+#include "ring_queue.hpp"
+
+
+namespace json_server::impl
+{
+
+// A non-blocking client connection on the server.
+// Incoming bytes are assembled into request frames (4 byte size prefix followed by the payload), which are queued
+// and processed strictly in order by at most one thread at a time. Outgoing frames are either written right away
+// without blocking (remaining bytes are flushed by the reactor once the socket becomes writable again), or collected
+// for an I/O engine that writes them itself (see `defer_writes`).
+// Request and output buffers are recycled, so that serving a connection in steady state does not allocate.
+// Seqpacket sockets are served like streams: datagrams are consecutive chunks of bytes, only their size is limited.
+class Connection : public std::enable_shared_from_this<Connection>
+{
+public:
+    // Called when a connection with deferred writes has new output and no write is scheduled yet.
+    using write_scheduler = std::function<void(std::shared_ptr<Connection> conn)>;
+    // Called to get the requests of a paused connection processed again.
+    using resume_scheduler = std::function<void(std::shared_ptr<Connection> conn)>;
+
+    explicit Connection(sockpp::unix_socket socket);
+    Connection(const Connection &) = delete;
+    Connection(Connection &&) = delete;
+    Connection &operator=(const Connection &) = delete;
+    Connection &operator=(Connection &&) = delete;
+    // Calls the callbacks registered with `on_close`
+    ~Connection();
+
+    [[nodiscard]] int handle() const noexcept
+    {
+        return m_socket.handle();
+    }
+
+    // Largest number of bytes to write with a single call, limited for sockets which keep message boundaries
+    [[nodiscard]] std::size_t max_write_size() const noexcept
+    {
+        return m_max_write_size;
+    }
+
+    // Register the epoll instance watching this connection (used to request writability notifications).
+    void attach(int epoll_fd) noexcept;
+    // Let an I/O engine write all output instead of the sending threads.
+    void defer_writes(write_scheduler scheduler);
+    // Let an I/O engine resume processing the requests of this connection on its own thread (see `resume`).
+    void defer_resume(resume_scheduler scheduler);
+
+    // Read all available bytes from the socket and queue completed request frames. `must_process` is set if the
+    // connection has queued requests and is not scheduled yet. Returns false if the peer closed the connection or the
+    // socket failed.
+    bool receive(bool &must_process);
+    // Queue the completed request frames within `size` received bytes. Partial frames are kept until the remaining
+    // bytes arrive. Returns true if the connection is not scheduled yet and must be processed.
+    bool consume(const uint8_t *data, std::size_t size);
+
+    // Take the next queued request. If there is none, the connection is unscheduled and false is returned. The
+    // previous contents of `request` are recycled for later requests.
+    bool pop_request(std::vector<uint8_t> &request);
+    // Hand the connection, whose processing some other thread paused, back to its I/O engine to process the
+    // remaining requests (thread-safe). Returns false if there is no engine doing so, the caller has to then.
+    bool resume();
+
+    // Send a message framed with its size (thread-safe).
+    void send(const uint8_t *payload, std::size_t size);
+    // Send a message which `write_payload` appends to the output buffer passed to it, framed with its size
+    // (thread-safe). Nothing is sent if `write_payload` throws.
+    template <typename PayloadWriter>
+    void send(PayloadWriter &&write_payload)
+    {
+        std::unique_lock lock(m_send_mutex);
+        const auto frame_start = m_send_buffer.size();
+        m_send_buffer.resize(frame_start + sizeof(uint32_t));
+        try
+        {
+            write_payload(m_send_buffer);
+        }
+        catch (...)
+        {
+            m_send_buffer.resize(frame_start);
+            throw;
+        }
+        finish_frame(lock, frame_start);
+    }
+    // Number of bytes sent but not written to the socket yet (thread-safe).
+    [[nodiscard]] std::size_t pending_output();
+    // Hold back writing replies until `uncork`, so that the replies to a batch of requests are written together.
+    void cork();
+    // Write the replies held back since `cork`.
+    void uncork();
+    // Continue writing pending data after the socket became writable (called by the reactor).
+    void flush();
+    // Move all pending output to `out` (called by the I/O engine for deferred writes). Returns false if there is
+    // none, which ends the scheduled write.
+    bool take_output(std::vector<uint8_t> &out);
+
+    // Paths resolved by the client, indexed by their handle. Only accessed while processing the client's requests.
+    [[nodiscard]] std::vector<PathHandle> &path_handles() noexcept
+    {
+        return m_path_handles;
+    }
+
+    // Call `callback` when the connection is destroyed, after its last request was processed. Only called while
+    // processing the client's requests.
+    void on_close(std::function<void(const Connection &conn)> callback);
+
+    // Shut the connection down after pending output was sent. Queued requests are dropped and the I/O engine
+    // releases the connection on the resulting hangup.
+    void shutdown();
+
+private:
+    sockpp::unix_socket m_socket;
+    int m_epoll_fd{-1};
+    std::size_t m_max_write_size{SIZE_MAX};
+
+    // Receive state, only accessed by the I/O thread
+    std::array<uint8_t, sizeof(uint32_t)> m_size_buffer{};
+    std::size_t m_size_received{0};
+    std::vector<uint8_t> m_payload{};
+    std::size_t m_payload_received{0};
+
+    // Queued requests and whether some thread currently processes them
+    std::mutex m_request_mutex{};
+    RingQueue<std::vector<uint8_t>> m_requests{};
+    bool m_is_scheduled{false};
+    bool m_is_shut_down{false};
+    resume_scheduler m_resume_scheduler{};
+
+    // Pending output
+    std::mutex m_send_mutex{};
+    std::vector<uint8_t> m_send_buffer{};
+    std::size_t m_send_offset{0};
+    bool m_wants_write{false};
+    bool m_is_corked{false};
+    bool m_shutdown_pending{false};
+    write_scheduler m_write_scheduler{};
+    bool m_is_write_scheduled{false};
+
+    std::vector<PathHandle> m_path_handles{};
+    std::vector<std::function<void(const Connection &conn)>> m_close_callbacks{};
+
+    // Fill in the size of the frame at `frame_start` in the output buffer and get it written. `lock` holds
+    // m_send_mutex and may be released.
+    void finish_frame(std::unique_lock<std::mutex> &lock, std::size_t frame_start);
+    // Write pending output until done or the socket would block. Must be called with m_send_mutex held.
+    void write_pending();
+    // Enable or disable writability notifications of the reactor.
+    void watch_writable(bool enable);
+};
+
+} // namespace json_server::impl
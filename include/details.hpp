@@ -1,12 +1,17 @@
 #pragma once
 
 #include <array>
+#include <cerrno>
+#include <cstddef>
 #include <cstdint>
 #include <cstring>
 #include <string>
 #include <string_view>
 #include <vector>
 
+#include <sys/socket.h>
+#include <sys/uio.h>
+
 #include "exceptions.hpp"
 
 
@@ -18,13 +23,155 @@ enum class request_cmd : uint8_t
     read,
     write,
     lock,
-    unlock
+    unlock,
+    // Resolve the path to a handle, which later requests may send instead of the path
+    resolve,
+    // Execute several get and set operations on arbitrary paths as one atomic step
+    batch,
+    // Subscribe to changes of the subtree at the path, see REPLY_FLAG_NOTIFICATION
+    watch,
+    // Remove the subscription whose ID is the value of the request
+    unwatch,
+    // Apply a read-modify-write operation (see update_op) to the value at the path as one atomic step
+    update,
+    // Apply several sets on arbitrary paths as one atomic step if all preconditions (see transaction_check) hold
+    transaction,
+    // Extend the lease of the lock on the path held by the client
+    renew
+};
+
+// Operations of a batch request
+enum class batch_op : uint8_t
+{
+    get,
+    set
+};
+
+// Read-modify-write operations of an update request
+enum class update_op : uint8_t
+{
+    // Add the operand to a number
+    fetch_add,
+    // Subtract the operand from a number
+    fetch_sub,
+    // Replace a number by the operand if that is smaller
+    fetch_min,
+    // Replace a number by the operand if that is larger
+    fetch_max,
+    // Replace any value by the operand
+    exchange,
+    // Replace any value by the desired one if it equals the expected one (the operand)
+    compare_exchange
+};
+
+// Modes of lock requests. A lock covers the subtree at its path: it conflicts with exclusive locks on the path, its
+// ancestors and its descendants, exclusive locks also with shared ones.
+enum class lock_mode : uint8_t
+{
+    exclusive,
+    shared
+};
+
+// Preconditions of a transaction request
+enum class transaction_check : uint8_t
+{
+    // The path exists
+    exists,
+    // The value at the path equals the given one
+    equals,
+    // The subtree at the path has the given version, 0 if the path must not exist
+    version
 };
 
 
 const std::string_view DEFAULT_SOCK_FILE = "/tmp/json_server.sock";
 
 
+// Socket types clients and server communicate over
+enum class transport : uint8_t
+{
+    // Byte stream (SOCK_STREAM)
+    stream,
+    // Sequenced datagrams (SOCK_SEQPACKET), which keep message boundaries: a request or reply up to
+    // MAX_DATAGRAM_SIZE is sent and received with a single call. Larger ones are split into several datagrams and
+    // reassembled by their size information, just like on a stream.
+    seqpacket
+};
+
+// Largest datagram sent on seqpacket sockets; receivers provide at least this much room for every datagram
+constexpr std::size_t MAX_DATAGRAM_SIZE = 8 * 1024;
+
+// Largest number of bytes to send with a single call on a socket of type `type`.
+constexpr std::size_t max_write_size(const transport type)
+{
+    return type == transport::seqpacket ? MAX_DATAGRAM_SIZE : SIZE_MAX;
+}
+
+// SOCK_SEQPACKET or SOCK_STREAM
+constexpr int socket_type(const transport type)
+{
+    return type == transport::seqpacket ? SOCK_SEQPACKET : SOCK_STREAM;
+}
+
+
+// Binary protocol: every request starts with a RequestHeader, followed by the path (or handle) bytes and the msgpack
+// encoded value of write requests. Every reply starts with a ReplyHeader, followed by a msgpack encoded value if the
+// reply carries one. Batch requests carry no path; their value is an array of [op, path] (get) and [op, path, value]
+// (set) items, the value of their reply an array of [err_code, value] pairs, one per item. Clients of the original
+// protocol send msgpack maps {"cmd", "path", "value"} instead, which the server tells apart by the first byte and
+// answers with msgpack maps {"err_code", "value"}.
+// The value of update requests is the array [op, operand] ([op, expected, desired] for compare_exchange), the value of
+// their reply [changed, previous value], where `changed` tells whether the value was replaced.
+// The optional value of lock requests is the lock_mode, exclusive if there is none, or the array [mode, timeout] with
+// the microseconds to wait for a contended lock before failing with error_code::timeout.
+// Transaction requests carry no path either; their value is the array [checks, sets] of [op, path] (exists) and
+// [op, path, value or version] checks and [path, value] sets, the value of their reply [failed, versions]: the index
+// of the first failed check or nil if the sets took effect, and the versions of the checked paths before the sets.
+// Clients may send further requests before the replies to earlier ones arrived (pipelining). The server processes the
+// requests of a connection in order and replies in the same order; every reply carries the request ID of its request.
+// After a watch request, the server pushes notifications in between the replies whenever a write changed the watched
+// subtree: the request ID of the watch request identifies the subscription, the value is the array [version, value]
+// with the subtree version and the current value of the subtree ([version] only for REQUEST_FLAG_VERSION_ONLY). The
+// optional value of a watch request is the minimum interval between notifications in microseconds.
+// Notifications of a subtree which no longer exists carry the error json_path_error and the array [version].
+// Note: No need to take care of byte ordering here, since all communication is local only
+
+// First byte of binary frames; never used in msgpack, so it cannot start a msgpack map
+constexpr uint8_t PROTOCOL_MAGIC = 0xc1;
+constexpr uint8_t PROTOCOL_VERSION = 2;
+
+// Request flag: the path bytes hold a 64 bit handle resolved before instead of a path
+constexpr uint8_t REQUEST_FLAG_HANDLE = 0x01;
+// Request flag of watch requests: notifications carry the subtree version only, not the value
+constexpr uint8_t REQUEST_FLAG_VERSION_ONLY = 0x02;
+// Reply flag: a msgpack encoded value follows the header
+constexpr uint8_t REPLY_FLAG_VALUE = 0x01;
+// Reply flag: the frame is a notification of a subscription instead of a reply
+constexpr uint8_t REPLY_FLAG_NOTIFICATION = 0x02;
+
+struct RequestHeader
+{
+    uint8_t magic{PROTOCOL_MAGIC};
+    uint8_t version{PROTOCOL_VERSION};
+    request_cmd cmd{};
+    uint8_t flags{0};
+    uint32_t path_size{0};
+    // Chosen by the client, echoed in the reply
+    uint32_t request_id{0};
+};
+static_assert(sizeof(RequestHeader) == 12, "RequestHeader must not contain padding");
+
+struct ReplyHeader
+{
+    uint8_t magic{PROTOCOL_MAGIC};
+    uint8_t version{PROTOCOL_VERSION};
+    json_server::error_code err_code{json_server::error_code::none};
+    uint8_t flags{0};
+    uint32_t request_id{0};
+};
+static_assert(sizeof(ReplyHeader) == 8, "ReplyHeader must not contain padding");
+
+
 // Send size information struct via some socket type (both client and server).
 template <typename T>
 void transmit_size_info(T &socket, const uint32_t payload_size)
@@ -41,6 +188,73 @@ void transmit_size_info(T &socket, const uint32_t payload_size)
     }
 }
 
+// Send a message framed with its size via some socket type (both client and server). The size information and all
+// `parts` of the payload are written with a single scatter-gather call, unless the socket takes only some of them or
+// the frame is larger than `max_size` (see max_write_size).
+template <typename T, std::size_t N>
+void transmit_frame(T &socket, const std::array<iovec, N> &parts, const std::size_t max_size = SIZE_MAX)
+{
+    // Note: No need to take care of byte ordering here, since all communication is local only
+    uint32_t sz{0};
+    std::array<iovec, N + 1> ranges{};
+    ranges[0] = {&sz, sizeof(uint32_t)};
+    for (std::size_t i = 0; i < N; ++i)
+    {
+        ranges[i + 1] = parts[i];
+        sz += static_cast<uint32_t>(parts[i].iov_len);
+    }
+
+    auto *next = ranges.data();
+    auto *const end = ranges.data() + ranges.size();
+    while (next != end)
+    {
+        // Send the ranges up to `max_size` bytes, the last one of them possibly cut short
+        msghdr msg{};
+        msg.msg_iov = next;
+        std::size_t size = 0;
+        iovec *last = next;
+        for (; last != end && size + last->iov_len <= max_size; ++last)
+        {
+            size += last->iov_len;
+        }
+        std::size_t cut_len = 0;
+        if (last != end && size < max_size)
+        {
+            cut_len = last->iov_len;
+            last->iov_len = max_size - size;
+            ++last;
+        }
+        msg.msg_iovlen = static_cast<std::size_t>(last - next);
+        const auto ret = ::sendmsg(socket.handle(), &msg, MSG_NOSIGNAL);
+        if (cut_len != 0)
+        {
+            (last - 1)->iov_len = cut_len;
+        }
+        if (ret < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            throw json_server::InternalException(lh::nostd::source_location::current(), "write failed: {}, {}", errno,
+                                                 std::strerror(errno));
+        }
+
+        // Skip the ranges written completely and continue within the first partially written one
+        auto num_written = static_cast<std::size_t>(ret);
+        while (next != end && num_written >= next->iov_len)
+        {
+            num_written -= next->iov_len;
+            ++next;
+        }
+        if (next != end)
+        {
+            next->iov_base = static_cast<uint8_t *>(next->iov_base) + num_written;
+            next->iov_len -= num_written;
+        }
+    }
+}
+
 // Read size information from some socket type (both client and server). Returns 0 when endpoint is closed.
 template <typename T>
 [[nodiscard]] uint32_t receive_size_info(T &socket)
@@ -124,7 +124,13 @@ enum class error_code : uint8_t
     socket_error,
     type_error,
     json_path_error,
-    lock
+    lock,
+    // Malformed or unknown request, e.g. of an unsupported protocol version
+    protocol,
+    // A lock request was refused since waiting for it would deadlock
+    deadlock,
+    // A lock request was not granted in time
+    timeout
 };
 
 // Main exception class with an error code for all public API errors.
@@ -1,10 +1,23 @@
 #pragma once
 
 #include <filesystem>
+#include <optional>
 #include <variant>
 #include <string>
+#include <string_view>
+#include <array>
+#include <chrono>
+#include <cstddef>
 #include <cstdint>
 #include <algorithm>
+#include <functional>
+// For the futures returned by AsyncConnection
+#include <future>
+#include <memory>
+#include <tuple>
+#include <utility>
+#include <type_traits>
+#include <vector>
 
 #include "details.hpp"
 
@@ -38,46 +51,24 @@ namespace impl
     {
     };
 
-} // namespace impl
-
-// A connection to the model server.
-class EndpointConnection
-{
-public:
-    /* Connect to a resource on the JSON server at `resource_path`.
-     * If `exclusive` is set to true, lock the resource on the server for exclusive access until
-     * either `unlock()` is called explicitely or the object goes out of scope.
-     */
-    explicit EndpointConnection(const std::string &resource_path, const bool exclusive = false,
-                                const std::filesystem::path &socket_file = details::DEFAULT_SOCK_FILE);
-    EndpointConnection(const EndpointConnection &) = delete;
-    EndpointConnection(EndpointConnection &&) = default;
-    EndpointConnection &operator=(const EndpointConnection &) = delete;
-    EndpointConnection &operator=(EndpointConnection &&) = default;
-    ~EndpointConnection();
-
-    // Lock the resource on the server.
-    void lock();
-    // Unlock the resource on the server.
-    void unlock();
-
-    // Retrieve some value from the model.
-    template <typename T>
-    T get()
+    // Convert a value read from the server for `path` to `T`. `get_basic` and `get_array` fetch the value as basic
+    // type or as array, depending on `T`.
+    template <typename T, typename GetBasic, typename GetArray>
+    T get_as(const std::string &path, GetBasic &&get_basic, GetArray &&get_array)
     {
-        if constexpr (impl::is_std_vector<T>::value)
+        if constexpr (is_std_vector<T>::value)
         {
             // If we need to return a vector ...
             using vec_t = typename T::value_type;
             if constexpr (std::is_same_v<vec_t, types::BasicType>)
             {
                 // ... of heterogenous types
-                return get_impl_array();
+                return get_array();
             }
             else
             {
                 // ... of homogenous types
-                const auto j_vec = get_impl_array();
+                const auto j_vec = get_array();
 
                 std::vector<vec_t> ret;
                 ret.resize(j_vec.size());
@@ -90,27 +81,27 @@ public:
         {
             try
             {
-                return std::get<T>(get_impl_basic());
+                return std::get<T>(get_basic());
             }
             catch (const std::bad_variant_access &)
             {
                 throw json_server::RuntimeException(json_server::error_code::type_error,
-                                                    "type error while getting element {}", m_resource_path);
+                                                    "type error while getting element {}", path);
             }
         }
     }
 
-    // Set some value in the model.
-    template <typename T>
-    void set(const T val)
+    // Pass `val` to `set_basic` as basic type or, if it is a vector, to `set_array` as array.
+    template <typename T, typename SetBasic, typename SetArray>
+    void set_as(const T &val, SetBasic &&set_basic, SetArray &&set_array)
     {
-        if constexpr (impl::is_std_vector<T>::value)
+        if constexpr (is_std_vector<T>::value)
         {
             using vec_t = typename T::value_type;
             if constexpr (std::is_same_v<vec_t, types::BasicType>)
             {
                 // Vector of heterogenous types
-                set_impl_array(val);
+                set_array(val);
             }
             else
             {
@@ -119,26 +110,218 @@ public:
                 j_vec.resize(val.size());
                 std::transform(val.begin(), val.end(), j_vec.begin(),
                                [](const auto &v) { return types::BasicType{v}; });
-                set_impl_array(j_vec);
+                set_array(j_vec);
             }
         }
         else
         {
-            set_impl_basic({val});
+            set_basic({val});
+        }
+    }
+
+    // Conversions between JSON values and our own types
+    types::BasicType json_to_basic(const nlohmann::json &j_val);
+    types::CompoundType json_to_compound(const nlohmann::json &j_val);
+
+    // Connection to the server socket, framing requests and replies. Any number of requests may be sent before
+    // receiving their replies, which arrive in the order of the requests.
+    class ServerConnection
+    {
+    public:
+        // Connect to the server at `socket_file`. Throws a RuntimeException (socket_error) on failure.
+        ServerConnection(const std::filesystem::path &socket_file, details::transport transport);
+
+        // Request ID of the next request sent, to be put into its header.
+        [[nodiscard]] uint32_t next_request_id() const noexcept
+        {
+            return m_next_request_id;
+        }
+        // Number of requests sent whose reply has not been received yet.
+        [[nodiscard]] std::size_t in_flight() const noexcept
+        {
+            return m_in_flight;
+        }
+        // Whether the last request and reply were sent and received completely, so the connection can be reused.
+        [[nodiscard]] bool is_in_step() const noexcept
+        {
+            return m_is_in_step;
+        }
+
+        // File descriptor of the socket.
+        [[nodiscard]] int handle() const noexcept
+        {
+            return m_socket.handle();
+        }
+        // Shut the socket down, which wakes up a thread waiting for a reply.
+        void shutdown() noexcept;
+
+        // Send a request made of `parts`.
+        void send(const std::array<iovec, 3> &parts);
+        // Send a binary protocol request for the command `cmd` on `path` (or on its resolved `handle`), with the value
+        // `val` for write requests.
+        void send_request(details::request_cmd cmd, std::string_view path, std::optional<uint64_t> handle,
+                          const nlohmann::json *val, uint8_t flags = 0);
+        // Wait until the next reply is buffered completely.
+        void wait_for_reply();
+        // Read what is available without blocking. Returns whether the next reply is buffered completely.
+        bool poll();
+        // Receive the reply to the oldest request in flight, consisting of an error code and some value (null if the
+        // reply has none).
+        std::tuple<json_server::error_code, nlohmann::json> receive();
+        // Whether the buffered reply is a notification of a subscription (see details::REPLY_FLAG_NOTIFICATION).
+        [[nodiscard]] bool is_notification_next() const noexcept;
+        // Receive the buffered notification, consisting of the ID of its subscription, an error code and its value.
+        std::tuple<uint32_t, json_server::error_code, nlohmann::json> receive_notification();
+
+    private:
+        static constexpr std::size_t RECEIVE_BUFFER_SIZE = 4096;
+
+        sockpp::unix_connector m_socket{};
+        // Socket type, must be the one the server listens with
+        details::transport m_transport;
+        uint32_t m_next_request_id{0};
+        std::size_t m_in_flight{0};
+        bool m_is_in_step{true};
+        // Encoded values of requests, reused for every request
+        std::vector<uint8_t> m_send_buffer{};
+        // Received bytes; the unread ones are in [m_receive_begin, m_receive_end)
+        std::vector<uint8_t> m_receive_buffer{};
+        std::size_t m_receive_begin{0};
+        std::size_t m_receive_end{0};
+
+        // Read from the server until at least `size` unread bytes are buffered.
+        void receive_at_least(std::size_t size);
+        // Read once from the server into a buffer with room for at least `size` unread bytes. Returns false if nothing
+        // was available with `flags` MSG_DONTWAIT.
+        bool read_some(std::size_t size, int flags);
+        // Number of unread bytes up to the end of the next reply, if they are more than buffered.
+        [[nodiscard]] std::size_t missing_reply_size() const noexcept;
+    };
+
+} // namespace impl
+
+class ConnectionPool;
+
+// A connection to the model server.
+class EndpointConnection
+{
+public:
+    /* Connect to a resource on the JSON server at `resource_path`.
+     * If `exclusive` is set to true, lock the resource on the server for exclusive access until
+     * either `unlock()` is called explicitely or the object goes out of scope.
+     * `transport` has to match the socket type the server listens with (see json_server::Options).
+     */
+    explicit EndpointConnection(const std::string &resource_path, const bool exclusive = false,
+                                const std::filesystem::path &socket_file = details::DEFAULT_SOCK_FILE,
+                                const details::transport transport = details::transport::stream);
+    // Access the resource at `resource_path` on a connection borrowed from `pool` (e.g. ConnectionPool::shared()),
+    // which is returned when the object goes out of scope. This saves connecting for short-lived endpoints. Locks are
+    // owned by connections, so pooled endpoints cannot lock their resource.
+    EndpointConnection(ConnectionPool &pool, const std::string &resource_path);
+    EndpointConnection(const EndpointConnection &) = delete;
+    EndpointConnection(EndpointConnection &&) = default;
+    EndpointConnection &operator=(const EndpointConnection &) = delete;
+    EndpointConnection &operator=(EndpointConnection &&) noexcept;
+    ~EndpointConnection();
+
+    // Lock the resource on the server, which covers its subtree. Shared locks of several clients may overlap,
+    // exclusive ones conflict with any other lock on the resource, the paths above it and the paths below it.
+    // The lock is owned by the connection of this endpoint, which must not be shared with others. Throws a
+    // RuntimeException (lock) for pooled endpoints.
+    void lock(details::lock_mode mode = details::lock_mode::exclusive);
+    // Like lock(), but give up if the lock is not granted within `timeout`. Returns whether the resource is locked.
+    bool try_lock(std::chrono::milliseconds timeout, details::lock_mode mode = details::lock_mode::exclusive);
+    // Extend the lease of the lock: the server releases locks which are not renewed within the lease time (see
+    // json_server::Options::lock_lease_time). Throws a RuntimeException (lock) if the lease expired already.
+    void renew();
+    // Unlock the resource on the server.
+    void unlock();
+
+    // Retrieve some value from the model.
+    template <typename T>
+    T get()
+    {
+        return impl::get_as<T>(
+            m_resource_path, [this]() { return get_impl_basic(); }, [this]() { return get_impl_array(); });
+    }
+
+    // Set some value in the model.
+    template <typename T>
+    void set(const T val)
+    {
+        impl::set_as(
+            val, [this](const types::BasicType &v) { set_impl_basic(v); },
+            [this](const types::CompoundType &v) { set_impl_array(v); });
+    }
+
+    // Atomic read-modify-write operations on a basic value, applied by the server in a single round trip without
+    // locking the resource. They return the previous value. The arithmetic ones apply to integers and floats.
+    template <typename T>
+    T fetch_add(const T operand)
+    {
+        return update<T>(details::update_op::fetch_add, operand).second;
+    }
+
+    template <typename T>
+    T fetch_sub(const T operand)
+    {
+        return update<T>(details::update_op::fetch_sub, operand).second;
+    }
+
+    template <typename T>
+    T fetch_min(const T operand)
+    {
+        return update<T>(details::update_op::fetch_min, operand).second;
+    }
+
+    template <typename T>
+    T fetch_max(const T operand)
+    {
+        return update<T>(details::update_op::fetch_max, operand).second;
+    }
+
+    template <typename T>
+    T exchange(const T val)
+    {
+        return update<T>(details::update_op::exchange, val).second;
+    }
+
+    // Replace the value by `desired` if it equals `expected`, otherwise load the current value into `expected`.
+    // Returns whether the value was replaced.
+    template <typename T>
+    bool compare_exchange(T &expected, const T desired)
+    {
+        const types::BasicType desired_val{desired};
+        auto [is_changed, previous] = update<T>(details::update_op::compare_exchange, expected, &desired_val);
+        if (!is_changed)
+        {
+            expected = std::move(previous);
         }
+        return is_changed;
     }
 
 
 private:
     std::string m_resource_path;
-    sockpp::unix_connector m_srv_con;
-    std::filesystem::path m_socket_file;
+    std::unique_ptr<impl::ServerConnection> m_server;
+    // Pool to return the connection to, if borrowed
+    ConnectionPool *m_pool{nullptr};
     bool m_is_locked;
+    // Handle of the resolved resource path, sent instead of the path with every request
+    std::optional<uint64_t> m_handle;
+    // Whether the server speaks the binary protocol, otherwise msgpack maps are sent
+    bool m_is_binary{true};
+    // Encoded values of requests, reused for every request
+    std::vector<uint8_t> m_send_buffer{};
 
-    // Send a request to the server.
-    void send_request(const nlohmann::json &req);
-    // Read server response object consisting of an error code and some value.
-    std::tuple<json_server::error_code, nlohmann::json> read_server_reply();
+    // Resolve the resource path to a handle on the server and negotiate the protocol.
+    void resolve();
+    // Throw a RuntimeException (lock) if the connection is pooled.
+    void check_lockable() const;
+    // Release the lock and the connection, if any.
+    void close() noexcept;
+    // Send a request for the command `cmd` on the resource to the server, with the value `val` for write requests.
+    void send_request(details::request_cmd cmd, const nlohmann::json *val = nullptr);
 
     // Get some JSON value from the server (implementation for nlohmann::json type).
     nlohmann::json get_impl();
@@ -153,6 +336,640 @@ private:
     void set_impl_basic(const types::BasicType &val);
     // Set some JSON array value on the server.
     void set_impl_array(const types::CompoundType &val_array);
+
+    // Apply the read-modify-write operation `op` with `operand` (and `desired` for compare_exchange). Returns whether
+    // the value was replaced and the previous value.
+    template <typename T>
+    std::pair<bool, T> update(const details::update_op op, const T &operand,
+                              const types::BasicType *desired = nullptr)
+    {
+        auto [is_changed, previous] = update_impl(op, types::BasicType{operand}, desired);
+        try
+        {
+            return {is_changed, std::get<T>(std::move(previous))};
+        }
+        catch (const std::bad_variant_access &)
+        {
+            throw json_server::RuntimeException(json_server::error_code::type_error,
+                                                "type error while updating element {}", m_resource_path);
+        }
+    }
+    std::pair<bool, types::BasicType> update_impl(details::update_op op, const types::BasicType &operand,
+                                                  const types::BasicType *desired);
+};
+
+// A connection for pipelined requests on arbitrary paths: requests are sent without waiting for the replies to the
+// ones before, which saves a round trip per request. Replies are received in the order of the requests.
+// A failed request only fails its own reply; the requests after it are still served. Pipelines offer no locks: the
+// server pauses a connection while its lock request waits, which would hold up all requests pipelined behind it.
+class Pipeline
+{
+public:
+    // Connect to the JSON server. `transport` has to match the socket type the server listens with.
+    explicit Pipeline(const std::filesystem::path &socket_file = details::DEFAULT_SOCK_FILE,
+                      const details::transport transport = details::transport::stream);
+    Pipeline(const Pipeline &) = delete;
+    Pipeline(Pipeline &&) noexcept;
+    Pipeline &operator=(const Pipeline &) = delete;
+    Pipeline &operator=(Pipeline &&) noexcept;
+    ~Pipeline();
+
+    // Send a request to read the value at `path`. Returns the request ID.
+    uint32_t get(const std::string &path);
+
+    // Send a request to set the value at `path` to `val`. Returns the request ID.
+    template <typename T>
+    uint32_t set(const std::string &path, const T val)
+    {
+        const auto request_id = m_server.next_request_id();
+        impl::set_as(
+            val, [&](const types::BasicType &v) { send_set_basic(path, v); },
+            [&](const types::CompoundType &v) { send_set_array(path, v); });
+        return request_id;
+    }
+
+    // Number of requests sent whose reply has not been received yet.
+    [[nodiscard]] std::size_t in_flight() const noexcept
+    {
+        return m_server.in_flight();
+    }
+
+    // Wait for the reply to the oldest request in flight. Returns its request ID.
+    uint32_t receive();
+
+    // Error of the last reply received.
+    [[nodiscard]] json_server::error_code error() const noexcept
+    {
+        return m_error;
+    }
+
+    // Value of the last reply received (to a get request). Throws a RuntimeException with the error of the request if
+    // it failed.
+    template <typename T>
+    T result() const
+    {
+        return impl::get_as<T>(
+            m_path, [this]() { return result_basic(); }, [this]() { return result_array(); });
+    }
+
+private:
+    struct State;
+
+    impl::ServerConnection m_server;
+    // Paths of the requests in flight
+    std::unique_ptr<State> m_state;
+    // Last reply received
+    std::string m_path{};
+    json_server::error_code m_error{json_server::error_code::none};
+    std::unique_ptr<nlohmann::json> m_value;
+
+    // Send a request for the command `cmd` on `path`, with the value `val` for write requests.
+    void send_request(details::request_cmd cmd, const std::string &path, const nlohmann::json *val);
+    void send_set_basic(const std::string &path, const types::BasicType &val);
+    void send_set_array(const std::string &path, const types::CompoundType &val_array);
+
+    // Value of the last reply; throws its error if the request failed
+    [[nodiscard]] const nlohmann::json &result_impl() const;
+    [[nodiscard]] types::BasicType result_basic() const;
+    [[nodiscard]] types::CompoundType result_array() const;
+};
+
+// A connection for asynchronous requests on arbitrary paths: requests return right away, their replies complete a
+// future or call a callback later. Replies are received either by an I/O thread of the connection, which also runs the
+// callbacks, or by `process_replies` on a thread of the user, e.g. whenever an event loop finds `fd()` readable.
+// Requests may be sent from any thread. A failed request only completes with its own error; if the connection
+// closes, all requests still in flight complete with error_code::socket_error. Like other connections multiplexing
+// requests, it offers no locks (see Pipeline).
+class AsyncConnection
+{
+public:
+    // Called with the reply to a get: error and value, which is default constructed on errors.
+    template <typename T>
+    using GetCallback = std::function<void(json_server::error_code, T)>;
+    // Called with the reply to a set.
+    using SetCallback = std::function<void(json_server::error_code)>;
+    // Called with the notifications of a subscription: error, version and value of the subtree, which is default
+    // constructed on errors.
+    template <typename T>
+    using WatchCallback = std::function<void(json_server::error_code, uint64_t, T)>;
+    // Called with the notifications of a version-only subscription: error and subtree version.
+    using VersionCallback = std::function<void(json_server::error_code, uint64_t)>;
+
+    // Connect to the JSON server. `transport` has to match the socket type the server listens with. Without
+    // `io_thread`, replies are only received by calling `process_replies`.
+    explicit AsyncConnection(const std::filesystem::path &socket_file = details::DEFAULT_SOCK_FILE,
+                             const details::transport transport = details::transport::stream,
+                             const bool io_thread = true);
+    AsyncConnection(const AsyncConnection &) = delete;
+    AsyncConnection(AsyncConnection &&) = delete;
+    AsyncConnection &operator=(const AsyncConnection &) = delete;
+    AsyncConnection &operator=(AsyncConnection &&) = delete;
+    ~AsyncConnection();
+
+    // Read the value at `path` and call `callback` with it. Callbacks must not throw.
+    template <typename T>
+    void get_async(const std::string &path, GetCallback<T> callback)
+    {
+        send_request(details::request_cmd::read, path, std::nullopt, nullptr,
+                     [path, callback = std::move(callback)](json_server::error_code err, const nlohmann::json &j_val)
+                     {
+                         T val{};
+                         if (err == json_server::error_code::none)
+                         {
+                             try
+                             {
+                                 val = impl::get_as<T>(
+                                     path, [&]() { return impl::json_to_basic(j_val); },
+                                     [&]() { return impl::json_to_compound(j_val); });
+                             }
+                             catch (const std::exception &)
+                             {
+                                 err = json_server::error_code::type_error;
+                             }
+                         }
+                         callback(err, std::move(val));
+                     });
+    }
+
+    // Read the value at `path`. The future throws a RuntimeException if the request fails.
+    template <typename T>
+    std::future<T> get_async(const std::string &path)
+    {
+        auto promise = std::make_shared<std::promise<T>>();
+        auto future = promise->get_future();
+        get_async<T>(path,
+                     [promise, path](const json_server::error_code err, T val)
+                     {
+                         if (err != json_server::error_code::none)
+                         {
+                             promise->set_exception(std::make_exception_ptr(
+                                 json_server::RuntimeException(err, "get failed for {}", path)));
+                             return;
+                         }
+                         promise->set_value(std::move(val));
+                     });
+        return future;
+    }
+
+    // Set the value at `path` to `val` and call `callback` with the result. Callbacks must not throw.
+    template <typename T>
+    void set_async(const std::string &path, const T val, SetCallback callback)
+    {
+        impl::set_as(
+            val, [&](const types::BasicType &v) { send_set_basic(path, v, std::move(callback)); },
+            [&](const types::CompoundType &v) { send_set_array(path, v, std::move(callback)); });
+    }
+
+    // Set the value at `path` to `val`. The future throws a RuntimeException if the request fails.
+    template <typename T>
+    std::future<void> set_async(const std::string &path, const T val)
+    {
+        auto promise = std::make_shared<std::promise<void>>();
+        auto future = promise->get_future();
+        set_async(path, val,
+                  [promise, path](const json_server::error_code err)
+                  {
+                      if (err != json_server::error_code::none)
+                      {
+                          promise->set_exception(
+                              std::make_exception_ptr(json_server::RuntimeException(err, "set failed for {}", path)));
+                          return;
+                      }
+                      promise->set_value();
+                  });
+        return future;
+    }
+
+    // Subscribe to changes of the subtree at `path`: after every write to the subtree, to a path below or above it,
+    // the server calls back with the version of the subtree, which changes with every write to it, and the new value.
+    // Writes in quick succession may be reported by a single notification with the latest value, and `min_interval`
+    // limits the rate of notifications. If the subtree disappears, the subscription fails or the connection closes,
+    // `callback` gets the error. Returns the ID of the subscription. Callbacks must not throw.
+    template <typename T>
+    uint32_t watch(const std::string &path, WatchCallback<T> callback,
+                   const std::chrono::microseconds min_interval = std::chrono::microseconds::zero())
+    {
+        return add_watch(path, false, min_interval,
+                         [path, callback = std::move(callback)](json_server::error_code err, const uint64_t version,
+                                                                const nlohmann::json *j_val)
+                         {
+                             T val{};
+                             if (err == json_server::error_code::none && j_val != nullptr)
+                             {
+                                 try
+                                 {
+                                     val = impl::get_as<T>(
+                                         path, [&]() { return impl::json_to_basic(*j_val); },
+                                         [&]() { return impl::json_to_compound(*j_val); });
+                                 }
+                                 catch (const std::exception &)
+                                 {
+                                     err = json_server::error_code::type_error;
+                                 }
+                             }
+                             callback(err, version, std::move(val));
+                         });
+    }
+    // Like `watch`, but notifications carry the subtree version only, which is cheaper for large subtrees.
+    uint32_t watch_version(const std::string &path, VersionCallback callback,
+                           std::chrono::microseconds min_interval = std::chrono::microseconds::zero());
+    // Remove the subscription `id`. Its callback is not called anymore once this returns, unless it is running.
+    void unwatch(uint32_t id);
+
+    // File descriptor to wait for readability on before calling `process_replies`.
+    [[nodiscard]] int fd() const noexcept
+    {
+        return m_server.handle();
+    }
+
+    // Receive the replies available without blocking and run their callbacks. Only for connections without I/O
+    // thread, from one thread at a time.
+    void process_replies();
+
+private:
+    friend class Session;
+
+    // Called with the error and value of the reply to a request
+    using Completion = std::function<void(json_server::error_code, const nlohmann::json &)>;
+    // Called with the error, subtree version and value (if any) of a notification
+    using Notification = std::function<void(json_server::error_code, uint64_t, const nlohmann::json *)>;
+
+    struct State;
+
+    impl::ServerConnection m_server;
+    // Completions of the requests in flight, subscriptions and the I/O thread
+    std::unique_ptr<State> m_state;
+
+    // Send a request for the command `cmd` on `path` (or on its resolved `handle`), with the value `val` for write
+    // requests.
+    void send_request(details::request_cmd cmd, const std::string &path, std::optional<uint64_t> handle,
+                      const nlohmann::json *val, Completion completion);
+    void send_set_basic(const std::string &path, const types::BasicType &val, SetCallback callback);
+    void send_set_array(const std::string &path, const types::CompoundType &val_array, SetCallback callback);
+    // Send a watch request for `path` and register `notification` for its subscription, whose ID is returned.
+    uint32_t add_watch(const std::string &path, bool version_only, std::chrono::microseconds min_interval,
+                       Notification notification);
+
+    // Receive the buffered reply to the oldest request in flight and run its completion, or the buffered
+    // notification and run the callback of its subscription.
+    void complete_next();
+    // Complete all requests in flight with a socket error, after the connection closed.
+    void close();
+    // Body of the I/O thread.
+    void io_loop();
+};
+
+// A thread-safe session on a single connection, shared by lightweight endpoints on any number of paths. Requests of
+// concurrent callers are multiplexed on the connection and matched to their replies by request ID. A failed request
+// only fails its caller. Endpoints do not lock their resource, since locks are owned by a connection and a waiting lock
+// request would stall the other threads of the session; use an EndpointConnection for exclusive access.
+class Session
+{
+public:
+    // A path resolved on the server, valid for the lifetime of its session. Cheap to copy.
+    class Endpoint
+    {
+    public:
+        [[nodiscard]] const std::string &path() const noexcept
+        {
+            return *m_path;
+        }
+
+        // Retrieve some value from the model.
+        template <typename T>
+        T get() const
+        {
+            return impl::get_as<T>(
+                *m_path, [this]() { return m_session->get_impl_basic(*this); },
+                [this]() { return m_session->get_impl_array(*this); });
+        }
+
+        // Set some value in the model.
+        template <typename T>
+        void set(const T val) const
+        {
+            impl::set_as(
+                val, [this](const types::BasicType &v) { m_session->set_impl_basic(*this, v); },
+                [this](const types::CompoundType &v) { m_session->set_impl_array(*this, v); });
+        }
+
+    private:
+        friend class Session;
+
+        Endpoint(Session &session, const std::string &path, const uint64_t handle) noexcept
+            : m_session(&session), m_path(&path), m_handle(handle)
+        {
+        }
+
+        Session *m_session;
+        // Owned by the session
+        const std::string *m_path;
+        uint64_t m_handle;
+    };
+
+    // Connect to the JSON server. `transport` has to match the socket type the server listens with.
+    explicit Session(const std::filesystem::path &socket_file = details::DEFAULT_SOCK_FILE,
+                     const details::transport transport = details::transport::stream);
+    Session(const Session &) = delete;
+    Session(Session &&) = delete;
+    Session &operator=(const Session &) = delete;
+    Session &operator=(Session &&) = delete;
+    ~Session();
+
+    // Endpoint on the resource at `path`. The path is resolved on the server once per session. Throws a
+    // RuntimeException (json_path_error) if it is no valid JSON pointer.
+    Endpoint endpoint(const std::string &path);
+
+    // Retrieve some value from the model.
+    template <typename T>
+    T get(const std::string &path)
+    {
+        return endpoint(path).get<T>();
+    }
+
+    // Set some value in the model.
+    template <typename T>
+    void set(const std::string &path, const T val)
+    {
+        endpoint(path).set(val);
+    }
+
+private:
+    struct State;
+
+    AsyncConnection m_connection;
+    // Handles of the resolved paths
+    std::unique_ptr<State> m_state;
+
+    // Send a request for the command `cmd` on `path` (or on its resolved `handle`) and wait for the reply, with the
+    // value `val` for write requests.
+    nlohmann::json request(details::request_cmd cmd, const std::string &path, std::optional<uint64_t> handle,
+                           const nlohmann::json *val);
+    types::BasicType get_impl_basic(const Endpoint &endpoint);
+    types::CompoundType get_impl_array(const Endpoint &endpoint);
+    void set_impl_basic(const Endpoint &endpoint, const types::BasicType &val);
+    void set_impl_array(const Endpoint &endpoint, const types::CompoundType &val_array);
+};
+
+// Limits of a ConnectionPool.
+struct PoolLimits
+{
+    // Most connections open at once; borrowers wait for a returned one beyond that
+    std::size_t max_connections{64};
+    // Most connections kept open while not borrowed
+    std::size_t max_idle{16};
+    // Idle connections older than this are closed instead of reused
+    std::chrono::milliseconds max_idle_time{std::chrono::seconds(60)};
+};
+
+// A pool of warm connections to the server: temporary endpoints borrow a connection instead of connecting, and return
+// it when they go out of scope. Besides its own endpoints, the pool serves pooled EndpointConnections. Connections are
+// checked before they are handed out again; ones the server closed (e.g. after a server restart), that were left out
+// of step by an interrupted request or that were idle for too long are dropped.
+class ConnectionPool
+{
+public:
+    // An endpoint on a borrowed connection. Endpoints do not lock their resource, since locks are owned by a connection
+    // and would pass to the next borrower; use an EndpointConnection for exclusive access.
+    class Endpoint
+    {
+    public:
+        Endpoint(const Endpoint &) = delete;
+        Endpoint(Endpoint &&) noexcept = default;
+        Endpoint &operator=(const Endpoint &) = delete;
+        Endpoint &operator=(Endpoint &&) = delete;
+        ~Endpoint();
+
+        // Retrieve some value from the model.
+        template <typename T>
+        T get()
+        {
+            return impl::get_as<T>(
+                m_path, [this]() { return get_impl_basic(); }, [this]() { return get_impl_array(); });
+        }
+
+        // Set some value in the model.
+        template <typename T>
+        void set(const T val)
+        {
+            impl::set_as(
+                val, [this](const types::BasicType &v) { set_impl_basic(v); },
+                [this](const types::CompoundType &v) { set_impl_array(v); });
+        }
+
+    private:
+        friend class ConnectionPool;
+
+        Endpoint(ConnectionPool &pool, std::string path, std::unique_ptr<impl::ServerConnection> server) noexcept;
+
+        ConnectionPool *m_pool;
+        std::string m_path;
+        std::unique_ptr<impl::ServerConnection> m_server;
+
+        // Send a request for the command `cmd` and wait for the reply, with the value `val` for write requests.
+        nlohmann::json request(details::request_cmd cmd, const nlohmann::json *val);
+        types::BasicType get_impl_basic();
+        types::CompoundType get_impl_array();
+        void set_impl_basic(const types::BasicType &val);
+        void set_impl_array(const types::CompoundType &val_array);
+    };
+
+    // Pool of connections to the server at `socket_file`. `transport` has to match the socket type the server listens
+    // with.
+    explicit ConnectionPool(const std::filesystem::path &socket_file = details::DEFAULT_SOCK_FILE,
+                            const details::transport transport = details::transport::stream,
+                            const PoolLimits &limits = {});
+    ConnectionPool(const ConnectionPool &) = delete;
+    ConnectionPool(ConnectionPool &&) = delete;
+    ConnectionPool &operator=(const ConnectionPool &) = delete;
+    ConnectionPool &operator=(ConnectionPool &&) = delete;
+    ~ConnectionPool();
+
+    // Process-wide pool for `socket_file`, created with default limits on first use.
+    static ConnectionPool &shared(const std::filesystem::path &socket_file = details::DEFAULT_SOCK_FILE,
+                                  const details::transport transport = details::transport::stream);
+
+    // Endpoint on the resource at `path`, on a borrowed connection. Waits while `max_connections` are borrowed. Throws
+    // a RuntimeException (socket_error) if no connection can be opened.
+    Endpoint endpoint(const std::string &path);
+
+    // Number of open connections, borrowed or idle.
+    [[nodiscard]] std::size_t num_open() const;
+    // Number of idle connections.
+    [[nodiscard]] std::size_t num_idle() const;
+
+private:
+    friend class EndpointConnection;
+
+    struct State;
+
+    std::filesystem::path m_socket_file;
+    details::transport m_transport;
+    PoolLimits m_limits;
+    // Idle connections and the number of open ones
+    std::unique_ptr<State> m_state;
+
+    // Borrow an idle connection or open a new one.
+    std::unique_ptr<impl::ServerConnection> acquire();
+    // Return a borrowed connection, which is closed unless it can be reused.
+    void release(std::unique_ptr<impl::ServerConnection> server);
+};
+
+// A batch of get and set operations on arbitrary paths, which the server executes in a single round trip as one
+// atomic step: gets see the sets before them, other clients see all sets of the batch or none.
+// Operations are kept after `execute`, so that the same batch can be executed again, e.g. periodically.
+class Batch
+{
+public:
+    // Connect to the JSON server. `transport` has to match the socket type the server listens with.
+    explicit Batch(const std::filesystem::path &socket_file = details::DEFAULT_SOCK_FILE,
+                   const details::transport transport = details::transport::stream);
+    Batch(const Batch &) = delete;
+    Batch(Batch &&) noexcept;
+    Batch &operator=(const Batch &) = delete;
+    Batch &operator=(Batch &&) noexcept;
+    ~Batch();
+
+    // Add reading the value at `path`. Returns the index of the operation.
+    std::size_t get(const std::string &path);
+
+    // Add setting the value at `path` to `val`. Returns the index of the operation.
+    template <typename T>
+    std::size_t set(const std::string &path, const T val)
+    {
+        impl::set_as(
+            val, [&](const types::BasicType &v) { add_set_basic(path, v); },
+            [&](const types::CompoundType &v) { add_set_array(path, v); });
+        return m_paths.size() - 1;
+    }
+
+    // Number of operations.
+    [[nodiscard]] std::size_t size() const noexcept
+    {
+        return m_paths.size();
+    }
+
+    // Remove all operations.
+    void clear();
+
+    // Execute all operations on the server. Failures of single operations are reported by `error` and `result`.
+    void execute();
+
+    // Error of the operation at `idx` in the last execution.
+    [[nodiscard]] json_server::error_code error(std::size_t idx) const;
+
+    // Value read by the get at `idx` in the last execution. Throws a RuntimeException with the error of the operation
+    // if it failed.
+    template <typename T>
+    T result(const std::size_t idx) const
+    {
+        return impl::get_as<T>(
+            m_paths.at(idx), [&]() { return result_basic(idx); }, [&]() { return result_array(idx); });
+    }
+
+private:
+    impl::ServerConnection m_server;
+    // Paths of the operations
+    std::vector<std::string> m_paths{};
+    // msgpack encoded operations, see details::request_cmd::batch
+    std::vector<uint8_t> m_items{};
+    // Results of the last execution
+    std::vector<json_server::error_code> m_errors{};
+    std::vector<nlohmann::json> m_values;
+
+    // Add an encoded operation.
+    void add(details::batch_op op, const std::string &path, const nlohmann::json *val);
+    void add_set_basic(const std::string &path, const types::BasicType &val);
+    void add_set_array(const std::string &path, const types::CompoundType &val_array);
+
+    // Value read by the get at `idx`; throws its error if it failed
+    [[nodiscard]] const nlohmann::json &result_impl(std::size_t idx) const;
+    [[nodiscard]] types::BasicType result_basic(std::size_t idx) const;
+    [[nodiscard]] types::CompoundType result_array(std::size_t idx) const;
+};
+
+// A transaction on arbitrary paths: the server checks all preconditions and, only if they hold, applies all sets, as
+// one atomic step in a single round trip. Other clients see all sets or none. Unlike locking a resource, nothing stays
+// locked between requests, so a client can neither block others nor deadlock with them.
+// Checks and sets are kept after `commit`, so that the same transaction can be retried.
+class Transaction
+{
+public:
+    // Connect to the JSON server. `transport` has to match the socket type the server listens with.
+    explicit Transaction(const std::filesystem::path &socket_file = details::DEFAULT_SOCK_FILE,
+                         const details::transport transport = details::transport::stream);
+    Transaction(const Transaction &) = delete;
+    Transaction(Transaction &&) noexcept;
+    Transaction &operator=(const Transaction &) = delete;
+    Transaction &operator=(Transaction &&) noexcept;
+    ~Transaction();
+
+    // Add the precondition that there is a value at `path`. Returns the index of the check.
+    std::size_t check_exists(const std::string &path);
+
+    // Add the precondition that the value at `path` equals `val`. Returns the index of the check.
+    template <typename T>
+    std::size_t check_equals(const std::string &path, const T val)
+    {
+        impl::set_as(
+            val, [&](const types::BasicType &v) { add_check_basic(path, v); },
+            [&](const types::CompoundType &v) { add_check_array(path, v); });
+        return m_num_checks - 1;
+    }
+
+    // Add the precondition that the subtree at `path` still has the `version` reported by an earlier commit (see
+    // `version`), i.e. that nobody changed it since. Version 0 requires that there is no value at `path`. Returns the
+    // index of the check.
+    std::size_t check_version(const std::string &path, uint64_t version);
+
+    // Add setting the value at `path` to `val`, which must exist.
+    template <typename T>
+    void set(const std::string &path, const T val)
+    {
+        impl::set_as(
+            val, [&](const types::BasicType &v) { add_set_basic(path, v); },
+            [&](const types::CompoundType &v) { add_set_array(path, v); });
+    }
+
+    // Remove all checks and sets.
+    void clear();
+
+    // Check the preconditions on the server and apply the sets if all of them hold. Returns whether they did;
+    // otherwise `failed_check` tells which check failed. Throws a RuntimeException (json_path_error) without applying
+    // any set if a set path does not exist.
+    bool commit();
+
+    // Index of the first failed check of the last commit, none if it succeeded.
+    [[nodiscard]] std::optional<std::size_t> failed_check() const noexcept
+    {
+        return m_failed_check;
+    }
+
+    // Version of the subtree at the path of the check `idx` when the transaction was last committed, before its sets
+    // took effect; 0 if there was no value. The version changes with every write to the subtree.
+    [[nodiscard]] uint64_t version(std::size_t idx) const;
+
+private:
+    impl::ServerConnection m_server;
+    // msgpack encoded checks and sets, see details::request_cmd::transaction
+    std::vector<uint8_t> m_checks{};
+    std::vector<uint8_t> m_sets{};
+    std::size_t m_num_checks{0};
+    std::size_t m_num_sets{0};
+    // Encoded request value, reused for every commit
+    std::vector<uint8_t> m_request{};
+    // Results of the last commit
+    std::optional<std::size_t> m_failed_check{};
+    std::vector<uint64_t> m_versions{};
+
+    // Add an encoded check.
+    void add_check(details::transaction_check op, const std::string &path, const nlohmann::json *val);
+    void add_check_basic(const std::string &path, const types::BasicType &val);
+    void add_check_array(const std::string &path, const types::CompoundType &val_array);
+    // Add an encoded set.
+    void add_set(const std::string &path, const nlohmann::json &val);
+    void add_set_basic(const std::string &path, const types::BasicType &val);
+    void add_set_array(const std::string &path, const types::CompoundType &val_array);
 };
 
 
@@ -1,6 +1,10 @@
 #pragma once
 
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
 #include <filesystem>
+#include <vector>
 
 #include "details.hpp"
 
@@ -8,7 +12,76 @@
 namespace json_server
 {
 
+// I/O backends serving the client connections.
+enum class io_backend : uint8_t
+{
+    // Event loops based on epoll, one per worker thread. Idle workers steal queued requests from busy ones.
+    epoll,
+    // Event loops based on io_uring, one per worker thread, batching the socket I/O of many requests into single
+    // system calls. Falls back to epoll if the kernel lacks io_uring support.
+    io_uring
+};
+
+// Server configuration options.
+struct Options
+{
+    // Unix domain socket file clients connect to.
+    std::filesystem::path socket_file{::details::DEFAULT_SOCK_FILE};
+    // Number of worker threads, each running an event loop that serves client requests. 0 uses the number of
+    // hardware threads.
+    std::size_t worker_threads{0};
+    // I/O backend serving the client connections.
+    io_backend backend{io_backend::epoll};
+    // Socket type clients connect with. Clients have to use the same one (see json_client::EndpointConnection).
+    ::details::transport transport{::details::transport::stream};
+    // Writers lock the model per subtree, keyed on the first `lock_stripe_depth` elements of their path. Writes to
+    // different subtrees proceed in parallel, writes to shorter paths lock the whole model. 0 uses a single lock.
+    std::size_t lock_stripe_depth{1};
+    // Unsent bytes to a client beyond which notifications of its subscriptions are held back until it caught up
+    // reading. Held back notifications are conflated, so the client gets the latest value of each subtree then.
+    std::size_t watch_backlog_limit{256 * 1024};
+    // Time after which a client lock is released unless the client renews it, so that a client which forgets to
+    // unlock does not stall the others forever. Clients holding locks longer have to renew them in time, since they
+    // are not told when a lease expires. 0 keeps locks until they are unlocked or the client disconnects.
+    std::chrono::milliseconds lock_lease_time{0};
+};
+
+// Contention counters of one lock stripe of the model.
+struct StripeStats
+{
+    // Number of times a writer locked the stripe
+    uint64_t acquisitions{0};
+    // Number of times a writer had to wait for the stripe
+    uint64_t contentions{0};
+};
+
+// Delivery counters of the subscriptions to model changes.
+struct WatchStats
+{
+    // Number of current subscriptions
+    std::size_t subscriptions{0};
+    // Number of notifications sent
+    uint64_t notifications{0};
+    // Number of changes merged into a pending notification instead of being notified on their own
+    uint64_t conflated{0};
+    // Number of changes merged into a notification while it was held back, for the minimum interval of its
+    // subscription or since the client did not keep up with reading (a part of `conflated`)
+    uint64_t dropped{0};
+};
+
 // Initializes the json model with a json file as resource backend. Starts a server to which clients can connect.
 void init(const std::filesystem::path &json_resource,
           const std::filesystem::path &socket_file = ::details::DEFAULT_SOCK_FILE);
+
+// Initializes the json model with a json file as resource backend. Starts a server configured by `options`.
+void init(const std::filesystem::path &json_resource, const Options &options);
+
+// Contention counters of all lock stripes of the model, e.g. to tune Options::lock_stripe_depth.
+[[nodiscard]] std::vector<StripeStats> stripe_stats();
+
+// Delivery counters of the subscriptions to model changes, e.g. to spot slow subscribers.
+[[nodiscard]] WatchStats watch_stats();
+
+// Change Options::lock_lease_time of the running server. Applies to locks granted or renewed from now on.
+void set_lock_lease_time(std::chrono::milliseconds lease_time);
 } // namespace json_server
@@ -0,0 +1,167 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "connection.hpp"
+#include "exceptions.hpp"
+#include "model.hpp"
+#include "timer_wheel.hpp"
+
+
+namespace json_server::impl
+{
+
+// Hierarchical path locks requested by clients.
+// A lock covers the subtree at its path. Locking a path in shared or exclusive mode also takes the corresponding
+// intention mode on all of its ancestors, so that locks on overlapping subtrees conflict while locks on disjoint ones
+// do not. Every node counts the locks granted per mode, so checking a request costs one lookup per path element,
+// regardless of the number of locks below it.
+// Taking a contended lock never blocks the thread handling the request: the request is queued, and the thread
+// releasing a conflicting lock grants it by calling its grant callback. Requests are granted in order where they
+// overlap: a request waits behind an earlier queued one it conflicts with, so exclusive locks are not starved by a
+// stream of shared ones. Locks are owned by connections, not threads, since the requests of one connection may be
+// served by different threads. When a connection is destroyed, its locks are released and its queued requests
+// dropped. While its lock request is queued, the requests after it on the connection wait as well, which is why the
+// clients multiplexing requests of several users on one connection do not take locks.
+// Granted locks are leases: unless renewed, they are released once the lease time passed, so that a client which hangs
+// or forgets to unlock does not stall the others forever. Lease and wait timeouts are driven by a timer wheel, which
+// wakes up only once one of them is due.
+class LockManager
+{
+public:
+    enum class Mode : uint8_t
+    {
+        // Taken on the ancestors of shared locks
+        intention_shared,
+        // Taken on the ancestors of exclusive locks
+        intention_exclusive,
+        shared,
+        exclusive
+    };
+
+    // Called with the connection whose queued lock request completed: error_code::none once it is granted,
+    // error_code::timeout if it was not granted in time.
+    using grant_callback = std::function<void(const std::shared_ptr<Connection> &conn, error_code err)>;
+
+    LockManager() = default;
+    LockManager(const LockManager &) = delete;
+    LockManager(LockManager &&) = delete;
+    LockManager &operator=(const LockManager &) = delete;
+    LockManager &operator=(LockManager &&) = delete;
+    ~LockManager() = default;
+
+    // Set the time after which granted locks are released unless renewed, 0 for locks without expiry. Applies to
+    // locks granted or renewed from now on.
+    void set_lease_time(std::chrono::microseconds lease_time);
+
+    // Lock the subtree at `path` in `mode` (shared or exclusive) for the client `conn`. Returns true if the lock was
+    // granted right away, otherwise `grant` is called once the request completes, on the thread releasing the
+    // conflicting lock or the timer thread. Queued requests time out after `timeout`, if set. Throws a
+    // RuntimeException with
+    // - lock if the client holds a lock on the path already, or one which conflicts with the request,
+    // - deadlock if the request would wait for a client which waits for the client itself, directly or through others,
+    // - timeout if the lock is not free and `timeout` is zero.
+    // Must be called while processing the client's requests.
+    bool lock(const std::shared_ptr<Connection> &conn, const PathHandle &path, Mode mode,
+              std::optional<std::chrono::microseconds> timeout, grant_callback grant);
+    // Extend the lease of the lock on `path` held by the client `conn` by the lease time from now on. Throws a
+    // RuntimeException (lock) if it holds none, e.g. since the lease expired.
+    void renew(const Connection &conn, const PathHandle &path);
+    // Release the lock on `path` held by the client `conn`. Throws a RuntimeException (lock) if it holds none.
+    void unlock(const Connection &conn, const PathHandle &path);
+    // Release all locks of the client `conn` and drop its queued requests.
+    void release_all(const Connection &conn);
+
+    // Expire leases and wait timeouts. Never returns.
+    [[noreturn]] void run();
+
+private:
+    using clock = TimerWheel::clock;
+
+    static constexpr std::size_t NUM_MODES = 4;
+    using mode_counts = std::array<uint32_t, NUM_MODES>;
+
+    // Locks on a path: those of the path itself and the intention locks of the paths below
+    struct LockNode
+    {
+        mode_counts granted{};
+        // Modes of the queued requests, which later requests must not overtake
+        mode_counts queued{};
+    };
+
+    struct Request
+    {
+        std::weak_ptr<Connection> conn;
+        // Identifies the client; never dereferenced
+        const Connection *client;
+        std::vector<std::string> tokens;
+        Mode mode;
+        // Nodes from the root to the locked path with the mode taken on each one
+        std::vector<std::pair<LockNode *, Mode>> nodes;
+        grant_callback grant;
+        bool is_granted{false};
+        // End of the lease of a granted lock, if any
+        std::optional<clock::time_point> expiry{};
+        // Timer of the lease, or of the wait timeout while queued
+        std::optional<TimerWheel::timer_id> timer{};
+    };
+    using request_ptr = std::shared_ptr<Request>;
+
+    // A queued request that completed, to be reported to its client after releasing m_mutex
+    struct Completion
+    {
+        std::shared_ptr<Connection> conn;
+        grant_callback grant;
+        error_code err;
+    };
+    using completions = std::vector<Completion>;
+
+    std::mutex m_mutex{};
+    std::chrono::microseconds m_lease_time{0};
+    // Nodes by JSON pointer; a node is removed once no lock is granted or queued on it
+    std::unordered_map<std::string, LockNode> m_nodes{};
+    // Queued requests in the order of their arrival
+    std::list<request_ptr> m_queue{};
+    // Granted and queued requests of each client. The entry of a client stays until its connection is destroyed, so
+    // that the release on destruction is registered once.
+    std::unordered_map<const Connection *, std::vector<request_ptr>> m_by_client{};
+    // Lease and wait timeouts, cancelled once the lock is released, renewed or granted. Their callbacks take m_mutex.
+    TimerWheel m_timers{std::chrono::milliseconds(10), 1024};
+
+    // Whether `mode` can be granted next to locks with `counts`.
+    [[nodiscard]] static bool is_compatible(Mode mode, const mode_counts &counts) noexcept;
+    // Whether queuing `request` would close a cycle in the graph of clients waiting for each other.
+    [[nodiscard]] bool would_deadlock(const Request &request) const;
+    // Clients of the granted requests and of the requests queued before `request` which conflict with it.
+    [[nodiscard]] std::vector<const Connection *> blockers(const Request &request) const;
+    // Count the granted locks of `request`, which is no longer queued, and start its lease.
+    void grant_locks(const request_ptr &request);
+    // Start a new lease of the granted `request`, replacing its timer.
+    void start_lease(const request_ptr &request);
+    // Uncount the locks of `request`, cancel its timer and remove the nodes left without locks.
+    void remove_locks(const Request &request);
+    // Remove the nodes of `request` left without locks.
+    void prune_nodes(const Request &request);
+    // Remove `request` from the requests of its client.
+    void forget(const Request &request);
+    // Grant the queued requests which no longer conflict, in order, and add them to `completed`.
+    void grant_queued(completions &completed);
+    // Timer callbacks: release the lock of `request` if its lease passed, or time out the queued `request`.
+    void expire_lease(const std::weak_ptr<Request> &request);
+    void expire_wait(const std::weak_ptr<Request> &request);
+    // Call the callbacks of `completed` without holding m_mutex.
+    static void notify(completions &completed);
+};
+
+} // namespace json_server::impl
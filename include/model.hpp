@@ -0,0 +1,325 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "nlohmann/json.hpp"
+#include "exceptions.hpp"
+#include "json_server.hpp"
+
+
+namespace json_server::impl
+{
+
+class Node;
+using node_ptr = std::shared_ptr<const Node>;
+
+// Immutable node of the model tree. Nodes are shared between versions of the model: a write copies only the nodes on
+// the path from the root to the changed node and reuses all others.
+// Every node gets a new version number, so the version of a node changes whenever its subtree changes.
+class Node
+{
+public:
+    // Object member; members are sorted by key
+    using member = std::pair<std::string, node_ptr>;
+    using members = std::vector<member>;
+    using elements = std::vector<node_ptr>;
+
+    // Primitive value (null, boolean, number or string)
+    explicit Node(nlohmann::json scalar);
+    explicit Node(members object);
+    explicit Node(elements array);
+
+    // Build the tree for a json value.
+    [[nodiscard]] static node_ptr from_json(const nlohmann::json &val);
+
+    // Append the msgpack encoding of this subtree to `out`. The encoding is the same as nlohmann::json::to_msgpack of
+    // the corresponding json value.
+    void to_msgpack(std::vector<uint8_t> &out) const;
+    // Json value of this subtree.
+    [[nodiscard]] nlohmann::json to_json() const;
+
+    // Version of this subtree, unique among all nodes created so far. Never 0.
+    [[nodiscard]] uint64_t version() const noexcept
+    {
+        return m_version;
+    }
+
+    [[nodiscard]] bool is_object() const noexcept
+    {
+        return m_type == nlohmann::json::value_t::object;
+    }
+
+    [[nodiscard]] bool is_array() const noexcept
+    {
+        return m_type == nlohmann::json::value_t::array;
+    }
+
+    // Value of a primitive node, null for objects and arrays
+    [[nodiscard]] const nlohmann::json &scalar() const noexcept
+    {
+        return m_scalar;
+    }
+
+    [[nodiscard]] const members &object() const noexcept
+    {
+        return m_members;
+    }
+
+    [[nodiscard]] const elements &array() const noexcept
+    {
+        return m_elements;
+    }
+
+    // Child for the JSON pointer reference token `token`. Throws a RuntimeException (json_path_error) if there is none.
+    [[nodiscard]] const node_ptr &child(std::string_view token) const;
+
+    // Like `child`, but tries the member at position `hint` of an object first. `hint` is set to the actual position.
+    [[nodiscard]] const node_ptr &child(std::string_view token, std::size_t &hint) const;
+
+    // Copy of this node with the child for `token` replaced by `new_child`.
+    [[nodiscard]] node_ptr with_child(std::string_view token, node_ptr new_child) const;
+
+private:
+    // Position of the child for `token` in m_members or m_elements
+    [[nodiscard]] std::size_t child_index(std::string_view token) const;
+
+    uint64_t m_version;
+    nlohmann::json::value_t m_type;
+    nlohmann::json m_scalar{};
+    members m_members{};
+    elements m_elements{};
+};
+
+// Split a JSON pointer into its unescaped reference tokens. Throws a RuntimeException (json_path_error) if the
+// pointer is malformed.
+[[nodiscard]] std::vector<std::string> parse_path(std::string_view path);
+
+// Node at `path` (a list of reference tokens) below `root`. Throws a RuntimeException (json_path_error) if there is
+// no such node.
+[[nodiscard]] const Node &find(const Node &root, const std::vector<std::string> &path);
+
+// Append the reference token `token` to the JSON pointer `path`, escaping '~' and '/'.
+void append_token(std::string &path, std::string_view token);
+
+// Copy of the tree below `root` with the node at `path` replaced by `new_node`. Only the nodes from the root to the
+// replaced node are copied. Throws a RuntimeException (json_path_error) if there is no node at `path`.
+[[nodiscard]] node_ptr replace(const Node &root, const std::vector<std::string> &path, node_ptr new_node);
+
+// Append the msgpack header of an array of `size` elements to `out`.
+void append_array_header(std::vector<uint8_t> &out, std::size_t size);
+// Append the msgpack encoding of `val` to `out`, in the smallest format like nlohmann::json::to_msgpack.
+void append_unsigned(std::vector<uint8_t> &out, uint64_t val);
+
+// A path resolved once by a client and then referred to by a numeric handle. Keeps the positions of the nodes found
+// by the last lookup, which are tried before searching by key. Positions are checked against the keys on every
+// lookup, so changes of the model structure simply lead to a new search.
+class PathHandle
+{
+public:
+    // Throws a RuntimeException (json_path_error) if `path` is malformed.
+    explicit PathHandle(std::string_view path);
+
+    [[nodiscard]] const std::string &path() const noexcept
+    {
+        return m_path;
+    }
+
+    [[nodiscard]] const std::vector<std::string> &tokens() const noexcept
+    {
+        return m_tokens;
+    }
+
+    // Node at the path below `root`. Throws a RuntimeException (json_path_error) if there is no such node.
+    [[nodiscard]] const Node &find(const Node &root);
+
+private:
+    std::string m_path;
+    std::vector<std::string> m_tokens;
+    std::vector<std::size_t> m_positions;
+};
+
+// Hash index from JSON pointers to the nodes of the current model version, so that looking up a path is a single probe
+// instead of one search per path element. Entries are keyed on the hash of the pointer; a colliding pointer simply
+// misses and is looked up in the tree instead.
+class PathIndex
+{
+public:
+    // Node at `path`, nullptr if the path is not indexed.
+    [[nodiscard]] node_ptr find(std::string_view path) const;
+
+    // Index `node` at `path`.
+    void assign(std::string_view path, node_ptr node);
+    // Index `node` at `path` and all of its descendants, except for the first `skip_levels` levels.
+    void assign_subtree(std::string &path, const node_ptr &node, std::size_t skip_levels);
+    // Remove the entries of `node` at `path` and of its descendants which still refer to these nodes, except for the
+    // first `skip_levels` levels.
+    void erase_subtree(std::string &path, const Node &node, std::size_t skip_levels);
+    // Remove all entries.
+    void clear();
+
+private:
+    static constexpr std::size_t NUM_SHARDS = 64;
+
+    struct Entry
+    {
+        std::string path;
+        node_ptr node;
+    };
+
+    // Cache line aligned, so that threads working on different shards do not share the lock
+    struct alignas(64) Shard
+    {
+        mutable std::shared_mutex mutex{};
+        std::unordered_map<std::size_t, Entry> entries{};
+    };
+
+    std::array<Shard, NUM_SHARDS> m_shards{};
+};
+
+// One operation of a batch, see Model::execute.
+struct BatchOp
+{
+    // Reference tokens of the path
+    std::vector<std::string> path{};
+    // New node for the path (set), nullptr to read the node (get)
+    node_ptr value{};
+    // Node read by a get
+    node_ptr result{};
+    // Error of the operation. Operations with an error set beforehand are skipped.
+    error_code err{error_code::none};
+};
+
+// Precondition of a transaction, see Model::transact.
+struct TransactionCheck
+{
+    enum class Kind : uint8_t
+    {
+        // The path exists
+        exists,
+        // The value at the path equals `value`
+        equals,
+        // The subtree at the path has the version `version` (see Node::version), 0 if the path must not exist
+        version
+    };
+
+    Kind kind{Kind::exists};
+    // Reference tokens of the path
+    std::vector<std::string> path{};
+    nlohmann::json value{};
+    uint64_t version{0};
+    // Set by Model::transact: version of the subtree at the path before the writes, 0 if there is none
+    uint64_t current_version{0};
+};
+
+// Write of a transaction, see Model::transact.
+struct TransactionWrite
+{
+    // Reference tokens of the path
+    std::vector<std::string> path{};
+    node_ptr value{};
+};
+
+// The JSON model shared by all clients.
+// The current version of the tree is published atomically (RCU style): readers pin a snapshot without taking a lock
+// and keep reading it while writers publish new versions. Writers lock the stripe of the subtree they change, keyed on
+// the path prefix of `stripe_depth` elements. Writers of disjoint subtrees run in parallel and merge their changes into
+// the root with a compare-and-swap.
+class Model
+{
+public:
+    Model() = default;
+    Model(const Model &) = delete;
+    Model(Model &&) = delete;
+    Model &operator=(const Model &) = delete;
+    Model &operator=(Model &&) = delete;
+    ~Model() = default;
+
+    // Replace the whole model and set the path depth of the lock stripes. Must not run concurrently with writers.
+    void reset(const nlohmann::json &doc, std::size_t stripe_depth);
+
+    // Pin the current version of the model. Pinning is O(1) regardless of the model size.
+    [[nodiscard]] node_ptr snapshot() const;
+
+    // Node at the JSON pointer `path` in the current version of the model. Throws a RuntimeException
+    // (json_path_error) if there is no such node.
+    [[nodiscard]] node_ptr find(std::string_view path) const;
+
+    // Replace the value at `path`, which must exist.
+    void set(std::string_view path, const nlohmann::json &val);
+    // Replace the value at `path` (a list of reference tokens), which must exist.
+    void set(const std::vector<std::string> &path, const nlohmann::json &val);
+
+    // Replace the value at `path` (a list of reference tokens) by the node `new_value` returns for the current one,
+    // as one atomic step. The value is kept if `new_value` returns nullptr. Returns the previous node. Throws a
+    // RuntimeException (json_path_error) if there is no node at `path`; exceptions of `new_value` leave the value
+    // unchanged.
+    node_ptr update(const std::vector<std::string> &path, const std::function<node_ptr(const Node &)> &new_value);
+
+    // Execute `ops` in order as one atomic step: gets see the sets before them, other clients see all sets or none.
+    // Failing operations get their error set and are skipped, the others take effect.
+    void execute(std::vector<BatchOp> &ops);
+
+    // Evaluate `checks` and, if all of them hold, apply `writes` in order, as one atomic step: the checked and the
+    // written paths are locked once for both. Returns the position of the first failing check, none if the writes
+    // took effect. The current versions of the checked paths are set either way. Throws a RuntimeException
+    // (json_path_error) and applies no write if a written path does not exist.
+    std::optional<std::size_t> transact(std::vector<TransactionCheck> &checks,
+                                        const std::vector<TransactionWrite> &writes);
+
+    // Number of writes published so far. A snapshot taken after reading the version contains all of these writes.
+    [[nodiscard]] uint64_t version() const noexcept
+    {
+        return m_version.load(std::memory_order_acquire);
+    }
+    // Contention counters of all lock stripes.
+    [[nodiscard]] std::vector<StripeStats> stripe_stats() const;
+
+private:
+    static constexpr std::size_t NUM_STRIPES = 64;
+
+    // Cache line aligned, so that writers of different stripes do not share the counters
+    struct alignas(64) Stripe
+    {
+        std::mutex mutex{};
+        std::atomic<uint64_t> acquisitions{0};
+        std::atomic<uint64_t> contentions{0};
+    };
+
+    using stripe_locks = std::vector<std::unique_lock<std::mutex>>;
+
+    // Add the stripes covering the subtree at `path` to `indices`. Paths shorter than the stripe depth cover all
+    // stripes.
+    void add_stripes(const std::vector<std::string> &path, std::vector<std::size_t> &indices) const;
+    // Lock the stripes at `indices` in ascending order.
+    [[nodiscard]] stripe_locks lock_stripes(std::vector<std::size_t> indices);
+
+    // Replace the node at `path` in the current root and publish the result, which is returned. The caller holds the
+    // stripes of `path`.
+    node_ptr publish(const std::vector<std::string> &path, const node_ptr &new_node);
+    // Update the path index after `old_node` at `path` was replaced by `new_node` in `root`. Only paths of at least the
+    // stripe depth are indexed, since their entries are changed by holders of the stripe only.
+    void update_index(const std::vector<std::string> &path, const node_ptr &root, const node_ptr &old_node,
+                      const node_ptr &new_node);
+
+    std::array<Stripe, NUM_STRIPES> m_stripes{};
+    std::size_t m_stripe_depth{1};
+    PathIndex m_index{};
+    // Accessed with the atomic shared_ptr functions only
+    node_ptr m_root{std::make_shared<const Node>(nlohmann::json{})};
+    // Incremented after every publish, lets readers reuse their last snapshot while the model is unchanged
+    std::atomic<uint64_t> m_version{0};
+};
+
+} // namespace json_server::impl
@@ -0,0 +1,110 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "connection.hpp"
+#include "ring_queue.hpp"
+
+
+namespace json_server::impl
+{
+
+class ReactorGroup;
+
+// Event loop multiplexing many non-blocking client connections on a single thread via epoll.
+// Connections with received requests are queued on the reactor's run queue and processed on the reactor thread,
+// unless an idle reactor of the same group steals them first.
+class Reactor
+{
+public:
+    Reactor(ReactorGroup &group, std::size_t index);
+    Reactor(const Reactor &) = delete;
+    Reactor(Reactor &&) = delete;
+    Reactor &operator=(const Reactor &) = delete;
+    Reactor &operator=(Reactor &&) = delete;
+    ~Reactor();
+
+    // Start watching a client connection (thread-safe).
+    void add(std::shared_ptr<Connection> conn);
+    // Queue a connection with pending requests on the run queue (thread-safe).
+    void schedule(std::shared_ptr<Connection> conn);
+    // Take queued work from the back of the run queue (thread-safe). Returns nullptr if there is none.
+    std::shared_ptr<Connection> steal();
+    // Wake the reactor up if it waits for events with an empty run queue (thread-safe).
+    bool wake_if_idle();
+
+    // Run the event loop. Never returns.
+    [[noreturn]] void run();
+
+private:
+    ReactorGroup &m_group;
+    std::size_t m_index;
+    int m_epoll_fd{-1};
+    int m_wakeup_fd{-1};
+    std::atomic<bool> m_is_idle{false};
+
+    std::mutex m_mutex{};
+    std::unordered_map<int, std::shared_ptr<Connection>> m_connections{};
+
+    std::mutex m_run_queue_mutex{};
+    RingQueue<std::shared_ptr<Connection>> m_run_queue{};
+
+    // Look up the connection registered for a socket handle.
+    std::shared_ptr<Connection> find(int fd);
+    // Stop watching a connection and release the reactor's reference to it.
+    void remove(const std::shared_ptr<Connection> &conn);
+    // Take work from the front of the own run queue. Returns nullptr if there is none.
+    std::shared_ptr<Connection> next();
+    // Read requests from a connection and queue them.
+    void receive(const std::shared_ptr<Connection> &conn, uint32_t events);
+};
+
+// A group of reactors, typically one per core, sharing the request processing work.
+// New connections are distributed round-robin. Reactors running out of work steal queued work from the others.
+class ReactorGroup
+{
+public:
+    // Processes the queued requests of a connection.
+    using connection_processor = std::function<void(const std::shared_ptr<Connection> &conn)>;
+
+    ReactorGroup(std::size_t num_reactors, connection_processor process);
+    ReactorGroup(const ReactorGroup &) = delete;
+    ReactorGroup(ReactorGroup &&) = delete;
+    ReactorGroup &operator=(const ReactorGroup &) = delete;
+    ReactorGroup &operator=(ReactorGroup &&) = delete;
+    ~ReactorGroup() = default;
+
+    // Start one detached thread per reactor.
+    void start();
+
+    // Hand a new client connection to the next reactor (thread-safe).
+    void add(std::shared_ptr<Connection> conn);
+    // Queue processing of a connection's pending requests on some reactor (thread-safe).
+    void schedule(std::shared_ptr<Connection> conn);
+
+    [[nodiscard]] std::size_t size() const noexcept
+    {
+        return m_reactors.size();
+    }
+
+private:
+    friend class Reactor;
+
+    std::vector<std::unique_ptr<Reactor>> m_reactors{};
+    connection_processor m_process;
+    std::atomic<std::size_t> m_next{0};
+
+    // Steal queued work from any reactor but the one at `thief`. Returns nullptr if there is none.
+    std::shared_ptr<Connection> steal(std::size_t thief);
+    // Wake up an idle reactor (other than `self`) to steal work.
+    void wake_idle(std::size_t self);
+};
+
+} // namespace json_server::impl
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <vector>
+
+
+namespace json_server::impl
+{
+
+// FIFO queue in a ring buffer of slots. Unlike std::deque, it only allocates when it grows beyond its largest size so
+// far, so that a steady flow of elements does not allocate at all.
+// Slots outlive the elements in them: callers assign or swap elements into the slot returned by `push_back` and move
+// or swap them out before popping. Whatever is left in a slot (e.g. a buffer with its capacity) is handed out again
+// with a later `push_back`.
+template <typename T>
+class RingQueue
+{
+public:
+    [[nodiscard]] bool empty() const noexcept
+    {
+        return m_size == 0;
+    }
+
+    [[nodiscard]] std::size_t size() const noexcept
+    {
+        return m_size;
+    }
+
+    // Append a slot and return it.
+    T &push_back()
+    {
+        if (m_size == m_slots.size())
+        {
+            grow();
+        }
+        return m_slots[(m_head + m_size++) % m_slots.size()];
+    }
+
+    // Slot the next `push_back` returns, nullptr if the queue has to grow first.
+    [[nodiscard]] T *next_slot() noexcept
+    {
+        return m_size == m_slots.size() ? nullptr : &m_slots[(m_head + m_size) % m_slots.size()];
+    }
+
+    [[nodiscard]] T &front() noexcept
+    {
+        return m_slots[m_head];
+    }
+
+    [[nodiscard]] T &back() noexcept
+    {
+        return m_slots[(m_head + m_size - 1) % m_slots.size()];
+    }
+
+    // Remove the first element, its slot keeps the value left there.
+    void pop_front() noexcept
+    {
+        m_head = (m_head + 1) % m_slots.size();
+        --m_size;
+    }
+
+    // Remove the last element, its slot keeps the value left there.
+    void pop_back() noexcept
+    {
+        --m_size;
+    }
+
+    // Remove all elements, their slots keep their values.
+    void clear() noexcept
+    {
+        m_size = 0;
+    }
+
+private:
+    static constexpr std::size_t MIN_SLOTS = 8;
+
+    std::vector<T> m_slots{};
+    std::size_t m_head{0};
+    std::size_t m_size{0};
+
+    void grow()
+    {
+        // Unroll the ring, so that the elements are in order at the start of the larger one
+        std::rotate(m_slots.begin(), m_slots.begin() + static_cast<std::ptrdiff_t>(m_head), m_slots.end());
+        m_head = 0;
+        m_slots.resize(std::max(MIN_SLOTS, m_slots.size() * 2));
+    }
+};
+
+} // namespace json_server::impl
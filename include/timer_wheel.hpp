@@ -0,0 +1,70 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+
+namespace json_server::impl
+{
+
+// Hashed timing wheel: timers are kept in the slot of their deadline tick modulo the number of slots, so scheduling and
+// cancelling a timer only touch one slot. Timers further away than one turn of the wheel stay in their slot until
+// their tick comes around. The thread running the wheel sleeps until the earliest deadline, skipping the ticks without
+// timers, and for as long as no timer is scheduled.
+class TimerWheel
+{
+public:
+    using clock = std::chrono::steady_clock;
+    using callback = std::function<void()>;
+    using timer_id = uint64_t;
+
+    // Fire timers with a resolution of `tick`; one turn of the wheel spans `num_slots` ticks.
+    TimerWheel(clock::duration tick, std::size_t num_slots);
+    TimerWheel(const TimerWheel &) = delete;
+    TimerWheel(TimerWheel &&) = delete;
+    TimerWheel &operator=(const TimerWheel &) = delete;
+    TimerWheel &operator=(TimerWheel &&) = delete;
+    ~TimerWheel() = default;
+
+    // Call `fn` on the thread running the wheel once `deadline` passed, at most one tick late (thread-safe).
+    timer_id schedule(clock::time_point deadline, callback fn);
+    // Remove the timer `id` unless it fired already (thread-safe). A timer about to fire may still fire after this
+    // returned, so callbacks have to check whether they are still due.
+    void cancel(timer_id id);
+
+    // Fire the timers as they expire. Never returns.
+    [[noreturn]] void run();
+
+private:
+    struct Timer
+    {
+        timer_id id;
+        uint64_t tick;
+        callback fn;
+    };
+
+    const clock::duration m_tick;
+    const clock::time_point m_start{clock::now()};
+
+    std::mutex m_mutex{};
+    std::condition_variable m_cv{};
+    std::vector<std::vector<Timer>> m_slots;
+    // Deadline ticks of the scheduled timers
+    std::unordered_map<timer_id, uint64_t> m_ticks{};
+    timer_id m_next_id{1};
+    // Next tick to fire the timers of
+    uint64_t m_next_tick{0};
+
+    // Number of the first tick at or after `time`.
+    [[nodiscard]] uint64_t tick_at(clock::time_point time) const noexcept;
+    // Earliest deadline tick of the scheduled timers, of which there must be some.
+    [[nodiscard]] uint64_t earliest_tick() const;
+};
+
+} // namespace json_server::impl
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include "connection.hpp"
+
+
+namespace json_server::impl
+{
+
+// I/O engine based on io_uring: accepts client connections with a multishot accept, receives requests with
+// multishot receives into a ring of kernel registered buffers and writes replies from registered buffers. All
+// operations of one event loop iteration are submitted together with a single system call.
+class UringEngine
+{
+public:
+    // Called on the engine thread when a connection queued received requests and is not being processed yet.
+    using request_handler = std::function<void(const std::shared_ptr<Connection> &conn)>;
+
+    // Set up the engine for the listening socket `listen_fd`. Throws an InternalException if the kernel (or the
+    // headers this library was built with) lacks the required io_uring features.
+    UringEngine(int listen_fd, request_handler on_requests);
+    UringEngine(const UringEngine &) = delete;
+    UringEngine(UringEngine &&) = delete;
+    UringEngine &operator=(const UringEngine &) = delete;
+    UringEngine &operator=(UringEngine &&) = delete;
+    ~UringEngine();
+
+    // Run the event loop. Never returns.
+    [[noreturn]] void run();
+
+private:
+    struct State;
+    std::unique_ptr<State> m_state;
+};
+
+} // namespace json_server::impl
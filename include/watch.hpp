@@ -0,0 +1,139 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "connection.hpp"
+#include "json_server.hpp"
+#include "model.hpp"
+
+
+namespace json_server::impl
+{
+
+// Subscriptions of clients to changes of subtrees of the model.
+// Writers report the paths they changed; subscriptions of overlapping subtrees (the changed one, those below and those
+// above it) are marked and queued for a dispatcher thread, which sends the notifications. Writers never wait for
+// subscribers or their sockets: a subscription changed several times before the dispatcher gets to it is notified
+// once, with the latest version of its subtree.
+// Delivery is bounded per subscriber: notifications are held back while a subscription's minimum interval has not
+// passed yet, or while its client has more unsent output than the backlog limit. A held back subscription keeps
+// collecting changes and is eventually notified with the latest version, so a slow client costs one pending entry per
+// subscription instead of a growing backlog of notifications.
+class WatchRegistry
+{
+public:
+    explicit WatchRegistry(const Model &model);
+    WatchRegistry(const WatchRegistry &) = delete;
+    WatchRegistry(WatchRegistry &&) = delete;
+    WatchRegistry &operator=(const WatchRegistry &) = delete;
+    WatchRegistry &operator=(WatchRegistry &&) = delete;
+    ~WatchRegistry() = default;
+
+    // Set the number of unsent bytes to a client beyond which its notifications are held back.
+    void set_backlog_limit(std::size_t limit) noexcept
+    {
+        m_backlog_limit.store(limit, std::memory_order_relaxed);
+    }
+
+    // Subscribe the client `conn` to changes of the subtree at `path`, notified with `id` at most once per
+    // `min_interval`. Notifications carry the version and current value of the subtree, or only its version with
+    // `version_only`. Replaces an earlier subscription of the client with the same `id`.
+    void watch(const std::shared_ptr<Connection> &conn, uint32_t id, const PathHandle &path, bool version_only,
+               std::chrono::microseconds min_interval);
+    // Remove the subscription `id` of the client `conn`, if any.
+    void unwatch(const Connection &conn, uint32_t id);
+    // Queue notifications for the subscriptions overlapping with `path` (a list of reference tokens), which a writer
+    // just changed.
+    void changed(const std::vector<std::string> &path);
+
+    // Delivery counters of all subscriptions.
+    [[nodiscard]] WatchStats stats() const;
+
+    // Send the queued notifications. Never returns.
+    [[noreturn]] void run();
+
+private:
+    using clock = std::chrono::steady_clock;
+
+    struct Subscription
+    {
+        std::weak_ptr<Connection> conn;
+        // Identifies the client in the map of all subscriptions; never dereferenced
+        const Connection *client;
+        uint32_t id;
+        std::vector<std::string> path;
+        bool is_version_only;
+        std::chrono::microseconds min_interval;
+        // Set once the subscription is removed, so that queued notifications are dropped
+        std::atomic<bool> is_removed{false};
+        // Set while the subscription is queued for the dispatcher
+        std::atomic<bool> is_queued{false};
+        // Number of changes merged into the queued notification
+        std::atomic<uint64_t> num_conflated{0};
+        // Set while the queued notification is held back, for the minimum interval or the backlog of the client
+        std::atomic<bool> is_held_back{false};
+        // Only accessed by the dispatcher: subtree version and time of the last notification
+        uint64_t version{0};
+        clock::time_point last_sent{};
+    };
+    using subscription_ptr = std::shared_ptr<Subscription>;
+
+    // Node of the subscription tree, which has the reference tokens of the watched paths as edges
+    struct TreeNode
+    {
+        std::unordered_map<std::string, std::unique_ptr<TreeNode>> children{};
+        std::vector<subscription_ptr> subscriptions{};
+    };
+
+    const Model &m_model;
+
+    // Protects the subscription tree and m_by_client
+    mutable std::shared_mutex m_mutex{};
+    TreeNode m_root{};
+    std::map<std::pair<const Connection *, uint32_t>, subscription_ptr> m_by_client{};
+    // Lets writers skip the tree while nobody watches
+    std::atomic<std::size_t> m_num_subscriptions{0};
+    // Number of subscriptions after the last removal of subscriptions of closed connections
+    std::size_t m_num_after_purge{0};
+    // Changes conflated by removed subscriptions
+    uint64_t m_removed_conflated{0};
+
+    std::atomic<std::size_t> m_backlog_limit{Options{}.watch_backlog_limit};
+    // Only written by the dispatcher
+    std::atomic<uint64_t> m_num_notifications{0};
+    // Changes merged into held back notifications, written by writers
+    std::atomic<uint64_t> m_num_dropped{0};
+
+    // Subscriptions queued for the dispatcher
+    std::mutex m_queue_mutex{};
+    std::condition_variable m_queue_cv{};
+    std::vector<subscription_ptr> m_queue{};
+    // Held back subscriptions by the time to try again, only accessed by the dispatcher
+    std::multimap<clock::time_point, subscription_ptr> m_deferred{};
+
+    // Queue `subscription` for the dispatcher unless it is queued already.
+    void enqueue(const subscription_ptr &subscription);
+    // Queue all subscriptions at and below `node`.
+    void enqueue_subtree(const TreeNode &node);
+    // Remove `subscription`. Must be called with m_mutex held exclusively.
+    void remove(const subscription_ptr &subscription);
+    // Remove the subscriptions of closed connections. Must be called with m_mutex held exclusively.
+    void purge();
+    // Send the notification of the `queued` subscription, or hold it back for later. Returns false if its connection
+    // is closed.
+    bool notify(const subscription_ptr &queued, clock::time_point now);
+};
+
+} // namespace json_server::impl
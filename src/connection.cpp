@@ -0,0 +1,332 @@
+#include "connection.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <utility>
+
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#include "details.hpp"
+#include "exceptions.hpp"
+
+
+namespace json_server::impl
+{
+
+namespace
+{
+    // Request buffers larger than this are released after use instead of being kept for later requests
+    constexpr std::size_t MAX_RECYCLED_CAPACITY = 64 * 1024;
+} // namespace
+
+// Note: Reads and writes use the raw socket handle, since they happen concurrently on different threads and sockpp
+// keeps a single last error per socket.
+
+Connection::Connection(sockpp::unix_socket socket) : m_socket(std::move(socket))
+{
+    if (!m_socket.set_non_blocking(true))
+    {
+        throw json_server::InternalException(lh::nostd::source_location::current(),
+                                             "Unable to set socket non-blocking: {}", m_socket.last_error_str());
+    }
+
+    int type{SOCK_STREAM};
+    socklen_t type_size = sizeof(type);
+    if (m_socket.get_option(SOL_SOCKET, SO_TYPE, &type, &type_size) && type == SOCK_SEQPACKET)
+    {
+        m_max_write_size = ::details::max_write_size(::details::transport::seqpacket);
+    }
+}
+
+Connection::~Connection()
+{
+    for (const auto &callback: m_close_callbacks)
+    {
+        callback(*this);
+    }
+}
+
+void Connection::attach(const int epoll_fd) noexcept
+{
+    m_epoll_fd = epoll_fd;
+}
+
+void Connection::defer_writes(write_scheduler scheduler)
+{
+    const std::scoped_lock lock(m_send_mutex);
+    m_write_scheduler = std::move(scheduler);
+}
+
+void Connection::defer_resume(resume_scheduler scheduler)
+{
+    const std::scoped_lock lock(m_request_mutex);
+    m_resume_scheduler = std::move(scheduler);
+}
+
+bool Connection::receive(bool &must_process)
+{
+    // Read in large chunks, so that a complete request usually takes a single call
+    thread_local std::array<uint8_t, 64 * 1024> chunk{};
+
+    must_process = false;
+    while (true)
+    {
+        const auto ret = ::recv(handle(), chunk.data(), chunk.size(), 0);
+        if (ret == 0)
+        {
+            // Peer closed connection
+            return false;
+        }
+        if (ret < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+
+        const auto num_received = static_cast<std::size_t>(ret);
+        must_process = consume(chunk.data(), num_received) || must_process;
+        if (num_received < chunk.size())
+        {
+            // Drained the socket, no need to wait for EAGAIN
+            return true;
+        }
+    }
+}
+
+bool Connection::consume(const uint8_t *data, std::size_t size)
+{
+    bool must_process = false;
+    while (size > 0)
+    {
+        if (m_size_received < m_size_buffer.size())
+        {
+            const auto n = std::min(size, m_size_buffer.size() - m_size_received);
+            std::memcpy(m_size_buffer.data() + m_size_received, data, n);
+            m_size_received += n;
+            data += n;
+            size -= n;
+            if (m_size_received < m_size_buffer.size())
+            {
+                break;
+            }
+
+            // Note: No need to take care of byte ordering here, since all communication is local only
+            uint32_t expected{0};
+            std::memcpy(&expected, m_size_buffer.data(), sizeof(uint32_t));
+            m_payload.resize(expected);
+            m_payload_received = 0;
+        }
+
+        const auto n = std::min(size, m_payload.size() - m_payload_received);
+        std::memcpy(m_payload.data() + m_payload_received, data, n);
+        m_payload_received += n;
+        data += n;
+        size -= n;
+
+        if (m_payload_received == m_payload.size())
+        {
+            m_payload_received = 0;
+            m_size_received = 0;
+
+            // Queue the frame by swapping it into its slot, which leaves a recycled buffer for the next frame
+            const std::scoped_lock lock(m_request_mutex);
+            if (m_is_shut_down)
+            {
+                continue;
+            }
+            std::swap(m_payload, m_requests.push_back());
+            if (!m_is_scheduled)
+            {
+                m_is_scheduled = true;
+                must_process = true;
+            }
+        }
+    }
+    return must_process;
+}
+
+bool Connection::pop_request(std::vector<uint8_t> &request)
+{
+    if (request.capacity() > MAX_RECYCLED_CAPACITY)
+    {
+        request = {};
+    }
+
+    const std::scoped_lock lock(m_request_mutex);
+    if (m_requests.empty() || m_is_shut_down)
+    {
+        // Hand the buffer of the last request to the next frame received
+        if (auto *const slot = m_requests.next_slot())
+        {
+            std::swap(request, *slot);
+        }
+        m_is_scheduled = false;
+        return false;
+    }
+    std::swap(request, m_requests.front());
+    m_requests.pop_front();
+    return true;
+}
+
+bool Connection::resume()
+{
+    resume_scheduler scheduler;
+    {
+        const std::scoped_lock lock(m_request_mutex);
+        scheduler = m_resume_scheduler;
+    }
+    if (!scheduler)
+    {
+        return false;
+    }
+    scheduler(shared_from_this());
+    return true;
+}
+
+void Connection::send(const uint8_t *payload, const std::size_t size)
+{
+    send([payload, size](std::vector<uint8_t> &out) { out.insert(out.end(), payload, payload + size); });
+}
+
+void Connection::finish_frame(std::unique_lock<std::mutex> &lock, const std::size_t frame_start)
+{
+    // Note: No need to take care of byte ordering here, since all communication is local only
+    const auto sz = static_cast<uint32_t>(m_send_buffer.size() - frame_start - sizeof(uint32_t));
+    std::memcpy(m_send_buffer.data() + frame_start, &sz, sizeof(sz));
+
+    if (m_write_scheduler)
+    {
+        if (!m_is_write_scheduled)
+        {
+            m_is_write_scheduled = true;
+            const auto scheduler = m_write_scheduler;
+            lock.unlock();
+            scheduler(shared_from_this());
+        }
+    }
+    else if (!m_wants_write && !m_is_corked)
+    {
+        write_pending();
+    }
+}
+
+std::size_t Connection::pending_output()
+{
+    const std::scoped_lock lock(m_send_mutex);
+    return m_send_buffer.size() - m_send_offset;
+}
+
+void Connection::cork()
+{
+    const std::scoped_lock lock(m_send_mutex);
+    m_is_corked = true;
+}
+
+void Connection::uncork()
+{
+    const std::scoped_lock lock(m_send_mutex);
+    m_is_corked = false;
+    if (!m_write_scheduler && !m_wants_write && !m_send_buffer.empty())
+    {
+        write_pending();
+    }
+}
+
+void Connection::flush()
+{
+    const std::scoped_lock lock(m_send_mutex);
+    write_pending();
+}
+
+bool Connection::take_output(std::vector<uint8_t> &out)
+{
+    const std::scoped_lock lock(m_send_mutex);
+    if (m_send_buffer.empty())
+    {
+        m_is_write_scheduled = false;
+        if (m_shutdown_pending)
+        {
+            ::shutdown(handle(), SHUT_RDWR);
+        }
+        return false;
+    }
+    out.clear();
+    std::swap(out, m_send_buffer);
+    return true;
+}
+
+void Connection::write_pending()
+{
+    while (m_send_offset < m_send_buffer.size())
+    {
+        const auto size = std::min(m_send_buffer.size() - m_send_offset, m_max_write_size);
+        const auto ret = ::send(handle(), m_send_buffer.data() + m_send_offset, size, MSG_NOSIGNAL);
+        if (ret < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                watch_writable(true);
+                return;
+            }
+            // Broken connection: the reactor will notice the hangup
+            break;
+        }
+        m_send_offset += static_cast<std::size_t>(ret);
+    }
+
+    m_send_buffer.clear();
+    m_send_offset = 0;
+    watch_writable(false);
+    if (m_shutdown_pending)
+    {
+        ::shutdown(handle(), SHUT_RDWR);
+    }
+}
+
+void Connection::watch_writable(const bool enable)
+{
+    if (enable == m_wants_write || m_epoll_fd < 0)
+    {
+        return;
+    }
+    epoll_event ev{};
+    ev.events = EPOLLIN | EPOLLRDHUP | (enable ? EPOLLOUT : 0U);
+    ev.data.fd = handle();
+    ::epoll_ctl(m_epoll_fd, EPOLL_CTL_MOD, handle(), &ev);
+    m_wants_write = enable;
+}
+
+void Connection::on_close(std::function<void(const Connection &conn)> callback)
+{
+    m_close_callbacks.push_back(std::move(callback));
+}
+
+void Connection::shutdown()
+{
+    {
+        const std::scoped_lock lock(m_request_mutex);
+        m_is_shut_down = true;
+        m_requests.clear();
+    }
+
+    const std::scoped_lock lock(m_send_mutex);
+    if (m_send_buffer.empty() && !m_is_write_scheduled)
+    {
+        ::shutdown(handle(), SHUT_RDWR);
+    }
+    else
+    {
+        m_shutdown_pending = true;
+    }
+}
+
+} // namespace json_server::impl
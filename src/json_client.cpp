@@ -1,5 +1,19 @@
 #include "json_client.hpp"
 
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+
+#include <poll.h>
+
 #include "nlohmann/json.hpp"
 #include "exceptions.hpp"
 
@@ -70,56 +84,375 @@ namespace impl
                                                  val.index());
         }
     }
+
+    types::CompoundType json_to_compound(const nlohmann::json &j_val)
+    {
+        if (!j_val.is_array())
+        {
+            throw json_server::InternalException(lh::nostd::source_location::current(), "Not an array type");
+        }
+        if (j_val.empty())
+        {
+            return {};
+        }
+
+        types::CompoundType ret;
+        ret.resize(j_val.size());
+        std::transform(j_val.begin(), j_val.end(), ret.begin(), json_to_basic);
+        return ret;
+    }
+
+    nlohmann::json compound_to_json(const types::CompoundType &val_array)
+    {
+        nlohmann::json ret;
+        for (const auto &val: val_array)
+        {
+            ret.push_back(basic_to_json(val));
+        }
+        return ret;
+    }
+
+    ServerConnection::ServerConnection(const std::filesystem::path &socket_file, const details::transport transport)
+        : m_transport(transport)
+    {
+        const sockpp::unix_address addr(socket_file);
+        bool is_connected = false;
+        if (m_transport == details::transport::stream)
+        {
+            is_connected = m_socket.connect(addr);
+        }
+        else
+        {
+            // The connector creates stream sockets only, so connect a socket of the other type by hand
+            m_socket.reset(sockpp::socket::create_handle(AF_UNIX, details::socket_type(m_transport)));
+            is_connected = m_socket.is_open() && ::connect(m_socket.handle(), addr.sockaddr_ptr(), addr.size()) == 0;
+        }
+        if (!is_connected)
+        {
+            throw json_server::RuntimeException(json_server::error_code::socket_error,
+                                                "Unable to connect to socket file {}", socket_file.string());
+        }
+    }
+
+    void ServerConnection::send(const std::array<iovec, 3> &parts)
+    {
+        // A request sent partially leaves the connection out of step
+        m_is_in_step = false;
+        details::transmit_frame(m_socket, parts, details::max_write_size(m_transport));
+        m_is_in_step = true;
+        ++m_next_request_id;
+        ++m_in_flight;
+    }
+
+    void ServerConnection::send_request(const details::request_cmd cmd, const std::string_view path,
+                                        const std::optional<uint64_t> handle, const nlohmann::json *val,
+                                        const uint8_t flags)
+    {
+        m_send_buffer.clear();
+        if (val != nullptr)
+        {
+            nlohmann::json::to_msgpack(*val, m_send_buffer);
+        }
+        details::RequestHeader header;
+        header.cmd = cmd;
+        header.flags = flags;
+        header.request_id = m_next_request_id;
+        iovec target{const_cast<char *>(path.data()), path.size()};
+        if (handle)
+        {
+            header.flags |= details::REQUEST_FLAG_HANDLE;
+            target = {const_cast<uint64_t *>(&*handle), sizeof(uint64_t)};
+        }
+        header.path_size = static_cast<uint32_t>(target.iov_len);
+        send({iovec{&header, sizeof(header)}, target, iovec{m_send_buffer.data(), m_send_buffer.size()}});
+    }
+
+    void ServerConnection::shutdown() noexcept
+    {
+        ::shutdown(m_socket.handle(), SHUT_RDWR);
+    }
+
+    bool ServerConnection::read_some(const std::size_t size, const int flags)
+    {
+        // Move the unread bytes to the front
+        if (m_receive_begin != 0)
+        {
+            std::memmove(m_receive_buffer.data(), m_receive_buffer.data() + m_receive_begin,
+                         m_receive_end - m_receive_begin);
+            m_receive_end -= m_receive_begin;
+            m_receive_begin = 0;
+        }
+
+        // Read as much as available, so that a reply usually takes a single call including its size information.
+        // Datagrams are cut off at the end of the buffer, so leave room for a whole one.
+        const auto min_room = m_transport == details::transport::seqpacket ? details::MAX_DATAGRAM_SIZE : 1;
+        const auto min_size = std::max({size, m_receive_end + min_room, RECEIVE_BUFFER_SIZE});
+        if (m_receive_buffer.size() < min_size)
+        {
+            m_receive_buffer.resize(min_size);
+        }
+        const auto ret = ::recv(m_socket.handle(), m_receive_buffer.data() + m_receive_end,
+                                m_receive_buffer.size() - m_receive_end, flags);
+        if (ret < 0 && (errno == EINTR || ((flags & MSG_DONTWAIT) != 0 && (errno == EAGAIN || errno == EWOULDBLOCK))))
+        {
+            return errno == EINTR;
+        }
+        if (ret <= 0)
+        {
+            throw json_server::InternalException(lh::nostd::source_location::current(), "read failed: {}, {}",
+                                                 ret == 0 ? 0 : errno, ret == 0 ? "closed" : std::strerror(errno));
+        }
+        m_receive_end += static_cast<std::size_t>(ret);
+        return true;
+    }
+
+    void ServerConnection::receive_at_least(const std::size_t size)
+    {
+        while (m_receive_end - m_receive_begin < size)
+        {
+            read_some(size, 0);
+        }
+    }
+
+    std::size_t ServerConnection::missing_reply_size() const noexcept
+    {
+        const auto unread = m_receive_end - m_receive_begin;
+        if (unread < sizeof(uint32_t))
+        {
+            return sizeof(uint32_t);
+        }
+        // Note: No need to take care of byte ordering here, since all communication is local only
+        uint32_t sz{0};
+        std::memcpy(&sz, m_receive_buffer.data() + m_receive_begin, sizeof(uint32_t));
+        return unread < sizeof(uint32_t) + sz ? sizeof(uint32_t) + sz : 0;
+    }
+
+    void ServerConnection::wait_for_reply()
+    {
+        for (auto size = missing_reply_size(); size != 0; size = missing_reply_size())
+        {
+            receive_at_least(size);
+        }
+    }
+
+    bool ServerConnection::poll()
+    {
+        for (auto size = missing_reply_size(); size != 0; size = missing_reply_size())
+        {
+            if (!read_some(size, MSG_DONTWAIT))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    std::tuple<json_server::error_code, nlohmann::json> ServerConnection::receive()
+    {
+        m_is_in_step = false;
+        wait_for_reply();
+        m_is_in_step = true;
+        uint32_t sz{0};
+        std::memcpy(&sz, m_receive_buffer.data() + m_receive_begin, sizeof(uint32_t));
+
+        const auto *const payload = m_receive_buffer.data() + m_receive_begin + sizeof(uint32_t);
+        m_receive_begin += sizeof(uint32_t) + sz;
+        if (m_in_flight == 0)
+        {
+            throw json_server::InternalException(lh::nostd::source_location::current(), "Unexpected reply");
+        }
+        const auto request_id = static_cast<uint32_t>(m_next_request_id - m_in_flight);
+        --m_in_flight;
+        if (sz == 0 || payload[0] != details::PROTOCOL_MAGIC)
+        {
+            const auto j_obj = nlohmann::json::from_msgpack(payload, payload + sz);
+            return {static_cast<json_server::error_code>(j_obj.at("err_code").get<int>()), j_obj.at("value")};
+        }
+
+        details::ReplyHeader header;
+        if (sz < sizeof(header))
+        {
+            throw json_server::InternalException(lh::nostd::source_location::current(), "Truncated reply header");
+        }
+        std::memcpy(&header, payload, sizeof(header));
+        if (header.version != details::PROTOCOL_VERSION)
+        {
+            return {json_server::error_code::protocol, nullptr};
+        }
+        if (header.request_id != request_id)
+        {
+            throw json_server::InternalException(lh::nostd::source_location::current(),
+                                                 "Reply to request {} while expecting the one to {}", header.request_id,
+                                                 request_id);
+        }
+        if ((header.flags & details::REPLY_FLAG_VALUE) == 0)
+        {
+            return {header.err_code, nullptr};
+        }
+        return {header.err_code, nlohmann::json::from_msgpack(payload + sizeof(header), payload + sz)};
+    }
+
+    bool ServerConnection::is_notification_next() const noexcept
+    {
+        uint32_t sz{0};
+        std::memcpy(&sz, m_receive_buffer.data() + m_receive_begin, sizeof(uint32_t));
+        const auto *const payload = m_receive_buffer.data() + m_receive_begin + sizeof(uint32_t);
+        return sz >= sizeof(details::ReplyHeader) && payload[0] == details::PROTOCOL_MAGIC &&
+               (payload[offsetof(details::ReplyHeader, flags)] & details::REPLY_FLAG_NOTIFICATION) != 0;
+    }
+
+    std::tuple<uint32_t, json_server::error_code, nlohmann::json> ServerConnection::receive_notification()
+    {
+        wait_for_reply();
+        uint32_t sz{0};
+        std::memcpy(&sz, m_receive_buffer.data() + m_receive_begin, sizeof(uint32_t));
+
+        const auto *const payload = m_receive_buffer.data() + m_receive_begin + sizeof(uint32_t);
+        m_receive_begin += sizeof(uint32_t) + sz;
+        details::ReplyHeader header;
+        if (sz < sizeof(header))
+        {
+            throw json_server::InternalException(lh::nostd::source_location::current(), "Truncated reply header");
+        }
+        std::memcpy(&header, payload, sizeof(header));
+        return {header.request_id, header.err_code,
+                nlohmann::json::from_msgpack(payload + sizeof(header), payload + sz)};
+    }
+
+    std::size_t encode_array_header(const std::size_t size, std::array<uint8_t, 5> &header)
+    {
+        const auto count = static_cast<uint32_t>(size);
+        if (count < 16)
+        {
+            header[0] = static_cast<uint8_t>(0x90 | count);
+            return 1;
+        }
+        // array 32, big endian
+        std::size_t header_size = 0;
+        header[header_size++] = 0xdd;
+        for (int shift = 24; shift >= 0; shift -= 8)
+        {
+            header[header_size++] = static_cast<uint8_t>(count >> shift);
+        }
+        return header_size;
+    }
+
 } // namespace impl
 
 EndpointConnection::EndpointConnection(const std::string &resource_path, const bool exclusive,
-                                       const std::filesystem::path &socket_file)
-    : m_resource_path(resource_path), m_socket_file(socket_file), m_is_locked(false)
+                                       const std::filesystem::path &socket_file, const details::transport transport)
+    : m_resource_path(resource_path), m_server(std::make_unique<impl::ServerConnection>(socket_file, transport)),
+      m_is_locked(false)
 {
-    if (!m_srv_con.connect(sockpp::unix_address(m_socket_file)))
+    resolve();
+    if (exclusive)
     {
-        throw json_server::RuntimeException(json_server::error_code::socket_error,
-                                            "Unable to connect to socket file {}", m_socket_file.string());
+        lock();
     }
+}
 
-    if (exclusive)
+EndpointConnection::EndpointConnection(ConnectionPool &pool, const std::string &resource_path)
+    : m_resource_path(resource_path), m_server(pool.acquire()), m_pool(&pool), m_is_locked(false)
+{
+    // Pooled endpoints are short-lived, so the path is sent with every request instead of resolving it first
+}
+
+EndpointConnection &EndpointConnection::operator=(EndpointConnection &&other) noexcept
+{
+    if (this != &other)
     {
-        lock();
+        close();
+        m_resource_path = std::move(other.m_resource_path);
+        m_server = std::move(other.m_server);
+        m_pool = std::exchange(other.m_pool, nullptr);
+        m_is_locked = std::exchange(other.m_is_locked, false);
+        m_handle = std::move(other.m_handle);
+        m_is_binary = other.m_is_binary;
+        m_send_buffer = std::move(other.m_send_buffer);
     }
+    return *this;
 }
 
-void EndpointConnection::send_request(const nlohmann::json &req)
+void EndpointConnection::resolve()
 {
-    // Transmit size and payload
-    const auto as_msgpack = nlohmann::json::to_msgpack(req);
-    details::transmit_size_info(m_srv_con, static_cast<uint32_t>(as_msgpack.size()));
+    send_request(details::request_cmd::resolve);
+    auto [err, j_handle] = m_server->receive();
+    if (err == json_server::error_code::protocol)
+    {
+        // The server does not speak our version of the binary protocol: fall back to msgpack maps
+        m_is_binary = false;
+        send_request(details::request_cmd::resolve);
+        std::tie(err, j_handle) = m_server->receive();
+    }
 
-    const auto ret = m_srv_con.write_n(as_msgpack.data(), as_msgpack.size());
-    if (ret == -1)
+    // Keep sending the path if it cannot be resolved; requests then fail with the error
+    if (err == json_server::error_code::none)
     {
-        throw json_server::InternalException(lh::nostd::source_location::current(), "Write failed with code {}, msg {}",
-                                             m_srv_con.last_error(), m_srv_con.last_error_str());
+        m_handle = j_handle.get<uint64_t>();
+    }
+}
+
+void EndpointConnection::send_request(const details::request_cmd cmd, const nlohmann::json *val)
+{
+    // Header, path (or handle) and value are sent straight from where they are, only the value is encoded into the
+    // send buffer
+    m_send_buffer.clear();
+    std::array<iovec, 3> parts{};
+    details::RequestHeader header;
+    if (m_is_binary)
+    {
+        header.cmd = cmd;
+        header.request_id = m_server->next_request_id();
+        const void *target = m_resource_path.data();
+        header.path_size = static_cast<uint32_t>(m_resource_path.size());
+        if (m_handle)
+        {
+            header.flags |= details::REQUEST_FLAG_HANDLE;
+            target = &*m_handle;
+            header.path_size = sizeof(uint64_t);
+        }
+        if (val != nullptr)
+        {
+            nlohmann::json::to_msgpack(*val, m_send_buffer);
+        }
+        parts[0] = {&header, sizeof(header)};
+        parts[1] = {const_cast<void *>(target), header.path_size};
     }
-    if (static_cast<size_t>(ret) != as_msgpack.size())
+    else
     {
-        throw json_server::InternalException(lh::nostd::source_location::current(),
-                                             "Write failed: not all bytes transmitted", ret);
+        nlohmann::json req;
+        req["cmd"] = static_cast<uint8_t>(cmd);
+        if (m_handle)
+        {
+            req["handle"] = *m_handle;
+        }
+        else
+        {
+            req["path"] = m_resource_path;
+        }
+        if (val != nullptr)
+        {
+            req["value"] = *val;
+        }
+        nlohmann::json::to_msgpack(req, m_send_buffer);
     }
+    parts[2] = {m_send_buffer.data(), m_send_buffer.size()};
+
+    m_server->send(parts);
 }
 
-void EndpointConnection::lock()
+void EndpointConnection::lock(const details::lock_mode mode)
 {
     if (m_is_locked)
     {
         return;
     }
-    nlohmann::json req;
-    req["cmd"] = static_cast<uint8_t>(details::request_cmd::lock);
-    req["path"] = m_resource_path;
-    send_request(req);
+    check_lockable();
+    const nlohmann::json j_mode = static_cast<uint8_t>(mode);
+    send_request(details::request_cmd::lock, &j_mode);
 
     // Receive answer
-    const auto [err, _] = read_server_reply();
+    const auto [err, _] = m_server->receive();
     if (err != json_server::error_code::none)
     {
         throw json_server::RuntimeException(err, "lock failed for {}: ", m_resource_path);
@@ -128,47 +461,85 @@ void EndpointConnection::lock()
     m_is_locked = true;
 }
 
-void EndpointConnection::unlock()
+bool EndpointConnection::try_lock(const std::chrono::milliseconds timeout, const details::lock_mode mode)
+{
+    if (m_is_locked)
+    {
+        return true;
+    }
+    check_lockable();
+    const nlohmann::json j_args = {static_cast<uint8_t>(mode),
+                                   std::chrono::duration_cast<std::chrono::microseconds>(timeout).count()};
+    send_request(details::request_cmd::lock, &j_args);
+
+    // Receive answer
+    const auto [err, _] = m_server->receive();
+    if (err == json_server::error_code::timeout)
+    {
+        return false;
+    }
+    if (err != json_server::error_code::none)
+    {
+        throw json_server::RuntimeException(err, "lock failed for {}: ", m_resource_path);
+    }
+
+    m_is_locked = true;
+    return true;
+}
+
+void EndpointConnection::check_lockable() const
+{
+    if (m_pool != nullptr)
+    {
+        // The lock would be owned by the pooled connection, and pass to its next borrower
+        throw json_server::RuntimeException(json_server::error_code::lock,
+                                            "lock failed for {}: pooled connections take no locks", m_resource_path);
+    }
+}
+
+void EndpointConnection::renew()
 {
     if (!m_is_locked)
     {
-        throw json_server::RuntimeException(json_server::error_code::lock, "unlock failed for {}: was not locked",
+        throw json_server::RuntimeException(json_server::error_code::lock, "renew failed for {}: was not locked",
                                             m_resource_path);
     }
-    nlohmann::json req;
-    req["cmd"] = static_cast<uint8_t>(details::request_cmd::unlock);
-    req["path"] = m_resource_path;
-    send_request(req);
+    send_request(details::request_cmd::renew);
 
     // Receive answer
-    const auto [err, _] = read_server_reply();
+    const auto [err, _] = m_server->receive();
     if (err != json_server::error_code::none)
     {
-        throw json_server::RuntimeException(err, "unlock failed for {}", m_resource_path);
+        // The lease expired
+        m_is_locked = false;
+        throw json_server::RuntimeException(err, "renew failed for {}", m_resource_path);
     }
 }
 
-std::tuple<json_server::error_code, nlohmann::json> EndpointConnection::read_server_reply()
+void EndpointConnection::unlock()
 {
-    const auto sz = details::receive_size_info(m_srv_con);
-    std::vector<uint8_t> buffer;
-    buffer.resize(sz);
+    if (!m_is_locked)
+    {
+        throw json_server::RuntimeException(json_server::error_code::lock, "unlock failed for {}: was not locked",
+                                            m_resource_path);
+    }
+    send_request(details::request_cmd::unlock);
+    m_is_locked = false;
 
-    m_srv_con.read_n(buffer.data(), buffer.size());
-    nlohmann::json j_obj;
-    j_obj = nlohmann::json::from_msgpack(buffer);
-    return {static_cast<json_server::error_code>(j_obj.at("err_code").get<int>()), j_obj.at("value")};
+    // Receive answer; fails if the lease expired
+    const auto [err, _] = m_server->receive();
+    if (err != json_server::error_code::none)
+    {
+        throw json_server::RuntimeException(err, "unlock failed for {}", m_resource_path);
+    }
 }
 
 nlohmann::json EndpointConnection::get_impl()
 {
-    nlohmann::json req;
-    req["cmd"] = static_cast<uint8_t>(details::request_cmd::read);
-    req["path"] = m_resource_path;
-    send_request(req);
+    send_request(details::request_cmd::read);
 
     // Receive answer
-    const auto [err, j_val] = read_server_reply();
+    const auto [err, j_val] = m_server->receive();
     if (err != json_server::error_code::none)
     {
         throw json_server::RuntimeException(err, "get failed for {}", m_resource_path);
@@ -178,21 +549,36 @@ nlohmann::json EndpointConnection::get_impl()
 
 void EndpointConnection::set_impl(const nlohmann::json &val)
 {
-    // Construct request
-    nlohmann::json req;
-    req["cmd"] = static_cast<uint8_t>(details::request_cmd::write);
-    req["path"] = m_resource_path;
-    req["value"] = val;
-    send_request(req);
+    send_request(details::request_cmd::write, &val);
 
     // Receive answer
-    const auto [err, _] = read_server_reply();
+    const auto [err, _] = m_server->receive();
     if (err != json_server::error_code::none)
     {
         throw json_server::RuntimeException(err, "set failed for {}", m_resource_path);
     }
 }
 
+std::pair<bool, types::BasicType> EndpointConnection::update_impl(const details::update_op op,
+                                                                  const types::BasicType &operand,
+                                                                  const types::BasicType *desired)
+{
+    auto j_args = nlohmann::json::array({static_cast<uint8_t>(op), impl::basic_to_json(operand)});
+    if (desired != nullptr)
+    {
+        j_args.push_back(impl::basic_to_json(*desired));
+    }
+    send_request(details::request_cmd::update, &j_args);
+
+    // Receive answer: [changed, previous value]
+    const auto [err, j_val] = m_server->receive();
+    if (err != json_server::error_code::none)
+    {
+        throw json_server::RuntimeException(err, "update failed for {}", m_resource_path);
+    }
+    return {j_val.at(0).get<bool>(), impl::json_to_basic(j_val.at(1))};
+}
+
 types::BasicType EndpointConnection::get_impl_basic()
 {
     return impl::json_to_basic(get_impl());
@@ -200,48 +586,772 @@ types::BasicType EndpointConnection::get_impl_basic()
 
 types::CompoundType EndpointConnection::get_impl_array()
 {
-    const auto j_val = get_impl();
+    return impl::json_to_compound(get_impl());
+}
+
+void EndpointConnection::set_impl_basic(const types::BasicType &val)
+{
+    set_impl(impl::basic_to_json(val));
+}
+
+void EndpointConnection::set_impl_array(const types::CompoundType &val_array)
+{
+    set_impl(impl::compound_to_json(val_array));
+}
+
+EndpointConnection::~EndpointConnection()
+{
+    close();
+}
 
-    if (!j_val.is_array())
+void EndpointConnection::close() noexcept
+{
+    if (!m_server)
+    {
+        // Moved from
+        return;
+    }
+    if (m_is_locked)
     {
-        throw json_server::InternalException(lh::nostd::source_location::current(), "Not an array type");
+        try
+        {
+            unlock();
+        }
+        catch (const std::exception &)
+        {
+            // The lease expired meanwhile (RuntimeException), or the server is gone (InternalException)
+        }
     }
-    if (j_val.empty())
+    if (m_pool != nullptr)
     {
-        return {};
+        m_pool->release(std::move(m_server));
     }
+    m_server.reset();
+}
+
+struct Pipeline::State
+{
+    // Oldest first
+    std::deque<std::string> in_flight_paths{};
+};
 
-    types::CompoundType ret;
-    ret.resize(j_val.size());
-    std::transform(j_val.begin(), j_val.end(), ret.begin(), impl::json_to_basic);
-    return ret;
+Pipeline::Pipeline(const std::filesystem::path &socket_file, const details::transport transport)
+    : m_server(socket_file, transport), m_state(std::make_unique<State>())
+{
 }
 
-void EndpointConnection::set_impl_basic(const types::BasicType &val)
+Pipeline::Pipeline(Pipeline &&) noexcept = default;
+Pipeline &Pipeline::operator=(Pipeline &&) noexcept = default;
+Pipeline::~Pipeline() = default;
+
+uint32_t Pipeline::get(const std::string &path)
 {
-    set_impl(impl::basic_to_json(val));
+    const auto request_id = m_server.next_request_id();
+    send_request(details::request_cmd::read, path, nullptr);
+    return request_id;
 }
 
-void EndpointConnection::set_impl_array(const types::CompoundType &val_array)
+void Pipeline::send_set_basic(const std::string &path, const types::BasicType &val)
+{
+    const auto j_val = impl::basic_to_json(val);
+    send_request(details::request_cmd::write, path, &j_val);
+}
+
+void Pipeline::send_set_array(const std::string &path, const types::CompoundType &val_array)
+{
+    const auto j_val = impl::compound_to_json(val_array);
+    send_request(details::request_cmd::write, path, &j_val);
+}
+
+void Pipeline::send_request(const details::request_cmd cmd, const std::string &path, const nlohmann::json *val)
+{
+    m_server.send_request(cmd, path, std::nullopt, val);
+    m_state->in_flight_paths.push_back(path);
+}
+
+uint32_t Pipeline::receive()
+{
+    const auto request_id = static_cast<uint32_t>(m_server.next_request_id() - m_server.in_flight());
+    auto [err, j_val] = m_server.receive();
+    m_path = std::move(m_state->in_flight_paths.front());
+    m_state->in_flight_paths.pop_front();
+    m_error = err;
+    m_value = std::make_unique<nlohmann::json>(std::move(j_val));
+    return request_id;
+}
+
+const nlohmann::json &Pipeline::result_impl() const
 {
-    nlohmann::json set_val;
-    for (const auto &val: val_array)
+    if (m_error != json_server::error_code::none)
+    {
+        throw json_server::RuntimeException(m_error, "request failed for {}", m_path);
+    }
+    if (!m_value)
     {
-        set_val.push_back(impl::basic_to_json(val));
+        throw json_server::InternalException(lh::nostd::source_location::current(), "No reply received");
     }
-    set_impl(set_val);
+    return *m_value;
 }
 
-EndpointConnection::~EndpointConnection()
+types::BasicType Pipeline::result_basic() const
 {
-    if (m_is_locked)
+    return impl::json_to_basic(result_impl());
+}
+
+types::CompoundType Pipeline::result_array() const
+{
+    return impl::json_to_compound(result_impl());
+}
+
+struct AsyncConnection::State
+{
+    // Protects sending and the members below
+    std::mutex mutex{};
+    // Completions of the requests in flight, oldest first
+    std::deque<Completion> completions{};
+    // Subscriptions by ID
+    std::unordered_map<uint32_t, std::shared_ptr<Notification>> watchers{};
+    bool is_closed{false};
+    std::thread io_thread{};
+};
+
+AsyncConnection::AsyncConnection(const std::filesystem::path &socket_file, const details::transport transport,
+                                 const bool io_thread)
+    : m_server(socket_file, transport), m_state(std::make_unique<State>())
+{
+    if (io_thread)
     {
-        unlock();
+        m_state->io_thread = std::thread(&AsyncConnection::io_loop, this);
     }
-    if (m_srv_con.is_open())
+}
+
+AsyncConnection::~AsyncConnection()
+{
+    if (m_state->io_thread.joinable())
     {
-        m_srv_con.close();
+        // Wake up the I/O thread
+        m_server.shutdown();
+        m_state->io_thread.join();
     }
+    close();
+}
+
+void AsyncConnection::send_set_basic(const std::string &path, const types::BasicType &val, SetCallback callback)
+{
+    const auto j_val = impl::basic_to_json(val);
+    send_request(details::request_cmd::write, path, std::nullopt, &j_val,
+                 [callback = std::move(callback)](const json_server::error_code err, const nlohmann::json &)
+                 { callback(err); });
+}
+
+void AsyncConnection::send_set_array(const std::string &path, const types::CompoundType &val_array,
+                                     SetCallback callback)
+{
+    const auto j_val = impl::compound_to_json(val_array);
+    send_request(details::request_cmd::write, path, std::nullopt, &j_val,
+                 [callback = std::move(callback)](const json_server::error_code err, const nlohmann::json &)
+                 { callback(err); });
+}
+
+void AsyncConnection::send_request(const details::request_cmd cmd, const std::string &path,
+                                   const std::optional<uint64_t> handle, const nlohmann::json *val,
+                                   Completion completion)
+{
+    const std::scoped_lock lock(m_state->mutex);
+    if (m_state->is_closed)
+    {
+        throw json_server::RuntimeException(json_server::error_code::socket_error, "Connection closed");
+    }
+    m_server.send_request(cmd, path, handle, val);
+    m_state->completions.push_back(std::move(completion));
+}
+
+uint32_t AsyncConnection::watch_version(const std::string &path, VersionCallback callback,
+                                       const std::chrono::microseconds min_interval)
+{
+    return add_watch(path, true, min_interval,
+                     [callback = std::move(callback)](const json_server::error_code err, const uint64_t version,
+                                                      const nlohmann::json *) { callback(err, version); });
+}
+
+uint32_t AsyncConnection::add_watch(const std::string &path, const bool version_only,
+                                   const std::chrono::microseconds min_interval, Notification notification)
+{
+    const nlohmann::json j_interval = min_interval.count();
+    const std::scoped_lock lock(m_state->mutex);
+    if (m_state->is_closed)
+    {
+        throw json_server::RuntimeException(json_server::error_code::socket_error, "Connection closed");
+    }
+    // The subscription is identified by the ID of the watch request
+    const auto id = m_server.next_request_id();
+    m_server.send_request(details::request_cmd::watch, path, std::nullopt,
+                          min_interval.count() > 0 ? &j_interval : nullptr,
+                          version_only ? details::REQUEST_FLAG_VERSION_ONLY : 0);
+    m_state->watchers.emplace(id, std::make_shared<Notification>(std::move(notification)));
+    m_state->completions.emplace_back(
+        [this, id](const json_server::error_code err, const nlohmann::json &)
+        {
+            if (err == json_server::error_code::none)
+            {
+                return;
+            }
+            std::shared_ptr<Notification> watcher;
+            {
+                const std::scoped_lock watchers_lock(m_state->mutex);
+                const auto it = m_state->watchers.find(id);
+                if (it == m_state->watchers.end())
+                {
+                    return;
+                }
+                watcher = std::move(it->second);
+                m_state->watchers.erase(it);
+            }
+            (*watcher)(err, 0, nullptr);
+        });
+    return id;
+}
+
+void AsyncConnection::unwatch(const uint32_t id)
+{
+    {
+        const std::scoped_lock lock(m_state->mutex);
+        m_state->watchers.erase(id);
+    }
+    // Notifications still on their way are dropped, since the subscription is unknown now
+    const nlohmann::json j_id = id;
+    send_request(details::request_cmd::unwatch, "", std::nullopt, &j_id,
+                 [](const json_server::error_code, const nlohmann::json &) {});
+}
+
+void AsyncConnection::complete_next()
+{
+    Completion completion;
+    std::shared_ptr<Notification> watcher;
+    json_server::error_code err{json_server::error_code::none};
+    nlohmann::json j_val;
+    {
+        const std::scoped_lock lock(m_state->mutex);
+        if (m_server.is_notification_next())
+        {
+            uint32_t id{0};
+            std::tie(id, err, j_val) = m_server.receive_notification();
+            if (const auto it = m_state->watchers.find(id); it != m_state->watchers.end())
+            {
+                watcher = it->second;
+            }
+        }
+        else
+        {
+            std::tie(err, j_val) = m_server.receive();
+            completion = std::move(m_state->completions.front());
+            m_state->completions.pop_front();
+        }
+    }
+
+    if (completion)
+    {
+        completion(err, j_val);
+    }
+    else if (watcher)
+    {
+        // [version, value], or [version] without value
+        (*watcher)(err, j_val.at(0).get<uint64_t>(), j_val.size() > 1 ? &j_val.at(1) : nullptr);
+    }
+}
+
+void AsyncConnection::close()
+{
+    std::deque<Completion> completions;
+    std::unordered_map<uint32_t, std::shared_ptr<Notification>> watchers;
+    {
+        const std::scoped_lock lock(m_state->mutex);
+        m_state->is_closed = true;
+        completions.swap(m_state->completions);
+        watchers.swap(m_state->watchers);
+    }
+    for (const auto &completion: completions)
+    {
+        completion(json_server::error_code::socket_error, nullptr);
+    }
+    for (const auto &watcher: watchers)
+    {
+        (*watcher.second)(json_server::error_code::socket_error, 0, nullptr);
+    }
+}
+
+void AsyncConnection::io_loop()
+{
+    try
+    {
+        while (true)
+        {
+            m_server.wait_for_reply();
+            complete_next();
+        }
+    }
+    catch (const std::exception &)
+    {
+        // Connection closed
+    }
+    close();
+}
+
+void AsyncConnection::process_replies()
+{
+    try
+    {
+        while (m_server.poll())
+        {
+            complete_next();
+        }
+    }
+    catch (const std::exception &)
+    {
+        close();
+    }
+}
+
+struct Session::State
+{
+    // Protects handles
+    std::mutex mutex{};
+    // Handles of the resolved paths; endpoints point to the keys
+    std::unordered_map<std::string, uint64_t> handles{};
+};
+
+Session::Session(const std::filesystem::path &socket_file, const details::transport transport)
+    : m_connection(socket_file, transport), m_state(std::make_unique<State>())
+{
+}
+
+Session::~Session() = default;
+
+Session::Endpoint Session::endpoint(const std::string &path)
+{
+    {
+        const std::scoped_lock lock(m_state->mutex);
+        if (const auto it = m_state->handles.find(path); it != m_state->handles.end())
+        {
+            return {*this, it->first, it->second};
+        }
+    }
+
+    // Resolve without holding the lock; paths resolved concurrently by several threads end up with a handle each,
+    // only the first one is kept
+    const auto handle = request(details::request_cmd::resolve, path, std::nullopt, nullptr).get<uint64_t>();
+    const std::scoped_lock lock(m_state->mutex);
+    const auto [it, _] = m_state->handles.emplace(path, handle);
+    return {*this, it->first, it->second};
+}
+
+nlohmann::json Session::request(const details::request_cmd cmd, const std::string &path,
+                                const std::optional<uint64_t> handle, const nlohmann::json *val)
+{
+    // Shared with the completion, which may still be inside set_value() once the caller woke up and returned. `path`
+    // is only used before that.
+    auto promise = std::make_shared<std::promise<nlohmann::json>>();
+    auto future = promise->get_future();
+    m_connection.send_request(cmd, path, handle, val,
+                              [promise, &path](const json_server::error_code err, const nlohmann::json &j_val)
+                              {
+                                  if (err != json_server::error_code::none)
+                                  {
+                                      promise->set_exception(std::make_exception_ptr(
+                                          json_server::RuntimeException(err, "request failed for {}", path)));
+                                      return;
+                                  }
+                                  promise->set_value(j_val);
+                              });
+    return future.get();
+}
+
+types::BasicType Session::get_impl_basic(const Endpoint &endpoint)
+{
+    return impl::json_to_basic(request(details::request_cmd::read, endpoint.path(), endpoint.m_handle, nullptr));
+}
+
+types::CompoundType Session::get_impl_array(const Endpoint &endpoint)
+{
+    return impl::json_to_compound(request(details::request_cmd::read, endpoint.path(), endpoint.m_handle, nullptr));
+}
+
+void Session::set_impl_basic(const Endpoint &endpoint, const types::BasicType &val)
+{
+    const auto j_val = impl::basic_to_json(val);
+    request(details::request_cmd::write, endpoint.path(), endpoint.m_handle, &j_val);
+}
+
+void Session::set_impl_array(const Endpoint &endpoint, const types::CompoundType &val_array)
+{
+    const auto j_val = impl::compound_to_json(val_array);
+    request(details::request_cmd::write, endpoint.path(), endpoint.m_handle, &j_val);
+}
+
+ConnectionPool::Endpoint::Endpoint(ConnectionPool &pool, std::string path,
+                                   std::unique_ptr<impl::ServerConnection> server) noexcept
+    : m_pool(&pool), m_path(std::move(path)), m_server(std::move(server))
+{
+}
+
+ConnectionPool::Endpoint::~Endpoint()
+{
+    if (m_server)
+    {
+        m_pool->release(std::move(m_server));
+    }
+}
+
+nlohmann::json ConnectionPool::Endpoint::request(const details::request_cmd cmd, const nlohmann::json *val)
+{
+    m_server->send_request(cmd, m_path, std::nullopt, val);
+    auto [err, j_val] = m_server->receive();
+    if (err != json_server::error_code::none)
+    {
+        throw json_server::RuntimeException(err, "request failed for {}", m_path);
+    }
+    return j_val;
+}
+
+types::BasicType ConnectionPool::Endpoint::get_impl_basic()
+{
+    return impl::json_to_basic(request(details::request_cmd::read, nullptr));
+}
+
+types::CompoundType ConnectionPool::Endpoint::get_impl_array()
+{
+    return impl::json_to_compound(request(details::request_cmd::read, nullptr));
+}
+
+void ConnectionPool::Endpoint::set_impl_basic(const types::BasicType &val)
+{
+    const auto j_val = impl::basic_to_json(val);
+    request(details::request_cmd::write, &j_val);
+}
+
+void ConnectionPool::Endpoint::set_impl_array(const types::CompoundType &val_array)
+{
+    const auto j_val = impl::compound_to_json(val_array);
+    request(details::request_cmd::write, &j_val);
+}
+
+struct ConnectionPool::State
+{
+    struct IdleConnection
+    {
+        std::unique_ptr<impl::ServerConnection> server;
+        std::chrono::steady_clock::time_point since;
+    };
+
+    std::mutex mutex{};
+    // Signalled when a connection is returned
+    std::condition_variable returned{};
+    // Most recently returned last
+    std::vector<IdleConnection> idle{};
+    std::size_t num_open{0};
+};
+
+ConnectionPool::ConnectionPool(const std::filesystem::path &socket_file, const details::transport transport,
+                               const PoolLimits &limits)
+    : m_socket_file(socket_file), m_transport(transport), m_limits(limits), m_state(std::make_unique<State>())
+{
+}
+
+ConnectionPool::~ConnectionPool() = default;
+
+ConnectionPool &ConnectionPool::shared(const std::filesystem::path &socket_file, const details::transport transport)
+{
+    // Never destroyed, so that endpoints may outlive static objects
+    static auto *const pools = new std::map<std::pair<std::string, details::transport>, ConnectionPool>();
+    static std::mutex pools_mutex;
+
+    const std::scoped_lock lock(pools_mutex);
+    const auto [it, _] = pools->try_emplace({socket_file.string(), transport}, socket_file, transport);
+    return it->second;
+}
+
+ConnectionPool::Endpoint ConnectionPool::endpoint(const std::string &path)
+{
+    return {*this, path, acquire()};
+}
+
+std::size_t ConnectionPool::num_open() const
+{
+    const std::scoped_lock lock(m_state->mutex);
+    return m_state->num_open;
+}
+
+std::size_t ConnectionPool::num_idle() const
+{
+    const std::scoped_lock lock(m_state->mutex);
+    return m_state->idle.size();
+}
+
+std::unique_ptr<impl::ServerConnection> ConnectionPool::acquire()
+{
+    std::unique_lock lock(m_state->mutex);
+    while (true)
+    {
+        while (!m_state->idle.empty())
+        {
+            auto idle = std::move(m_state->idle.back());
+            m_state->idle.pop_back();
+
+            // An idle connection has nothing to read, unless the server closed it
+            pollfd fds{idle.server->handle(), POLLIN, 0};
+            const bool is_closed = ::poll(&fds, 1, 0) != 0;
+            if (!is_closed && std::chrono::steady_clock::now() - idle.since <= m_limits.max_idle_time)
+            {
+                return std::move(idle.server);
+            }
+            --m_state->num_open;
+        }
+        if (m_state->num_open < m_limits.max_connections)
+        {
+            break;
+        }
+        m_state->returned.wait(lock);
+    }
+
+    // Connect without holding the lock
+    ++m_state->num_open;
+    lock.unlock();
+    try
+    {
+        return std::make_unique<impl::ServerConnection>(m_socket_file, m_transport);
+    }
+    catch (...)
+    {
+        lock.lock();
+        --m_state->num_open;
+        m_state->returned.notify_one();
+        throw;
+    }
+}
+
+void ConnectionPool::release(std::unique_ptr<impl::ServerConnection> server)
+{
+    {
+        const std::scoped_lock lock(m_state->mutex);
+        // Failed requests leave the connection usable, unless they were interrupted halfway
+        if (server->is_in_step() && server->in_flight() == 0 && m_state->idle.size() < m_limits.max_idle)
+        {
+            m_state->idle.push_back({std::move(server), std::chrono::steady_clock::now()});
+        }
+        else
+        {
+            --m_state->num_open;
+        }
+    }
+    m_state->returned.notify_one();
+}
+
+Batch::Batch(const std::filesystem::path &socket_file, const details::transport transport)
+    : m_server(socket_file, transport)
+{
+}
+
+Batch::Batch(Batch &&) noexcept = default;
+Batch &Batch::operator=(Batch &&) noexcept = default;
+Batch::~Batch() = default;
+
+std::size_t Batch::get(const std::string &path)
+{
+    add(details::batch_op::get, path, nullptr);
+    return m_paths.size() - 1;
+}
+
+void Batch::add_set_basic(const std::string &path, const types::BasicType &val)
+{
+    const auto j_val = impl::basic_to_json(val);
+    add(details::batch_op::set, path, &j_val);
+}
+
+void Batch::add_set_array(const std::string &path, const types::CompoundType &val_array)
+{
+    const auto j_val = impl::compound_to_json(val_array);
+    add(details::batch_op::set, path, &j_val);
+}
+
+void Batch::add(const details::batch_op op, const std::string &path, const nlohmann::json *val)
+{
+    auto item = nlohmann::json::array({static_cast<uint8_t>(op), path});
+    if (val != nullptr)
+    {
+        item.push_back(*val);
+    }
+    nlohmann::json::to_msgpack(item, m_items);
+    m_paths.push_back(path);
+}
+
+void Batch::clear()
+{
+    m_paths.clear();
+    m_items.clear();
+    m_errors.clear();
+    m_values.clear();
+}
+
+void Batch::execute()
+{
+    // The encoded operations only need the array header in front
+    std::array<uint8_t, 5> array_header{};
+    const auto header_size = impl::encode_array_header(m_paths.size(), array_header);
+
+    details::RequestHeader header;
+    header.cmd = details::request_cmd::batch;
+    header.request_id = m_server.next_request_id();
+    m_server.send({iovec{&header, sizeof(header)}, iovec{array_header.data(), header_size},
+                   iovec{m_items.data(), m_items.size()}});
+
+    const auto [err, j_results] = m_server.receive();
+    if (err != json_server::error_code::none)
+    {
+        throw json_server::RuntimeException(err, "batch failed");
+    }
+    m_errors.clear();
+    m_values.clear();
+    for (const auto &j_result: j_results)
+    {
+        m_errors.push_back(static_cast<json_server::error_code>(j_result.at(0).get<int>()));
+        m_values.push_back(j_result.at(1));
+    }
+    if (m_values.size() != m_paths.size())
+    {
+        throw json_server::InternalException(lh::nostd::source_location::current(), "Invalid batch reply");
+    }
+}
+
+json_server::error_code Batch::error(const std::size_t idx) const
+{
+    return m_errors.at(idx);
+}
+
+const nlohmann::json &Batch::result_impl(const std::size_t idx) const
+{
+    if (const auto err = error(idx); err != json_server::error_code::none)
+    {
+        throw json_server::RuntimeException(err, "batch operation failed for {}", m_paths.at(idx));
+    }
+    return m_values.at(idx);
+}
+
+types::BasicType Batch::result_basic(const std::size_t idx) const
+{
+    return impl::json_to_basic(result_impl(idx));
+}
+
+types::CompoundType Batch::result_array(const std::size_t idx) const
+{
+    return impl::json_to_compound(result_impl(idx));
+}
+
+Transaction::Transaction(const std::filesystem::path &socket_file, const details::transport transport)
+    : m_server(socket_file, transport)
+{
+}
+
+Transaction::Transaction(Transaction &&) noexcept = default;
+Transaction &Transaction::operator=(Transaction &&) noexcept = default;
+Transaction::~Transaction() = default;
+
+std::size_t Transaction::check_exists(const std::string &path)
+{
+    add_check(details::transaction_check::exists, path, nullptr);
+    return m_num_checks - 1;
+}
+
+std::size_t Transaction::check_version(const std::string &path, const uint64_t version)
+{
+    const nlohmann::json j_version = version;
+    add_check(details::transaction_check::version, path, &j_version);
+    return m_num_checks - 1;
+}
+
+void Transaction::add_check_basic(const std::string &path, const types::BasicType &val)
+{
+    const auto j_val = impl::basic_to_json(val);
+    add_check(details::transaction_check::equals, path, &j_val);
+}
+
+void Transaction::add_check_array(const std::string &path, const types::CompoundType &val_array)
+{
+    const auto j_val = impl::compound_to_json(val_array);
+    add_check(details::transaction_check::equals, path, &j_val);
+}
+
+void Transaction::add_check(const details::transaction_check op, const std::string &path, const nlohmann::json *val)
+{
+    auto item = nlohmann::json::array({static_cast<uint8_t>(op), path});
+    if (val != nullptr)
+    {
+        item.push_back(*val);
+    }
+    nlohmann::json::to_msgpack(item, m_checks);
+    ++m_num_checks;
+}
+
+void Transaction::add_set_basic(const std::string &path, const types::BasicType &val)
+{
+    add_set(path, impl::basic_to_json(val));
+}
+
+void Transaction::add_set_array(const std::string &path, const types::CompoundType &val_array)
+{
+    add_set(path, impl::compound_to_json(val_array));
+}
+
+void Transaction::add_set(const std::string &path, const nlohmann::json &val)
+{
+    nlohmann::json::to_msgpack(nlohmann::json::array({path, val}), m_sets);
+    ++m_num_sets;
+}
+
+void Transaction::clear()
+{
+    m_checks.clear();
+    m_sets.clear();
+    m_num_checks = 0;
+    m_num_sets = 0;
+    m_failed_check.reset();
+    m_versions.clear();
+}
+
+bool Transaction::commit()
+{
+    // [checks, sets]: fixarray with two entries, each one an array of encoded items
+    std::array<uint8_t, 5> array_header{};
+    m_request.assign(1, 0x92);
+    auto header_size = impl::encode_array_header(m_num_checks, array_header);
+    m_request.insert(m_request.end(), array_header.begin(), array_header.begin() + header_size);
+    m_request.insert(m_request.end(), m_checks.begin(), m_checks.end());
+    header_size = impl::encode_array_header(m_num_sets, array_header);
+    m_request.insert(m_request.end(), array_header.begin(), array_header.begin() + header_size);
+    m_request.insert(m_request.end(), m_sets.begin(), m_sets.end());
+
+    details::RequestHeader header;
+    header.cmd = details::request_cmd::transaction;
+    header.request_id = m_server.next_request_id();
+    m_server.send({iovec{&header, sizeof(header)}, iovec{m_request.data(), m_request.size()}, iovec{nullptr, 0}});
+
+    const auto [err, j_result] = m_server.receive();
+    if (err != json_server::error_code::none)
+    {
+        throw json_server::RuntimeException(err, "transaction failed");
+    }
+    const auto &j_failed = j_result.at(0);
+    m_failed_check = j_failed.is_null() ? std::nullopt : std::optional<std::size_t>(j_failed.get<std::size_t>());
+    m_versions = j_result.at(1).get<std::vector<uint64_t>>();
+    if (m_versions.size() != m_num_checks)
+    {
+        throw json_server::InternalException(lh::nostd::source_location::current(), "Invalid transaction reply");
+    }
+    return !m_failed_check;
+}
+
+uint64_t Transaction::version(const std::size_t idx) const
+{
+    return m_versions.at(idx);
 }
 
 } // namespace json_client
@@ -1,17 +1,28 @@
 #include "json_server.hpp"
 
-#include <map>
-#include <thread>
-#include <mutex>
-#include <functional>
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstring>
 #include <fstream>
-
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string_view>
+#include <thread>
+#include <vector>
 
 #include "nlohmann/json.hpp"
 #include "sockpp/unix_acceptor.h"
 
 #include "exceptions.hpp"
 #include "details.hpp"
+#include "connection.hpp"
+#include "lock_manager.hpp"
+#include "model.hpp"
+#include "reactor.hpp"
+#include "uring_engine.hpp"
+#include "watch.hpp"
 
 
 using json = nlohmann::json;
@@ -22,141 +33,694 @@ namespace json_server
 
 namespace
 {
+    using connection_ptr = std::shared_ptr<impl::Connection>;
+
+    // State of a client connection after one of its requests has been handled.
+    enum class connection_state
+    {
+        // Ready for the next request
+        idle,
+        // Handed over to some other thread, which resumes processing later
+        busy,
+        // Shut down
+        closed
+    };
+
     sockpp::unix_acceptor g_srv_acceptor{};
-    std::mutex g_model_mutex{};
-    json g_model{};
+    impl::Model g_model{};
     std::filesystem::path g_uds_socket_file{};
-    std::map<std::string, std::mutex> g_mutex_map{};
+    // The event loops and the notification dispatcher run on detached threads for the lifetime of the process, so they
+    // are never destroyed: tearing them down at exit would pull their state away from threads still running. Neither is
+    // the lock manager, whose timers run on a detached thread as well and which connections release their locks with
+    // when they are destroyed.
+    impl::ReactorGroup *g_reactors{nullptr};
+    std::vector<impl::UringEngine *> g_uring_engines{};
+    impl::WatchRegistry *g_watches{nullptr};
+    impl::LockManager *g_locks{nullptr};
 
-    // Accept incoming client connections and dispatch them to the handler function f_callback.
-    void server_loop(std::function<void(sockpp::unix_socket sock)> f_callback)
+    // Accept incoming client connections and hand them to the reactors.
+    void server_loop()
     {
         while (true)
         {
             auto sock = g_srv_acceptor.accept();
-            std::thread thr(f_callback, std::move(sock));
-            thr.detach();
+            if (!sock)
+            {
+                continue;
+            }
+            try
+            {
+                g_reactors->add(std::make_shared<impl::Connection>(std::move(sock)));
+            }
+            catch (const json_server::InternalException &)
+            {
+                // Drop the connection
+            }
         }
     }
 
+    // Open the listening socket for clients at `socket_file`.
+    bool open_listener(const std::filesystem::path &socket_file, const ::details::transport transport)
+    {
+        const sockpp::unix_address addr(socket_file);
+        if (transport == ::details::transport::stream)
+        {
+            return g_srv_acceptor.open(addr);
+        }
+
+        // The acceptor opens stream sockets only, but accepts connections on any listening socket
+        g_srv_acceptor.reset(sockpp::socket::create_handle(AF_UNIX, ::details::socket_type(transport)));
+        if (g_srv_acceptor.is_open() && g_srv_acceptor.bind(addr) && g_srv_acceptor.listen())
+        {
+            return true;
+        }
+        g_srv_acceptor.close();
+        return false;
+    }
+
+    // Wire format of a request; the reply uses the same one.
+    enum class wire_format
+    {
+        // Binary header, see details::RequestHeader
+        binary,
+        // msgpack map of the original protocol
+        msgpack_map
+    };
+
+    // How to reply to a request.
+    struct ReplyFormat
+    {
+        wire_format format{wire_format::binary};
+        // Request ID of binary requests, echoed in the reply
+        uint32_t request_id{0};
+    };
+
+    // A client request decoded from either wire format.
+    struct Request
+    {
+        wire_format format{wire_format::binary};
+        uint32_t request_id{0};
+        ::details::request_cmd cmd{};
+        // Flags of binary requests
+        uint8_t flags{0};
+        std::optional<uint64_t> handle{};
+        std::string_view path{};
+        // msgpack encoded value of binary write requests
+        const uint8_t *value_data{nullptr};
+        std::size_t value_size{0};
+        // Decoded map of msgpack map requests, owns path and value
+        json map{};
+
+        [[nodiscard]] bool has_value() const
+        {
+            return format == wire_format::msgpack_map ? map.contains("value") : value_size != 0;
+        }
+
+        [[nodiscard]] json value() const
+        {
+            if (format == wire_format::msgpack_map)
+            {
+                return map.at("value");
+            }
+            return json::from_msgpack(value_data, value_data + value_size);
+        }
+
+        [[nodiscard]] ReplyFormat reply_format() const noexcept
+        {
+            return {format, request_id};
+        }
+    };
+
+    // Decode a request payload. Throws a RuntimeException for unsupported protocol versions and other exceptions for
+    // malformed requests.
+    Request decode_request(const std::vector<uint8_t> &payload)
+    {
+        Request request;
+        if (payload.empty() || payload.front() != ::details::PROTOCOL_MAGIC)
+        {
+            request.format = wire_format::msgpack_map;
+            request.map = json::from_msgpack(payload);
+            request.cmd = static_cast<::details::request_cmd>(request.map.at("cmd").get<int>());
+            if (const auto it = request.map.find("handle"); it != request.map.end())
+            {
+                request.handle = it->get<uint64_t>();
+            }
+            else
+            {
+                request.path = request.map.at("path").get_ref<const std::string &>();
+            }
+            return request;
+        }
+
+        // The header layout depends on the version, so check it first
+        ::details::RequestHeader header;
+        constexpr auto VERSION_OFFSET = offsetof(::details::RequestHeader, version);
+        if (payload.size() > VERSION_OFFSET && payload[VERSION_OFFSET] != ::details::PROTOCOL_VERSION)
+        {
+            throw json_server::RuntimeException(json_server::error_code::protocol, "Unsupported protocol version {}",
+                                                payload[VERSION_OFFSET]);
+        }
+        if (payload.size() < sizeof(header))
+        {
+            throw json_server::InternalException(lh::nostd::source_location::current(), "Truncated request header");
+        }
+        std::memcpy(&header, payload.data(), sizeof(header));
+        if (header.path_size > payload.size() - sizeof(header))
+        {
+            throw json_server::InternalException(lh::nostd::source_location::current(), "Truncated request path");
+        }
+
+        request.cmd = header.cmd;
+        request.request_id = header.request_id;
+        request.flags = header.flags;
+        const auto *const path_data = payload.data() + sizeof(header);
+        if ((header.flags & ::details::REQUEST_FLAG_HANDLE) != 0)
+        {
+            if (header.path_size != sizeof(uint64_t))
+            {
+                throw json_server::InternalException(lh::nostd::source_location::current(), "Invalid handle size");
+            }
+            uint64_t handle{0};
+            std::memcpy(&handle, path_data, sizeof(handle));
+            request.handle = handle;
+        }
+        else
+        {
+            request.path = std::string_view(reinterpret_cast<const char *>(path_data), header.path_size);
+        }
+        request.value_data = path_data + header.path_size;
+        request.value_size = payload.size() - sizeof(header) - header.path_size;
+        return request;
+    }
+
+    // Append the start of a reply carrying a value in the format `reply` to `out`. The caller appends the msgpack of
+    // the value.
+    void append_reply_header(std::vector<uint8_t> &out, const ReplyFormat &reply, const ::json_server::error_code &err)
+    {
+        if (reply.format == wire_format::binary)
+        {
+            ::details::ReplyHeader header;
+            header.err_code = err;
+            header.flags = ::details::REPLY_FLAG_VALUE;
+            header.request_id = reply.request_id;
+            const auto *const header_bytes = reinterpret_cast<const uint8_t *>(&header);
+            out.insert(out.end(), header_bytes, header_bytes + sizeof(header));
+            return;
+        }
+
+        // The map {"err_code": err, "value": ...}: fixmap with two entries, keys as fixstr, the error code as positive
+        // fixint
+        constexpr std::string_view ERR_CODE_KEY = "err_code";
+        constexpr std::string_view VALUE_KEY = "value";
+        out.push_back(0x82);
+        out.push_back(static_cast<uint8_t>(0xa0 | ERR_CODE_KEY.size()));
+        out.insert(out.end(), ERR_CODE_KEY.begin(), ERR_CODE_KEY.end());
+        out.push_back(static_cast<uint8_t>(err));
+        out.push_back(static_cast<uint8_t>(0xa0 | VALUE_KEY.size()));
+        out.insert(out.end(), VALUE_KEY.begin(), VALUE_KEY.end());
+    }
+
     // Reply calls by sending the value back to the client with optional error.
-    void transmit_server_reply(sockpp::unix_socket &socket, const json &val, const ::json_server::error_code &err)
+    void transmit_server_reply(impl::Connection &conn, const ReplyFormat &reply, const json &val,
+                               const ::json_server::error_code &err)
     {
-        json j_reply;
-        j_reply["value"] = val;
-        j_reply["err_code"] = static_cast<int>(err);
+        conn.send([&](std::vector<uint8_t> &out) {
+            append_reply_header(out, reply, err);
+            json::to_msgpack(val, out);
+        });
+    }
 
-        const auto as_msgpack = json::to_msgpack(j_reply);
+    // Reply calls without a value, only with an optional error.
+    void transmit_server_reply(impl::Connection &conn, const ReplyFormat &reply, const ::json_server::error_code &err)
+    {
+        if (reply.format == wire_format::msgpack_map)
+        {
+            transmit_server_reply(conn, reply, json::value_t::null, err);
+            return;
+        }
+        ::details::ReplyHeader header;
+        header.err_code = err;
+        header.request_id = reply.request_id;
+        conn.send(reinterpret_cast<const uint8_t *>(&header), sizeof(header));
+    }
 
-        // Send size
-        ::details::transmit_size_info(socket, static_cast<uint32_t>(as_msgpack.size()));
+    void process_requests(const connection_ptr &conn);
 
-        // Send payload
-        const auto ret = socket.write_n(as_msgpack.data(), as_msgpack.size());
-        if (ret < 0)
+    // Continue processing the requests of a connection after some other thread took it over. They are handed back to
+    // the event loops rather than processed by the calling thread, which may be in the middle of serving another
+    // client or be the lock manager's timer thread.
+    void resume_requests(const connection_ptr &conn)
+    {
+        if (g_reactors)
         {
-            throw json_server::InternalException(lh::nostd::source_location::current(),
-                                                 "send_error: Unable to send status response: socket error");
+            g_reactors->schedule(conn);
         }
-        if (static_cast<size_t>(ret) != as_msgpack.size())
+        else if (!conn->resume())
         {
-            throw json_server::InternalException(
-                lh::nostd::source_location::current(),
-                "send_error: Unable to send status response: Not all bytes transmitted");
+            process_requests(conn);
         }
     }
 
-    // Handle a client connection.
-    void client_handler(sockpp::unix_socket socket)
+    // Path of a request: either resolved to a handle before, or a temporary handle for the path sent along.
+    impl::PathHandle &request_path(impl::Connection &conn, const Request &request,
+                                   std::optional<impl::PathHandle> &temp)
     {
-        while (true)
+        if (request.handle)
         {
-            // Read the size of the payload to receive
-            const auto expected = ::details::receive_size_info(socket);
-            if (expected == 0)
+            auto &handles = conn.path_handles();
+            if (*request.handle >= handles.size())
             {
-                // Client closed connection
-                socket.close();
-                break;
+                throw json_server::RuntimeException(json_server::error_code::json_path_error, "Unknown path handle {}",
+                                                    *request.handle);
             }
+            return handles[*request.handle];
+        }
+        return temp.emplace(request.path);
+    }
 
-            // Read the actual payload
-            std::vector<uint8_t> payload_buffer;
-            payload_buffer.resize(expected);
-            auto ret = socket.read_n(payload_buffer.data(), expected);
+    // Resolve a path to a handle for later requests of the connection. Malformed paths are reported without dropping
+    // the client, which keeps sending the path along with its requests then.
+    void resolve_path(impl::Connection &conn, const Request &request)
+    {
+        auto &handles = conn.path_handles();
+        try
+        {
+            handles.emplace_back(request.path);
+        }
+        catch (const json_server::RuntimeException &e)
+        {
+            transmit_server_reply(conn, request.reply_format(), e.m_err_code);
+            return;
+        }
+        transmit_server_reply(conn, request.reply_format(), handles.size() - 1, ::json_server::error_code::none);
+    }
 
-            if (ret < 0)
+    // Execute the get and set operations of a batch request and reply with the result of each one.
+    void execute_batch(impl::Connection &conn, const Request &request)
+    {
+        const auto items = request.value();
+        std::vector<impl::BatchOp> ops(items.size());
+        for (std::size_t i = 0; i < ops.size(); ++i)
+        {
+            const auto &item = items.at(i);
+            auto &op = ops[i];
+            try
+            {
+                op.path = impl::parse_path(item.at(1).get_ref<const std::string &>());
+            }
+            catch (const json_server::RuntimeException &e)
+            {
+                op.err = e.m_err_code;
+            }
+            if (static_cast<::details::batch_op>(item.at(0).get<uint8_t>()) == ::details::batch_op::set)
             {
-                socket.close();
-                throw json_server::InternalException(lh::nostd::source_location::current(),
-                                                     "client_handler: Unable to read from socket: {}, {}",
-                                                     socket.last_error(), socket.last_error_str());
+                op.value = impl::Node::from_json(item.at(2));
             }
+        }
 
-            if (ret != expected)
+        g_model.execute(ops);
+        for (const auto &op: ops)
+        {
+            if (op.value && op.err == ::json_server::error_code::none)
             {
-                socket.close();
-                throw json_server::InternalException(lh::nostd::source_location::current(),
-                                                     "client_handler: Got {} bytes, expected {} bytes", ret, expected);
+                g_watches->changed(op.path);
             }
+        }
 
-            // Convert received payload to to json object and react upon the request
-            auto j_recv = json::from_msgpack(payload_buffer);
-            try
+        conn.send([&](std::vector<uint8_t> &out) {
+            append_reply_header(out, request.reply_format(), ::json_server::error_code::none);
+            impl::append_array_header(out, ops.size());
+            for (const auto &op: ops)
             {
-                const auto cmd_code = static_cast<::details::request_cmd>(j_recv.at("cmd").get<int>());
-                const auto path = j_recv.at("path").get<std::string>();
+                // [err_code, value]: fixarray with two entries, the error code as positive fixint, nil without value
+                out.push_back(0x92);
+                out.push_back(static_cast<uint8_t>(op.err));
+                if (op.result)
+                {
+                    op.result->to_msgpack(out);
+                }
+                else
+                {
+                    out.push_back(0xc0);
+                }
+            }
+        });
+    }
+
+    // New value of the read-modify-write operation with the arguments `args` (see details::update_op) on `current`,
+    // none if the value stays as it is. Throws a RuntimeException (type_error) if the operation does not apply to
+    // the values. Arithmetic keeps the type of the value, so integers and floats do not mix.
+    std::optional<json> apply_update(const impl::Node &current, const json &args)
+    {
+        const auto op = static_cast<::details::update_op>(args.at(0).get<uint8_t>());
+        const auto &operand = args.at(1);
+        if (op == ::details::update_op::exchange)
+        {
+            return operand;
+        }
+        if (op == ::details::update_op::compare_exchange)
+        {
+            // Only subtrees are converted for the comparison
+            const bool is_equal = current.is_object() || current.is_array() ? current.to_json() == operand
+                                                                              : current.scalar() == operand;
+            return is_equal ? std::optional<json>(args.at(2)) : std::nullopt;
+        }
 
-                switch (cmd_code)
+        const auto &value = current.scalar();
+        if (!value.is_number() || !operand.is_number())
+        {
+            throw json_server::RuntimeException(json_server::error_code::type_error, "Update of a non-numeric value");
+        }
+        if (value.is_number_float() != operand.is_number_float())
+        {
+            throw json_server::RuntimeException(json_server::error_code::type_error,
+                                                "Update mixes integer and floating point numbers");
+        }
+        switch (op)
+        {
+            case ::details::update_op::fetch_min:
+                return operand < value ? std::optional<json>(operand) : std::nullopt;
+            case ::details::update_op::fetch_max:
+                return value < operand ? std::optional<json>(operand) : std::nullopt;
+            case ::details::update_op::fetch_add:
+            case ::details::update_op::fetch_sub:
+            {
+                const bool is_add = op == ::details::update_op::fetch_add;
+                if (value.is_number_float())
                 {
-                    case ::details::request_cmd::read:
-                    {
-                        // Read some value on the model
-                        json val;
-                        {
-                            const std::scoped_lock lock(g_model_mutex);
-                            val = g_model.at(nlohmann::json_pointer<std::string>(path));
-                        }
-                        transmit_server_reply(socket, val, ::json_server::error_code::none);
+                    const auto lhs = value.get<double>();
+                    const auto rhs = operand.get<double>();
+                    return is_add ? lhs + rhs : lhs - rhs;
+                }
+                // Integers wrap around like std::atomic
+                const auto lhs = static_cast<uint64_t>(value.get<int64_t>());
+                const auto rhs = static_cast<uint64_t>(operand.get<int64_t>());
+                return static_cast<int64_t>(is_add ? lhs + rhs : lhs - rhs);
+            }
+            default:
+                throw json_server::RuntimeException(json_server::error_code::protocol, "Unknown update operation {}",
+                                                    static_cast<int>(op));
+        }
+    }
+
+    // Apply a read-modify-write operation to the value at `path` and reply with [changed, previous value].
+    void update_value(impl::Connection &conn, const Request &request, const std::vector<std::string> &path)
+    {
+        const auto args = request.value();
+        bool is_changed = false;
+        const auto previous = g_model.update(path,
+                                             [&](const impl::Node &current) -> impl::node_ptr
+                                             {
+                                                 const auto new_value = apply_update(current, args);
+                                                 if (!new_value)
+                                                 {
+                                                     return nullptr;
+                                                 }
+                                                 is_changed = true;
+                                                 return impl::Node::from_json(*new_value);
+                                             });
+        if (is_changed)
+        {
+            g_watches->changed(path);
+        }
+
+        conn.send([&](std::vector<uint8_t> &out) {
+            append_reply_header(out, request.reply_format(), ::json_server::error_code::none);
+            // fixarray with two entries, the first one true or false
+            out.push_back(0x92);
+            out.push_back(is_changed ? 0xc3 : 0xc2);
+            previous->to_msgpack(out);
+        });
+    }
+
+    // Check the preconditions of a transaction request, apply its sets if they hold and reply with [failed, versions].
+    // Malformed or missing paths fail the transaction without dropping the client, which may simply retry.
+    void execute_transaction(impl::Connection &conn, const Request &request)
+    {
+        std::vector<impl::TransactionCheck> checks;
+        std::vector<impl::TransactionWrite> writes;
+        std::optional<std::size_t> failed;
+        try
+        {
+            const auto args = request.value();
+            const auto &items = args.at(0);
+            checks.resize(items.size());
+            for (std::size_t i = 0; i < checks.size(); ++i)
+            {
+                const auto &item = items.at(i);
+                auto &check = checks[i];
+                check.path = impl::parse_path(item.at(1).get_ref<const std::string &>());
+                switch (static_cast<::details::transaction_check>(item.at(0).get<uint8_t>()))
+                {
+                    case ::details::transaction_check::exists:
+                        check.kind = impl::TransactionCheck::Kind::exists;
                         break;
-                    }
-                    case ::details::request_cmd::write:
-                    {
-                        // Update value in json model
-                        {
-                            const std::scoped_lock lock(g_model_mutex);
-                            g_model.at(nlohmann::json_pointer<std::string>(path)) = j_recv.at("value");
-                        }
-                        transmit_server_reply(socket, json::value_t::null, ::json_server::error_code::none);
+                    case ::details::transaction_check::equals:
+                        check.kind = impl::TransactionCheck::Kind::equals;
+                        check.value = item.at(2);
                         break;
+                    case ::details::transaction_check::version:
+                        check.kind = impl::TransactionCheck::Kind::version;
+                        check.version = item.at(2).get<uint64_t>();
+                        break;
+                    default:
+                        throw json_server::RuntimeException(json_server::error_code::protocol,
+                                                            "Unknown transaction check {}", item.at(0).dump());
+                }
+            }
+            for (const auto &item: args.at(1))
+            {
+                writes.push_back({impl::parse_path(item.at(0).get_ref<const std::string &>()),
+                                  impl::Node::from_json(item.at(1))});
+            }
+
+            failed = g_model.transact(checks, writes);
+        }
+        catch (const json_server::RuntimeException &e)
+        {
+            transmit_server_reply(conn, request.reply_format(), e.m_err_code);
+            return;
+        }
+        if (!failed)
+        {
+            for (const auto &write: writes)
+            {
+                g_watches->changed(write.path);
+            }
+        }
+
+        conn.send([&](std::vector<uint8_t> &out) {
+            append_reply_header(out, request.reply_format(), ::json_server::error_code::none);
+            // fixarray with two entries, the first one the index of the failed check or nil
+            out.push_back(0x92);
+            if (failed)
+            {
+                impl::append_unsigned(out, *failed);
+            }
+            else
+            {
+                out.push_back(0xc0);
+            }
+            impl::append_array_header(out, checks.size());
+            for (const auto &check: checks)
+            {
+                impl::append_unsigned(out, check.current_version);
+            }
+        });
+    }
+
+    // Handle a lock, unlock or renew request. A contended lock is granted by the client releasing it or times out,
+    // until then the connection pauses. Refused requests are replied with the error without dropping the client,
+    // which may retry or back off.
+    connection_state lock_request(const connection_ptr &conn, const Request &request, const impl::PathHandle &path)
+    {
+        const auto reply = request.reply_format();
+        try
+        {
+            if (request.cmd == ::details::request_cmd::unlock)
+            {
+                g_locks->unlock(*conn, path);
+            }
+            else if (request.cmd == ::details::request_cmd::renew)
+            {
+                g_locks->renew(*conn, path);
+            }
+            else
+            {
+                // The value is the mode or [mode, timeout]
+                const auto args = request.has_value() ? request.value() : json();
+                const auto &j_mode = args.is_array() ? args.at(0) : args;
+                const auto is_shared = !j_mode.is_null() &&
+                                       static_cast<::details::lock_mode>(j_mode.get<uint8_t>()) ==
+                                           ::details::lock_mode::shared;
+                const auto mode = is_shared ? impl::LockManager::Mode::shared : impl::LockManager::Mode::exclusive;
+                std::optional<std::chrono::microseconds> timeout;
+                if (args.is_array())
+                {
+                    timeout = std::chrono::microseconds(args.at(1).get<uint64_t>());
+                }
+                const auto grant = [reply](const connection_ptr &waiter, const json_server::error_code err) {
+                    transmit_server_reply(*waiter, reply, err);
+                    resume_requests(waiter);
+                };
+                if (!g_locks->lock(conn, path, mode, timeout, grant))
+                {
+                    return connection_state::busy;
+                }
+            }
+        }
+        catch (const json_server::RuntimeException &e)
+        {
+            transmit_server_reply(*conn, reply, e.m_err_code);
+            return connection_state::idle;
+        }
+        transmit_server_reply(*conn, reply, ::json_server::error_code::none);
+        return connection_state::idle;
+    }
+
+    // Handle a single request of a client connection.
+    connection_state handle_request(const connection_ptr &conn, const std::vector<uint8_t> &payload)
+    {
+        ReplyFormat reply;
+        try
+        {
+            const auto request = decode_request(payload);
+            reply = request.reply_format();
+            std::optional<impl::PathHandle> temp_path;
+
+            switch (request.cmd)
+            {
+                case ::details::request_cmd::read:
+                {
+                    // Read some value, which is serialized straight into the output buffer. Resolved paths are
+                    // looked up on a snapshot of the model, others in the path index.
+                    impl::node_ptr pinned;
+                    const impl::Node *node = nullptr;
+                    if (request.handle)
+                    {
+                        pinned = g_model.snapshot();
+                        node = &request_path(*conn, request, temp_path).find(*pinned);
                     }
-                    case ::details::request_cmd::lock:
+                    else
                     {
-                        g_mutex_map[path].lock();
-                        transmit_server_reply(socket, json::value_t::null, ::json_server::error_code::none);
-                        break;
+                        pinned = g_model.find(request.path);
+                        node = pinned.get();
                     }
-                    case ::details::request_cmd::unlock:
+                    conn->send([&](std::vector<uint8_t> &out) {
+                        append_reply_header(out, reply, ::json_server::error_code::none);
+                        node->to_msgpack(out);
+                    });
+                    break;
+                }
+                case ::details::request_cmd::write:
+                {
+                    // Update value in json model
+                    const auto &path = request_path(*conn, request, temp_path).tokens();
+                    g_model.set(path, request.value());
+                    g_watches->changed(path);
+                    transmit_server_reply(*conn, reply, ::json_server::error_code::none);
+                    break;
+                }
+                case ::details::request_cmd::lock:
+                case ::details::request_cmd::unlock:
+                case ::details::request_cmd::renew:
+                {
+                    return lock_request(conn, request, request_path(*conn, request, temp_path));
+                }
+                case ::details::request_cmd::resolve:
+                {
+                    resolve_path(*conn, request);
+                    break;
+                }
+                case ::details::request_cmd::batch:
+                {
+                    execute_batch(*conn, request);
+                    break;
+                }
+                case ::details::request_cmd::watch:
+                {
+                    // Notifications are binary frames, which clients of the original protocol cannot tell apart
+                    if (request.format == wire_format::msgpack_map)
                     {
-                        g_mutex_map.at(path).unlock();
-                        transmit_server_reply(socket, json::value_t::null, ::json_server::error_code::none);
-                        break;
+                        throw json_server::RuntimeException(json_server::error_code::protocol,
+                                                            "Watch requires the binary protocol");
                     }
+                    const auto min_interval = request.value_size == 0 ? 0 : request.value().get<uint64_t>();
+                    g_watches->watch(conn, request.request_id, request_path(*conn, request, temp_path),
+                                     (request.flags & ::details::REQUEST_FLAG_VERSION_ONLY) != 0,
+                                     std::chrono::microseconds(min_interval));
+                    transmit_server_reply(*conn, reply, ::json_server::error_code::none);
+                    break;
+                }
+                case ::details::request_cmd::unwatch:
+                {
+                    g_watches->unwatch(*conn, request.value().get<uint32_t>());
+                    transmit_server_reply(*conn, reply, ::json_server::error_code::none);
+                    break;
+                }
+                case ::details::request_cmd::update:
+                {
+                    update_value(*conn, request, request_path(*conn, request, temp_path).tokens());
+                    break;
+                }
+                case ::details::request_cmd::transaction:
+                {
+                    execute_transaction(*conn, request);
+                    break;
+                }
+            }
+        }
+        catch (const json_server::RuntimeException &e)
+        {
+            transmit_server_reply(*conn, reply, e.m_err_code);
+            // A failed binary request fails on its own, since other requests multiplexed on the connection must not
+            // be affected. After an unsupported protocol version, the client may retry with another one.
+            if (reply.format == wire_format::binary || e.m_err_code == ::json_server::error_code::protocol)
+            {
+                return connection_state::idle;
+            }
+            // Got request of the original protocol with invalid json path: Send error and abort connection
+            conn->shutdown();
+            return connection_state::closed;
+        }
+        return connection_state::idle;
+    }
+
+    // Process the queued requests of a connection in order.
+    void process_requests(const connection_ptr &conn)
+    {
+        // Buffers of processed requests are handed back to the connection by pop_request
+        std::vector<uint8_t> request;
+        // The replies to all requests processed in one go are written with a single call
+        conn->cork();
+        while (conn->pop_request(request))
+        {
+            try
+            {
+                if (handle_request(conn, request) == connection_state::busy)
+                {
+                    break;
                 }
             }
-            catch (const json::out_of_range &e)
+            catch (const std::exception &)
             {
-                // Got client request with invalid json path: Send error and abort connection
-                transmit_server_reply(socket, json::value_t{0}, ::json_server::error_code::json_path_error);
-                socket.close();
-                return;
+                // Malformed request: drop the client
+                conn->shutdown();
             }
         }
+        conn->uncork();
     }
 
 } // namespace
 
 void init(const std::filesystem::path &json_resource, const std::filesystem::path &socket_file)
+{
+    Options options;
+    options.socket_file = socket_file;
+    init(json_resource, options);
+}
+
+void init(const std::filesystem::path &json_resource, const Options &options)
 {
     if (!std::filesystem::is_regular_file(json_resource))
     {
@@ -167,7 +731,7 @@ void init(const std::filesystem::path &json_resource, const std::filesystem::pat
     try
     {
         std::ifstream fs(json_resource);
-        g_model = json::parse(fs);
+        g_model.reset(json::parse(fs), options.lock_stripe_depth);
     }
     catch (const json::parse_error &e)
     {
@@ -175,21 +739,89 @@ void init(const std::filesystem::path &json_resource, const std::filesystem::pat
                                             e.what());
     }
 
+    if (!g_locks)
+    {
+        g_locks = new impl::LockManager();
+        auto thr = std::thread([locks = g_locks]() { locks->run(); });
+        thr.detach();
+    }
+    g_locks->set_lease_time(options.lock_lease_time);
+    if (!g_watches)
+    {
+        g_watches = new impl::WatchRegistry(g_model);
+        auto thr = std::thread([watches = g_watches]() { watches->run(); });
+        thr.detach();
+    }
+    g_watches->set_backlog_limit(options.watch_backlog_limit);
+
     sockpp::initialize();
 
+    const auto &socket_file = options.socket_file;
     if (std::filesystem::is_socket(socket_file))
     {
         std::filesystem::remove(socket_file);
     }
-    if (!g_srv_acceptor.open(sockpp::unix_address(socket_file)))
+    if (!open_listener(socket_file, options.transport))
     {
         throw json_server::RuntimeException(json_server::error_code::socket_error, "Unable to open unix socket {}",
                                             socket_file.string());
     }
     g_uds_socket_file = socket_file;
 
-    auto thr = std::thread(server_loop, client_handler);
+    const auto num_workers = std::max<std::size_t>(
+        options.worker_threads == 0 ? std::thread::hardware_concurrency() : options.worker_threads, 1);
+
+    if (options.backend == io_backend::io_uring)
+    {
+        // One engine per worker, all accepting on the listening socket
+        std::vector<std::unique_ptr<impl::UringEngine>> engines;
+        try
+        {
+            for (std::size_t i = 0; i < num_workers; ++i)
+            {
+                engines.push_back(
+                    std::make_unique<impl::UringEngine>(g_srv_acceptor.handle(), process_requests));
+            }
+        }
+        catch (const json_server::InternalException &)
+        {
+            // Kernel lacks io_uring support: fall back to epoll
+            engines.clear();
+        }
+        if (!engines.empty())
+        {
+            for (auto &engine: engines)
+            {
+                g_uring_engines.push_back(engine.release());
+                auto thr = std::thread([engine = g_uring_engines.back()]() { engine->run(); });
+                thr.detach();
+            }
+            return;
+        }
+    }
+
+    g_reactors = new impl::ReactorGroup(num_workers, process_requests);
+    g_reactors->start();
+    auto thr = std::thread(server_loop);
     thr.detach();
 }
 
+std::vector<StripeStats> stripe_stats()
+{
+    return g_model.stripe_stats();
+}
+
+WatchStats watch_stats()
+{
+    return g_watches ? g_watches->stats() : WatchStats{};
+}
+
+void set_lock_lease_time(const std::chrono::milliseconds lease_time)
+{
+    if (g_locks)
+    {
+        g_locks->set_lease_time(lease_time);
+    }
+}
+
 } // namespace json_server
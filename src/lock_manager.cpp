@@ -0,0 +1,455 @@
+#include "lock_manager.hpp"
+
+#include <algorithm>
+#include <unordered_set>
+
+#include "exceptions.hpp"
+
+
+namespace json_server::impl
+{
+
+namespace
+{
+    using Mode = LockManager::Mode;
+
+    // Which modes can be granted together, indexed by Mode
+    constexpr bool COMPATIBLE[4][4] = {
+        // intention_shared, intention_exclusive, shared, exclusive
+        {true, true, true, false},
+        {true, true, false, false},
+        {true, false, true, false},
+        {false, false, false, false},
+    };
+
+    constexpr std::size_t index(const Mode mode) noexcept
+    {
+        return static_cast<std::size_t>(mode);
+    }
+
+    // Whether one of the paths `lhs` and `rhs` (lists of reference tokens) is in the subtree of the other one.
+    bool is_overlapping(const std::vector<std::string> &lhs, const std::vector<std::string> &rhs)
+    {
+        const auto size = std::min(lhs.size(), rhs.size());
+        return std::equal(lhs.begin(), lhs.begin() + static_cast<std::ptrdiff_t>(size), rhs.begin());
+    }
+
+    // Whether locks on `lhs` in `lhs_mode` and on `rhs` in `rhs_mode` cannot be held at the same time.
+    bool is_conflicting(const std::vector<std::string> &lhs, const Mode lhs_mode, const std::vector<std::string> &rhs,
+                        const Mode rhs_mode)
+    {
+        return is_overlapping(lhs, rhs) && (lhs_mode == Mode::exclusive || rhs_mode == Mode::exclusive);
+    }
+} // namespace
+
+void LockManager::set_lease_time(const std::chrono::microseconds lease_time)
+{
+    const std::scoped_lock lock(m_mutex);
+    m_lease_time = lease_time;
+}
+
+bool LockManager::lock(const std::shared_ptr<Connection> &conn, const PathHandle &path, const Mode mode,
+                       const std::optional<std::chrono::microseconds> timeout, grant_callback grant)
+{
+    const std::scoped_lock lock(m_mutex);
+    const auto [client, is_new_client] = m_by_client.try_emplace(conn.get());
+    if (is_new_client)
+    {
+        conn->on_close([this](const Connection &closed) { release_all(closed); });
+    }
+    auto &requests = client->second;
+    for (const auto &held: requests)
+    {
+        if (held->tokens == path.tokens())
+        {
+            throw json_server::RuntimeException(json_server::error_code::lock, "Lock on {} requested twice",
+                                                path.path());
+        }
+        // The request would wait for the client itself
+        if (is_conflicting(held->tokens, held->mode, path.tokens(), mode))
+        {
+            throw json_server::RuntimeException(json_server::error_code::lock,
+                                                "Lock on {} conflicts with a lock of the client", path.path());
+        }
+    }
+
+    auto request = std::make_shared<Request>();
+    request->conn = conn;
+    request->client = conn.get();
+    request->tokens = path.tokens();
+    request->mode = mode;
+    const auto intention = mode == Mode::shared ? Mode::intention_shared : Mode::intention_exclusive;
+    std::string pointer;
+    for (std::size_t depth = 0; depth <= request->tokens.size(); ++depth)
+    {
+        if (depth > 0)
+        {
+            append_token(pointer, request->tokens[depth - 1]);
+        }
+        request->nodes.emplace_back(&m_nodes[pointer], depth == request->tokens.size() ? mode : intention);
+    }
+
+    // Queued requests are not overtaken by conflicting ones
+    const bool is_free = std::all_of(request->nodes.begin(), request->nodes.end(), [](const auto &node) {
+        return is_compatible(node.second, node.first->granted) && is_compatible(node.second, node.first->queued);
+    });
+    if (is_free)
+    {
+        requests.push_back(request);
+        grant_locks(request);
+        return true;
+    }
+    if (timeout && timeout->count() == 0)
+    {
+        prune_nodes(*request);
+        throw json_server::RuntimeException(json_server::error_code::timeout, "{} is locked", path.path());
+    }
+    if (would_deadlock(*request))
+    {
+        prune_nodes(*request);
+        throw json_server::RuntimeException(json_server::error_code::deadlock,
+                                            "Waiting for the lock on {} would deadlock", path.path());
+    }
+
+    for (const auto &[node, node_mode]: request->nodes)
+    {
+        ++node->queued[index(node_mode)];
+    }
+    request->grant = std::move(grant);
+    if (timeout)
+    {
+        request->timer = m_timers.schedule(
+            clock::now() + *timeout, [this, waiting = std::weak_ptr<Request>(request)]() { expire_wait(waiting); });
+    }
+    requests.push_back(request);
+    m_queue.push_back(std::move(request));
+    return false;
+}
+
+void LockManager::renew(const Connection &conn, const PathHandle &path)
+{
+    const std::scoped_lock lock(m_mutex);
+    const auto client = m_by_client.find(&conn);
+    if (client != m_by_client.end())
+    {
+        const auto &requests = client->second;
+        const auto it = std::find_if(requests.begin(), requests.end(), [&path](const request_ptr &request) {
+            return request->is_granted && request->tokens == path.tokens();
+        });
+        if (it != requests.end())
+        {
+            start_lease(*it);
+            return;
+        }
+    }
+    throw json_server::RuntimeException(json_server::error_code::lock, "{} is not locked by the client", path.path());
+}
+
+void LockManager::unlock(const Connection &conn, const PathHandle &path)
+{
+    completions completed;
+    {
+        const std::scoped_lock lock(m_mutex);
+        const auto client = m_by_client.find(&conn);
+        bool is_held = false;
+        if (client != m_by_client.end())
+        {
+            auto &requests = client->second;
+            const auto it = std::find_if(requests.begin(), requests.end(), [&path](const request_ptr &request) {
+                return request->is_granted && request->tokens == path.tokens();
+            });
+            if (it != requests.end())
+            {
+                remove_locks(**it);
+                requests.erase(it);
+                is_held = true;
+            }
+        }
+        if (!is_held)
+        {
+            throw json_server::RuntimeException(json_server::error_code::lock, "{} is not locked by the client",
+                                                path.path());
+        }
+        grant_queued(completed);
+    }
+    notify(completed);
+}
+
+void LockManager::release_all(const Connection &conn)
+{
+    completions completed;
+    {
+        const std::scoped_lock lock(m_mutex);
+        const auto client = m_by_client.find(&conn);
+        if (client == m_by_client.end())
+        {
+            return;
+        }
+        for (const auto &request: client->second)
+        {
+            if (!request->is_granted)
+            {
+                m_queue.remove(request);
+            }
+            remove_locks(*request);
+        }
+        m_by_client.erase(client);
+        grant_queued(completed);
+    }
+    notify(completed);
+}
+
+void LockManager::run()
+{
+    m_timers.run();
+}
+
+bool LockManager::is_compatible(const Mode mode, const mode_counts &counts) noexcept
+{
+    for (std::size_t other = 0; other < NUM_MODES; ++other)
+    {
+        if (counts[other] != 0 && !COMPATIBLE[index(mode)][other])
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool LockManager::would_deadlock(const Request &request) const
+{
+    // Depth-first search of the clients the request would wait for. Every client waits for one request at most, since
+    // a connection does not process further requests while its lock request is queued.
+    std::unordered_set<const Connection *> visited;
+    auto pending = blockers(request);
+    while (!pending.empty())
+    {
+        const auto *client = pending.back();
+        pending.pop_back();
+        if (client == request.client)
+        {
+            return true;
+        }
+        if (!visited.insert(client).second)
+        {
+            continue;
+        }
+        const auto requests = m_by_client.find(client);
+        if (requests == m_by_client.end())
+        {
+            continue;
+        }
+        for (const auto &waiting: requests->second)
+        {
+            if (!waiting->is_granted)
+            {
+                const auto next = blockers(*waiting);
+                pending.insert(pending.end(), next.begin(), next.end());
+            }
+        }
+    }
+    return false;
+}
+
+std::vector<const Connection *> LockManager::blockers(const Request &request) const
+{
+    std::vector<const Connection *> clients;
+    for (const auto &[client, requests]: m_by_client)
+    {
+        if (client == request.client)
+        {
+            continue;
+        }
+        const bool is_blocking = std::any_of(requests.begin(), requests.end(), [&request](const request_ptr &held) {
+            return held->is_granted && is_conflicting(held->tokens, held->mode, request.tokens, request.mode);
+        });
+        if (is_blocking)
+        {
+            clients.push_back(client);
+        }
+    }
+    for (const auto &queued: m_queue)
+    {
+        if (queued.get() == &request)
+        {
+            break;
+        }
+        if (queued->client != request.client &&
+            is_conflicting(queued->tokens, queued->mode, request.tokens, request.mode))
+        {
+            clients.push_back(queued->client);
+        }
+    }
+    return clients;
+}
+
+void LockManager::grant_locks(const request_ptr &request)
+{
+    for (const auto &[node, mode]: request->nodes)
+    {
+        ++node->granted[index(mode)];
+    }
+    request->is_granted = true;
+    // Replaces the timer of the wait timeout, if any
+    start_lease(request);
+}
+
+void LockManager::start_lease(const request_ptr &request)
+{
+    if (request->timer)
+    {
+        m_timers.cancel(*request->timer);
+        request->timer.reset();
+    }
+    if (m_lease_time.count() == 0)
+    {
+        request->expiry.reset();
+        return;
+    }
+    request->expiry = clock::now() + m_lease_time;
+    request->timer =
+        m_timers.schedule(*request->expiry, [this, held = std::weak_ptr<Request>(request)]() { expire_lease(held); });
+}
+
+void LockManager::remove_locks(const Request &request)
+{
+    for (const auto &[node, mode]: request.nodes)
+    {
+        auto &counts = request.is_granted ? node->granted : node->queued;
+        --counts[index(mode)];
+    }
+    if (request.timer)
+    {
+        m_timers.cancel(*request.timer);
+    }
+    prune_nodes(request);
+}
+
+void LockManager::prune_nodes(const Request &request)
+{
+    const auto is_zero = [](const mode_counts &counts) {
+        return std::all_of(counts.begin(), counts.end(), [](const uint32_t count) { return count == 0; });
+    };
+    std::string pointer;
+    for (std::size_t depth = 0; depth < request.nodes.size(); ++depth)
+    {
+        if (depth > 0)
+        {
+            append_token(pointer, request.tokens[depth - 1]);
+        }
+        const auto *node = request.nodes[depth].first;
+        if (is_zero(node->granted) && is_zero(node->queued))
+        {
+            m_nodes.erase(pointer);
+        }
+    }
+}
+
+void LockManager::forget(const Request &request)
+{
+    auto &requests = m_by_client.at(request.client);
+    requests.erase(std::find_if(requests.begin(), requests.end(),
+                                [&request](const request_ptr &other) { return other.get() == &request; }));
+}
+
+void LockManager::grant_queued(completions &completed)
+{
+    // Modes of the requests passed over so far, which later requests must not overtake
+    std::unordered_map<const LockNode *, mode_counts> ahead;
+    for (auto it = m_queue.begin(); it != m_queue.end();)
+    {
+        auto &request = **it;
+        if (request.conn.expired())
+        {
+            // Dropped by release_all once the connection is destroyed
+            ++it;
+            continue;
+        }
+        const bool is_free = std::all_of(request.nodes.begin(), request.nodes.end(), [&ahead](const auto &node) {
+            if (!is_compatible(node.second, node.first->granted))
+            {
+                return false;
+            }
+            const auto before = ahead.find(node.first);
+            return before == ahead.end() || is_compatible(node.second, before->second);
+        });
+        // Dropping the last reference to a connection here would release its locks, which takes m_mutex again:
+        // granted connections are only released by notify
+        auto conn = is_free ? request.conn.lock() : nullptr;
+        if (!conn)
+        {
+            for (const auto &[node, mode]: request.nodes)
+            {
+                ++ahead[node][index(mode)];
+            }
+            ++it;
+            continue;
+        }
+        for (const auto &[node, mode]: request.nodes)
+        {
+            --node->queued[index(mode)];
+        }
+        grant_locks(*it);
+        completed.push_back({std::move(conn), std::move(request.grant), json_server::error_code::none});
+        it = m_queue.erase(it);
+    }
+}
+
+void LockManager::expire_lease(const std::weak_ptr<Request> &request)
+{
+    completions completed;
+    {
+        const std::scoped_lock lock(m_mutex);
+        // Gone once unlocked or released
+        const auto held = request.lock();
+        if (!held || !held->expiry)
+        {
+            return;
+        }
+        if (*held->expiry > clock::now())
+        {
+            // Renewed after the timer fired, which scheduled the timer of the new lease
+            return;
+        }
+        remove_locks(*held);
+        forget(*held);
+        grant_queued(completed);
+    }
+    notify(completed);
+}
+
+void LockManager::expire_wait(const std::weak_ptr<Request> &request)
+{
+    completions completed;
+    {
+        const std::scoped_lock lock(m_mutex);
+        // Gone once released, granted if it holds the lock now
+        const auto waiting = request.lock();
+        if (!waiting || waiting->is_granted)
+        {
+            return;
+        }
+        m_queue.remove(waiting);
+        remove_locks(*waiting);
+        forget(*waiting);
+        // The connection is only released by notify, as in grant_queued
+        if (auto conn = waiting->conn.lock())
+        {
+            completed.push_back({std::move(conn), std::move(waiting->grant), json_server::error_code::timeout});
+        }
+        // Later requests may have waited behind the one timed out
+        grant_queued(completed);
+    }
+    notify(completed);
+}
+
+void LockManager::notify(completions &completed)
+{
+    // Dropping the last reference to a connection here releases its locks, which takes m_mutex again
+    for (auto &[conn, grant, err]: completed)
+    {
+        grant(conn, err);
+    }
+}
+
+} // namespace json_server::impl
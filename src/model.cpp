@@ -0,0 +1,865 @@
+#include "model.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <functional>
+#include <limits>
+
+#include "exceptions.hpp"
+
+
+using json = nlohmann::json;
+
+
+namespace json_server::impl
+{
+
+namespace
+{
+    // Append `val` in big endian byte order, as required by msgpack.
+    template <typename T>
+    void append_big_endian(std::vector<uint8_t> &out, const T val)
+    {
+        for (auto shift = static_cast<int>(sizeof(T) - 1) * 8; shift >= 0; shift -= 8)
+        {
+            out.push_back(static_cast<uint8_t>(val >> shift));
+        }
+    }
+
+    // Append a msgpack header of a container or string of `size` entries. `fix_tag` is used for sizes below
+    // `fix_limit`, otherwise the 8 (if `tag8` is nonzero), 16 or 32 bit variant.
+    void append_header(std::vector<uint8_t> &out, const std::size_t size, const uint8_t fix_tag,
+                       const std::size_t fix_limit, const uint8_t tag8, const uint8_t tag16, const uint8_t tag32)
+    {
+        if (size < fix_limit)
+        {
+            out.push_back(static_cast<uint8_t>(fix_tag | size));
+        }
+        else if (tag8 != 0 && size <= UINT8_MAX)
+        {
+            out.push_back(tag8);
+            out.push_back(static_cast<uint8_t>(size));
+        }
+        else if (size <= UINT16_MAX)
+        {
+            out.push_back(tag16);
+            append_big_endian(out, static_cast<uint16_t>(size));
+        }
+        else
+        {
+            out.push_back(tag32);
+            append_big_endian(out, static_cast<uint32_t>(size));
+        }
+    }
+
+    void append_string(std::vector<uint8_t> &out, const std::string_view str)
+    {
+        append_header(out, str.size(), 0xa0, 32, 0xd9, 0xda, 0xdb);
+        out.insert(out.end(), str.begin(), str.end());
+    }
+
+    void append_integer(std::vector<uint8_t> &out, const int64_t val)
+    {
+        if (val >= 0)
+        {
+            append_unsigned(out, static_cast<uint64_t>(val));
+        }
+        else if (val >= -32)
+        {
+            out.push_back(static_cast<uint8_t>(val));
+        }
+        else if (val >= INT8_MIN)
+        {
+            out.push_back(0xd0);
+            out.push_back(static_cast<uint8_t>(val));
+        }
+        else if (val >= INT16_MIN)
+        {
+            out.push_back(0xd1);
+            append_big_endian(out, static_cast<uint16_t>(val));
+        }
+        else if (val >= INT32_MIN)
+        {
+            out.push_back(0xd2);
+            append_big_endian(out, static_cast<uint32_t>(val));
+        }
+        else
+        {
+            out.push_back(0xd3);
+            append_big_endian(out, static_cast<uint64_t>(val));
+        }
+    }
+
+    // Floats which survive the round trip through single precision are written as float 32, like nlohmann::json does.
+    void append_float(std::vector<uint8_t> &out, const double val)
+    {
+        if (val >= static_cast<double>(std::numeric_limits<float>::lowest()) &&
+            val <= static_cast<double>(std::numeric_limits<float>::max()) &&
+            static_cast<double>(static_cast<float>(val)) == val)
+        {
+            const auto single = static_cast<float>(val);
+            uint32_t bits{0};
+            std::memcpy(&bits, &single, sizeof(bits));
+            out.push_back(0xca);
+            append_big_endian(out, bits);
+        }
+        else
+        {
+            uint64_t bits{0};
+            std::memcpy(&bits, &val, sizeof(bits));
+            out.push_back(0xcb);
+            append_big_endian(out, bits);
+        }
+    }
+
+    // Version of the next node created, see Node::version
+    std::atomic<uint64_t> g_next_node_version{1};
+
+    uint64_t next_node_version() noexcept
+    {
+        return g_next_node_version.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    [[noreturn]] void throw_path_error(const std::string_view token)
+    {
+        throw json_server::RuntimeException(json_server::error_code::json_path_error, "No such path element: {}",
+                                            token);
+    }
+} // namespace
+
+Node::Node(json scalar) : m_version(next_node_version()), m_type(scalar.type()), m_scalar(std::move(scalar))
+{
+}
+
+Node::Node(members object)
+    : m_version(next_node_version()), m_type(json::value_t::object), m_members(std::move(object))
+{
+}
+
+Node::Node(elements array) : m_version(next_node_version()), m_type(json::value_t::array), m_elements(std::move(array))
+{
+}
+
+node_ptr Node::from_json(const json &val)
+{
+    if (val.is_object())
+    {
+        // Iteration order of json objects is sorted by key already
+        members object;
+        object.reserve(val.size());
+        for (const auto &[key, child]: val.items())
+        {
+            object.emplace_back(key, from_json(child));
+        }
+        return std::make_shared<const Node>(std::move(object));
+    }
+    if (val.is_array())
+    {
+        elements array;
+        array.reserve(val.size());
+        for (const auto &child: val)
+        {
+            array.push_back(from_json(child));
+        }
+        return std::make_shared<const Node>(std::move(array));
+    }
+    return std::make_shared<const Node>(val);
+}
+
+void Node::to_msgpack(std::vector<uint8_t> &out) const
+{
+    if (is_object())
+    {
+        append_header(out, m_members.size(), 0x80, 16, 0, 0xde, 0xdf);
+        for (const auto &[key, child]: m_members)
+        {
+            append_string(out, key);
+            child->to_msgpack(out);
+        }
+    }
+    else if (is_array())
+    {
+        append_header(out, m_elements.size(), 0x90, 16, 0, 0xdc, 0xdd);
+        for (const auto &child: m_elements)
+        {
+            child->to_msgpack(out);
+        }
+    }
+    else
+    {
+        // Scalars are written by hand as well, nlohmann::json::to_msgpack allocates an output adapter on every call
+        switch (m_type)
+        {
+            case json::value_t::null:
+                out.push_back(0xc0);
+                break;
+            case json::value_t::boolean:
+                out.push_back(m_scalar.get<bool>() ? 0xc3 : 0xc2);
+                break;
+            case json::value_t::number_integer:
+                append_integer(out, m_scalar.get<int64_t>());
+                break;
+            case json::value_t::number_unsigned:
+                append_unsigned(out, m_scalar.get<uint64_t>());
+                break;
+            case json::value_t::number_float:
+                append_float(out, m_scalar.get<double>());
+                break;
+            case json::value_t::string:
+                append_string(out, m_scalar.get_ref<const std::string &>());
+                break;
+            default:
+                json::to_msgpack(m_scalar, out);
+                break;
+        }
+    }
+}
+
+json Node::to_json() const
+{
+    if (is_object())
+    {
+        json val = json::object();
+        for (const auto &[key, child]: m_members)
+        {
+            val.emplace(key, child->to_json());
+        }
+        return val;
+    }
+    if (is_array())
+    {
+        json val = json::array();
+        for (const auto &child: m_elements)
+        {
+            val.push_back(child->to_json());
+        }
+        return val;
+    }
+    return m_scalar;
+}
+
+std::size_t Node::child_index(const std::string_view token) const
+{
+    if (is_object())
+    {
+        const auto it = std::lower_bound(m_members.begin(), m_members.end(), token,
+                                         [](const member &lhs, const std::string_view key) { return lhs.first < key; });
+        if (it == m_members.end() || it->first != token)
+        {
+            throw_path_error(token);
+        }
+        return static_cast<std::size_t>(it - m_members.begin());
+    }
+    if (is_array())
+    {
+        // Array indices are decimal numbers without leading zeros
+        const auto is_digit = [](const char c) { return c >= '0' && c <= '9'; };
+        const bool is_index = !token.empty() && token.size() <= 9 &&
+                              std::all_of(token.begin(), token.end(), is_digit) &&
+                              (token.size() == 1 || token.front() != '0');
+        if (!is_index)
+        {
+            throw_path_error(token);
+        }
+        std::size_t idx = 0;
+        for (const auto c: token)
+        {
+            idx = idx * 10 + static_cast<std::size_t>(c - '0');
+        }
+        if (idx >= m_elements.size())
+        {
+            throw_path_error(token);
+        }
+        return idx;
+    }
+    throw_path_error(token);
+}
+
+const node_ptr &Node::child(const std::string_view token) const
+{
+    const auto idx = child_index(token);
+    return is_object() ? m_members[idx].second : m_elements[idx];
+}
+
+const node_ptr &Node::child(const std::string_view token, std::size_t &hint) const
+{
+    if (!is_object() || hint >= m_members.size() || m_members[hint].first != token)
+    {
+        hint = child_index(token);
+    }
+    return is_object() ? m_members[hint].second : m_elements[hint];
+}
+
+node_ptr Node::with_child(const std::string_view token, node_ptr new_child) const
+{
+    const auto idx = child_index(token);
+    if (is_object())
+    {
+        auto object = m_members;
+        object[idx].second = std::move(new_child);
+        return std::make_shared<const Node>(std::move(object));
+    }
+    auto array = m_elements;
+    array[idx] = std::move(new_child);
+    return std::make_shared<const Node>(std::move(array));
+}
+
+std::vector<std::string> parse_path(const std::string_view path)
+{
+    std::vector<std::string> tokens;
+    if (path.empty())
+    {
+        return tokens;
+    }
+    if (path.front() != '/')
+    {
+        throw json_server::RuntimeException(json_server::error_code::json_path_error,
+                                            "JSON pointer must start with '/': {}", path);
+    }
+
+    std::size_t start = 1;
+    while (true)
+    {
+        const auto end = std::min(path.find('/', start), path.size());
+        std::string token;
+        for (auto pos = start; pos < end; ++pos)
+        {
+            if (path[pos] != '~')
+            {
+                token.push_back(path[pos]);
+                continue;
+            }
+            // Escape sequences: ~0 for '~' and ~1 for '/'
+            if (pos + 1 == end || (path[pos + 1] != '0' && path[pos + 1] != '1'))
+            {
+                throw json_server::RuntimeException(json_server::error_code::json_path_error,
+                                                    "Invalid escape sequence in JSON pointer: {}", path);
+            }
+            token.push_back(path[++pos] == '0' ? '~' : '/');
+        }
+        tokens.push_back(std::move(token));
+
+        if (end == path.size())
+        {
+            return tokens;
+        }
+        start = end + 1;
+    }
+}
+
+const Node &find(const Node &root, const std::vector<std::string> &path)
+{
+    const Node *node = &root;
+    for (const auto &token: path)
+    {
+        node = node->child(token).get();
+    }
+    return *node;
+}
+
+void append_token(std::string &path, const std::string_view token)
+{
+    path.push_back('/');
+    for (const auto c: token)
+    {
+        if (c == '~')
+        {
+            path.append("~0");
+        }
+        else if (c == '/')
+        {
+            path.append("~1");
+        }
+        else
+        {
+            path.push_back(c);
+        }
+    }
+}
+
+PathHandle::PathHandle(const std::string_view path)
+    : m_path(path), m_tokens(parse_path(path)), m_positions(m_tokens.size(), SIZE_MAX)
+{
+}
+
+const Node &PathHandle::find(const Node &root)
+{
+    const Node *node = &root;
+    for (std::size_t i = 0; i < m_tokens.size(); ++i)
+    {
+        node = node->child(m_tokens[i], m_positions[i]).get();
+    }
+    return *node;
+}
+
+void append_array_header(std::vector<uint8_t> &out, const std::size_t size)
+{
+    append_header(out, size, 0x90, 16, 0, 0xdc, 0xdd);
+}
+
+void append_unsigned(std::vector<uint8_t> &out, const uint64_t val)
+{
+    if (val < 128)
+    {
+        out.push_back(static_cast<uint8_t>(val));
+    }
+    else if (val <= UINT8_MAX)
+    {
+        out.push_back(0xcc);
+        out.push_back(static_cast<uint8_t>(val));
+    }
+    else if (val <= UINT16_MAX)
+    {
+        out.push_back(0xcd);
+        append_big_endian(out, static_cast<uint16_t>(val));
+    }
+    else if (val <= UINT32_MAX)
+    {
+        out.push_back(0xce);
+        append_big_endian(out, static_cast<uint32_t>(val));
+    }
+    else
+    {
+        out.push_back(0xcf);
+        append_big_endian(out, val);
+    }
+}
+
+node_ptr replace(const Node &root, const std::vector<std::string> &path, node_ptr new_node)
+{
+    // Nodes from the root down to the parent of the replaced node; each one is copied with its new child below
+    std::vector<const Node *> ancestors{&root};
+    for (std::size_t i = 0; i + 1 < path.size(); ++i)
+    {
+        ancestors.push_back(ancestors.back()->child(path[i]).get());
+    }
+
+    for (auto i = path.size(); i > 0; --i)
+    {
+        new_node = ancestors[i - 1]->with_child(path[i - 1], std::move(new_node));
+    }
+    return new_node;
+}
+
+node_ptr PathIndex::find(const std::string_view path) const
+{
+    const auto hash = std::hash<std::string_view>{}(path);
+    const auto &shard = m_shards[hash % NUM_SHARDS];
+    const std::shared_lock lock(shard.mutex);
+    const auto it = shard.entries.find(hash);
+    if (it == shard.entries.end() || it->second.path != path)
+    {
+        return nullptr;
+    }
+    return it->second.node;
+}
+
+void PathIndex::assign(const std::string_view path, node_ptr node)
+{
+    const auto hash = std::hash<std::string_view>{}(path);
+    auto &shard = m_shards[hash % NUM_SHARDS];
+    const std::unique_lock lock(shard.mutex);
+    auto &entry = shard.entries[hash];
+    if (entry.path != path)
+    {
+        entry.path = path;
+    }
+    entry.node = std::move(node);
+}
+
+void PathIndex::assign_subtree(std::string &path, const node_ptr &node, const std::size_t skip_levels)
+{
+    if (skip_levels == 0)
+    {
+        assign(path, node);
+    }
+    const auto child_skip_levels = skip_levels == 0 ? 0 : skip_levels - 1;
+
+    const auto path_size = path.size();
+    for (const auto &[key, child]: node->object())
+    {
+        append_token(path, key);
+        assign_subtree(path, child, child_skip_levels);
+        path.resize(path_size);
+    }
+    for (std::size_t idx = 0; idx < node->array().size(); ++idx)
+    {
+        append_token(path, std::to_string(idx));
+        assign_subtree(path, node->array()[idx], child_skip_levels);
+        path.resize(path_size);
+    }
+}
+
+void PathIndex::erase_subtree(std::string &path, const Node &node, const std::size_t skip_levels)
+{
+    if (skip_levels == 0)
+    {
+        const auto hash = std::hash<std::string_view>{}(path);
+        auto &shard = m_shards[hash % NUM_SHARDS];
+        const std::unique_lock lock(shard.mutex);
+        const auto it = shard.entries.find(hash);
+        if (it != shard.entries.end() && it->second.path == path && it->second.node.get() == &node)
+        {
+            shard.entries.erase(it);
+        }
+    }
+    const auto child_skip_levels = skip_levels == 0 ? 0 : skip_levels - 1;
+
+    const auto path_size = path.size();
+    for (const auto &[key, child]: node.object())
+    {
+        append_token(path, key);
+        erase_subtree(path, *child, child_skip_levels);
+        path.resize(path_size);
+    }
+    for (std::size_t idx = 0; idx < node.array().size(); ++idx)
+    {
+        append_token(path, std::to_string(idx));
+        erase_subtree(path, *node.array()[idx], child_skip_levels);
+        path.resize(path_size);
+    }
+}
+
+void PathIndex::clear()
+{
+    for (auto &shard: m_shards)
+    {
+        const std::unique_lock lock(shard.mutex);
+        shard.entries.clear();
+    }
+}
+
+void Model::reset(const json &doc, const std::size_t stripe_depth)
+{
+    m_stripe_depth = stripe_depth;
+    const auto root = publish({}, Node::from_json(doc));
+
+    // Index all paths of at least the stripe depth
+    m_index.clear();
+    std::string pointer;
+    m_index.assign_subtree(pointer, root, m_stripe_depth);
+}
+
+node_ptr Model::snapshot() const
+{
+    // Every thread keeps its last snapshot and only reloads the root after a write. Copying the snapshot is a
+    // reference count increment. Superseded versions are freed once no thread uses them anymore.
+    thread_local const Model *cached_model{nullptr};
+    thread_local uint64_t cached_version{0};
+    thread_local node_ptr cached_root{};
+
+    const auto version = m_version.load(std::memory_order_acquire);
+    if (cached_model != this || cached_version != version || !cached_root)
+    {
+        cached_root = std::atomic_load(&m_root);
+        cached_version = version;
+        cached_model = this;
+    }
+    return cached_root;
+}
+
+void Model::set(const std::string_view path, const json &val)
+{
+    set(parse_path(path), val);
+}
+
+node_ptr Model::find(const std::string_view path) const
+{
+    if (auto node = m_index.find(path))
+    {
+        return node;
+    }
+    // Not indexed: shorter than the stripe depth, hash collision or no such path
+    const auto root = snapshot();
+    const Node *node = root.get();
+    node_ptr found = root;
+    for (const auto &token: parse_path(path))
+    {
+        found = node->child(token);
+        node = found.get();
+    }
+    return found;
+}
+
+void Model::set(const std::vector<std::string> &path, const json &val)
+{
+    const auto new_node = Node::from_json(val);
+
+    std::vector<std::size_t> indices;
+    add_stripes(path, indices);
+    const auto locks = lock_stripes(std::move(indices));
+    // The replaced node cannot change while the stripe is held
+    node_ptr old_node = std::atomic_load(&m_root);
+    for (const auto &token: path)
+    {
+        old_node = old_node->child(token);
+    }
+    const auto root = publish(path, new_node);
+    update_index(path, root, old_node, new_node);
+}
+
+node_ptr Model::update(const std::vector<std::string> &path, const std::function<node_ptr(const Node &)> &new_value)
+{
+    std::vector<std::size_t> indices;
+    add_stripes(path, indices);
+    const auto locks = lock_stripes(std::move(indices));
+    // The node cannot change while the stripe is held, so the new value is based on the latest one
+    node_ptr old_node = std::atomic_load(&m_root);
+    for (const auto &token: path)
+    {
+        old_node = old_node->child(token);
+    }
+    const auto new_node = new_value(*old_node);
+    if (new_node)
+    {
+        const auto root = publish(path, new_node);
+        update_index(path, root, old_node, new_node);
+    }
+    return old_node;
+}
+
+void Model::execute(std::vector<BatchOp> &ops)
+{
+    std::vector<std::size_t> indices;
+    std::vector<bool> is_skipped;
+    for (const auto &op: ops)
+    {
+        is_skipped.push_back(op.err != error_code::none);
+        if (op.value && op.err == error_code::none)
+        {
+            add_stripes(op.path, indices);
+        }
+    }
+    const auto locks = lock_stripes(std::move(indices));
+
+    // Run the operations on the current root and publish the result. Writers of other stripes may publish in the
+    // meantime: then run them again on top of their root until the swap succeeds.
+    std::vector<node_ptr> old_nodes(ops.size());
+    auto root = std::atomic_load(&m_root);
+    node_ptr new_root;
+    while (true)
+    {
+        new_root = root;
+        bool has_changes = false;
+        for (std::size_t i = 0; i < ops.size(); ++i)
+        {
+            auto &op = ops[i];
+            if (is_skipped[i])
+            {
+                continue;
+            }
+            op.err = error_code::none;
+            try
+            {
+                node_ptr node = new_root;
+                for (const auto &token: op.path)
+                {
+                    node = node->child(token);
+                }
+                if (op.value)
+                {
+                    new_root = replace(*new_root, op.path, op.value);
+                    old_nodes[i] = std::move(node);
+                    has_changes = true;
+                }
+                else
+                {
+                    op.result = std::move(node);
+                }
+            }
+            catch (const json_server::RuntimeException &e)
+            {
+                op.err = e.m_err_code;
+            }
+        }
+
+        if (!has_changes)
+        {
+            return;
+        }
+        if (std::atomic_compare_exchange_weak(&m_root, &root, new_root))
+        {
+            break;
+        }
+    }
+    m_version.fetch_add(1, std::memory_order_release);
+
+    // Index the changes in order, later sets may replace nodes of earlier ones
+    for (std::size_t i = 0; i < ops.size(); ++i)
+    {
+        if (!is_skipped[i] && ops[i].value && ops[i].err == error_code::none)
+        {
+            update_index(ops[i].path, new_root, old_nodes[i], ops[i].value);
+        }
+    }
+}
+
+std::optional<std::size_t> Model::transact(std::vector<TransactionCheck> &checks,
+                                           const std::vector<TransactionWrite> &writes)
+{
+    // The checked paths are locked as well, so that they cannot change between the checks and the writes
+    std::vector<std::size_t> indices;
+    for (const auto &check: checks)
+    {
+        add_stripes(check.path, indices);
+    }
+    for (const auto &write: writes)
+    {
+        add_stripes(write.path, indices);
+    }
+    const auto locks = lock_stripes(std::move(indices));
+
+    auto root = std::atomic_load(&m_root);
+    std::optional<std::size_t> failed;
+    for (std::size_t i = 0; i < checks.size(); ++i)
+    {
+        auto &check = checks[i];
+        const Node *node = nullptr;
+        try
+        {
+            node = &impl::find(*root, check.path);
+        }
+        catch (const json_server::RuntimeException &)
+        {
+            // The path does not exist
+        }
+        check.current_version = node != nullptr ? node->version() : 0;
+
+        bool holds = false;
+        switch (check.kind)
+        {
+            case TransactionCheck::Kind::exists:
+                holds = node != nullptr;
+                break;
+            case TransactionCheck::Kind::equals:
+                holds = node != nullptr && node->to_json() == check.value;
+                break;
+            case TransactionCheck::Kind::version:
+                holds = check.current_version == check.version;
+                break;
+        }
+        if (!holds && !failed)
+        {
+            failed = i;
+        }
+    }
+    if (failed || writes.empty())
+    {
+        return failed;
+    }
+
+    // Like in `execute`, apply the writes again on top of the root of concurrent writers of other stripes until the
+    // swap succeeds. A missing path throws before anything is published.
+    std::vector<node_ptr> old_nodes(writes.size());
+    node_ptr new_root;
+    do
+    {
+        new_root = root;
+        for (std::size_t i = 0; i < writes.size(); ++i)
+        {
+            node_ptr node = new_root;
+            for (const auto &token: writes[i].path)
+            {
+                node = node->child(token);
+            }
+            old_nodes[i] = std::move(node);
+            new_root = replace(*new_root, writes[i].path, writes[i].value);
+        }
+    } while (!std::atomic_compare_exchange_weak(&m_root, &root, new_root));
+    m_version.fetch_add(1, std::memory_order_release);
+
+    for (std::size_t i = 0; i < writes.size(); ++i)
+    {
+        update_index(writes[i].path, new_root, old_nodes[i], writes[i].value);
+    }
+    return std::nullopt;
+}
+
+std::vector<StripeStats> Model::stripe_stats() const
+{
+    std::vector<StripeStats> stats;
+    for (const auto &stripe: m_stripes)
+    {
+        stats.push_back({stripe.acquisitions.load(), stripe.contentions.load()});
+    }
+    return stats;
+}
+
+void Model::add_stripes(const std::vector<std::string> &path, std::vector<std::size_t> &indices) const
+{
+    if (path.size() < m_stripe_depth)
+    {
+        for (std::size_t i = 0; i < NUM_STRIPES; ++i)
+        {
+            indices.push_back(i);
+        }
+    }
+    else
+    {
+        std::size_t hash = 0;
+        for (std::size_t i = 0; i < m_stripe_depth; ++i)
+        {
+            hash = hash * 31 + std::hash<std::string>{}(path[i]);
+        }
+        indices.push_back(hash % NUM_STRIPES);
+    }
+}
+
+Model::stripe_locks Model::lock_stripes(std::vector<std::size_t> indices)
+{
+    // Stripes are always locked in ascending order, so that multi-stripe writers cannot deadlock
+    std::sort(indices.begin(), indices.end());
+    indices.erase(std::unique(indices.begin(), indices.end()), indices.end());
+    stripe_locks locks;
+    for (const auto idx: indices)
+    {
+        auto &stripe = m_stripes[idx];
+        std::unique_lock lock(stripe.mutex, std::try_to_lock);
+        if (!lock.owns_lock())
+        {
+            stripe.contentions.fetch_add(1, std::memory_order_relaxed);
+            lock.lock();
+        }
+        stripe.acquisitions.fetch_add(1, std::memory_order_relaxed);
+        locks.push_back(std::move(lock));
+    }
+    return locks;
+}
+
+node_ptr Model::publish(const std::vector<std::string> &path, const node_ptr &new_node)
+{
+    // The locked subtree cannot change, but writers of other stripes may publish concurrently: rebuild the path above
+    // the subtree on top of their root until the swap succeeds.
+    auto root = std::atomic_load(&m_root);
+    auto new_root = replace(*root, path, new_node);
+    while (!std::atomic_compare_exchange_weak(&m_root, &root, new_root))
+    {
+        new_root = replace(*root, path, new_node);
+    }
+    m_version.fetch_add(1, std::memory_order_release);
+    return new_root;
+}
+
+void Model::update_index(const std::vector<std::string> &path, const node_ptr &root, const node_ptr &old_node,
+                         const node_ptr &new_node)
+{
+    // Ancestors were copied with their new children
+    std::string pointer;
+    const node_ptr *node = &root;
+    for (std::size_t depth = 0; depth < path.size(); ++depth)
+    {
+        if (depth >= m_stripe_depth)
+        {
+            m_index.assign(pointer, *node);
+        }
+        node = &(*node)->child(path[depth]);
+        append_token(pointer, path[depth]);
+    }
+
+    // Index the new subtree before dropping the old one, so that paths in both never miss
+    const auto skip_levels = m_stripe_depth > path.size() ? m_stripe_depth - path.size() : 0;
+    m_index.assign_subtree(pointer, new_node, skip_levels);
+    m_index.erase_subtree(pointer, *old_node, skip_levels);
+}
+
+} // namespace json_server::impl
@@ -0,0 +1,279 @@
+#include "reactor.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <thread>
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "exceptions.hpp"
+
+
+namespace json_server::impl
+{
+
+Reactor::Reactor(ReactorGroup &group, const std::size_t index)
+    : m_group(group), m_index(index), m_epoll_fd(::epoll_create1(EPOLL_CLOEXEC)),
+      m_wakeup_fd(::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK))
+{
+    if (m_epoll_fd < 0 || m_wakeup_fd < 0)
+    {
+        throw json_server::InternalException(lh::nostd::source_location::current(), "Reactor setup failed: {}",
+                                             errno);
+    }
+
+    epoll_event ev{};
+    ev.events = EPOLLIN;
+    ev.data.fd = m_wakeup_fd;
+    if (::epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, m_wakeup_fd, &ev) != 0)
+    {
+        throw json_server::InternalException(lh::nostd::source_location::current(), "epoll_ctl failed: {}", errno);
+    }
+}
+
+Reactor::~Reactor()
+{
+    ::close(m_wakeup_fd);
+    ::close(m_epoll_fd);
+}
+
+void Reactor::add(std::shared_ptr<Connection> conn)
+{
+    const auto fd = conn->handle();
+    conn->attach(m_epoll_fd);
+    {
+        const std::scoped_lock lock(m_mutex);
+        m_connections[fd] = std::move(conn);
+    }
+
+    epoll_event ev{};
+    ev.events = EPOLLIN | EPOLLRDHUP;
+    ev.data.fd = fd;
+    if (::epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0)
+    {
+        const std::scoped_lock lock(m_mutex);
+        m_connections.erase(fd);
+        throw json_server::InternalException(lh::nostd::source_location::current(), "epoll_ctl failed: {}", errno);
+    }
+}
+
+void Reactor::schedule(std::shared_ptr<Connection> conn)
+{
+    std::size_t num_queued = 0;
+    {
+        const std::scoped_lock lock(m_run_queue_mutex);
+        m_run_queue.push_back() = std::move(conn);
+        num_queued = m_run_queue.size();
+    }
+
+    // A sleeping reactor has to wake up for its new work. A backlog is offered to an idle reactor instead.
+    if (!wake_if_idle() && num_queued > 1)
+    {
+        m_group.wake_idle(m_index);
+    }
+}
+
+std::shared_ptr<Connection> Reactor::steal()
+{
+    const std::scoped_lock lock(m_run_queue_mutex);
+    if (m_run_queue.empty())
+    {
+        return nullptr;
+    }
+    auto conn = std::move(m_run_queue.back());
+    m_run_queue.pop_back();
+    return conn;
+}
+
+std::shared_ptr<Connection> Reactor::next()
+{
+    const std::scoped_lock lock(m_run_queue_mutex);
+    if (m_run_queue.empty())
+    {
+        return nullptr;
+    }
+    auto conn = std::move(m_run_queue.front());
+    m_run_queue.pop_front();
+    return conn;
+}
+
+bool Reactor::wake_if_idle()
+{
+    if (!m_is_idle.exchange(false))
+    {
+        return false;
+    }
+    const uint64_t one{1};
+    [[maybe_unused]] const auto ret = ::write(m_wakeup_fd, &one, sizeof(one));
+    return true;
+}
+
+std::shared_ptr<Connection> Reactor::find(const int fd)
+{
+    const std::scoped_lock lock(m_mutex);
+    const auto it = m_connections.find(fd);
+    return it == m_connections.end() ? nullptr : it->second;
+}
+
+void Reactor::remove(const std::shared_ptr<Connection> &conn)
+{
+    // Requests queued before the hangup are still processed, the connection is closed with its last reference
+    ::epoll_ctl(m_epoll_fd, EPOLL_CTL_DEL, conn->handle(), nullptr);
+    const std::scoped_lock lock(m_mutex);
+    m_connections.erase(conn->handle());
+}
+
+void Reactor::receive(const std::shared_ptr<Connection> &conn, const uint32_t events)
+{
+    if ((events & EPOLLOUT) != 0)
+    {
+        conn->flush();
+    }
+
+    bool is_open = (events & EPOLLERR) == 0;
+    if (is_open && (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP)) != 0)
+    {
+        // Queue all completely received frames, even if the peer hung up after sending them
+        bool must_process = false;
+        is_open = conn->receive(must_process);
+        if (must_process)
+        {
+            schedule(conn);
+        }
+    }
+
+    if (!is_open)
+    {
+        remove(conn);
+    }
+}
+
+void Reactor::run()
+{
+    constexpr int MAX_EVENTS = 64;
+    std::array<epoll_event, MAX_EVENTS> events{};
+
+    while (true)
+    {
+        // Without own work, help the other reactors before going to sleep
+        int timeout = 0;
+        {
+            const std::scoped_lock lock(m_run_queue_mutex);
+            timeout = m_run_queue.empty() ? -1 : 0;
+        }
+        if (timeout < 0)
+        {
+            if (const auto conn = m_group.steal(m_index))
+            {
+                m_group.m_process(conn);
+                continue;
+            }
+
+            // Work queued in the meantime does not wake the reactor up, so check once more after marking it idle
+            m_is_idle = true;
+            if (const auto conn = m_group.steal(m_index))
+            {
+                m_is_idle = false;
+                m_group.m_process(conn);
+                continue;
+            }
+            const std::scoped_lock lock(m_run_queue_mutex);
+            if (!m_run_queue.empty())
+            {
+                m_is_idle = false;
+                timeout = 0;
+            }
+        }
+
+        const auto num_events = ::epoll_wait(m_epoll_fd, events.data(), MAX_EVENTS, timeout);
+        m_is_idle = false;
+
+        for (int i = 0; i < num_events; ++i)
+        {
+            const auto &ev = events.at(static_cast<std::size_t>(i));
+            if (ev.data.fd == m_wakeup_fd)
+            {
+                uint64_t value{0};
+                [[maybe_unused]] const auto ret = ::read(m_wakeup_fd, &value, sizeof(value));
+                continue;
+            }
+            if (const auto conn = find(ev.data.fd))
+            {
+                receive(conn, ev.events);
+            }
+        }
+
+        // Process the work queued so far, later work has to wait for the next round of events
+        std::size_t num_queued = 0;
+        {
+            const std::scoped_lock lock(m_run_queue_mutex);
+            num_queued = m_run_queue.size();
+        }
+        for (; num_queued > 0; --num_queued)
+        {
+            const auto conn = next();
+            if (!conn)
+            {
+                break;
+            }
+            m_group.m_process(conn);
+        }
+    }
+}
+
+ReactorGroup::ReactorGroup(const std::size_t num_reactors, connection_processor process)
+    : m_process(std::move(process))
+{
+    const auto count = std::max<std::size_t>(num_reactors, 1);
+    for (std::size_t i = 0; i < count; ++i)
+    {
+        m_reactors.push_back(std::make_unique<Reactor>(*this, i));
+    }
+}
+
+void ReactorGroup::start()
+{
+    for (auto &reactor: m_reactors)
+    {
+        auto thr = std::thread([reactor = reactor.get()]() { reactor->run(); });
+        thr.detach();
+    }
+}
+
+void ReactorGroup::add(std::shared_ptr<Connection> conn)
+{
+    m_reactors[m_next++ % m_reactors.size()]->add(std::move(conn));
+}
+
+void ReactorGroup::schedule(std::shared_ptr<Connection> conn)
+{
+    m_reactors[m_next++ % m_reactors.size()]->schedule(std::move(conn));
+}
+
+std::shared_ptr<Connection> ReactorGroup::steal(const std::size_t thief)
+{
+    for (std::size_t i = 1; i < m_reactors.size(); ++i)
+    {
+        if (auto conn = m_reactors[(thief + i) % m_reactors.size()]->steal())
+        {
+            return conn;
+        }
+    }
+    return nullptr;
+}
+
+void ReactorGroup::wake_idle(const std::size_t self)
+{
+    for (std::size_t i = 1; i < m_reactors.size(); ++i)
+    {
+        if (m_reactors[(self + i) % m_reactors.size()]->wake_if_idle())
+        {
+            return;
+        }
+    }
+}
+
+} // namespace json_server::impl
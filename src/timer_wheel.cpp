@@ -0,0 +1,121 @@
+#include "timer_wheel.hpp"
+
+#include <algorithm>
+#include <iterator>
+#include <limits>
+#include <utility>
+
+
+namespace json_server::impl
+{
+
+TimerWheel::TimerWheel(const clock::duration tick, const std::size_t num_slots) : m_tick(tick), m_slots(num_slots)
+{
+}
+
+TimerWheel::timer_id TimerWheel::schedule(const clock::time_point deadline, callback fn)
+{
+    timer_id id = 0;
+    {
+        const std::scoped_lock lock(m_mutex);
+        if (m_ticks.empty())
+        {
+            // Skip the ticks passed while the wheel was empty
+            m_next_tick = tick_at(clock::now());
+        }
+        const auto tick = std::max(tick_at(deadline), m_next_tick);
+        id = m_next_id++;
+        m_slots[tick % m_slots.size()].push_back({id, tick, std::move(fn)});
+        m_ticks.emplace(id, tick);
+    }
+    // The new timer may be due before the one the wheel waits for
+    m_cv.notify_one();
+    return id;
+}
+
+void TimerWheel::cancel(const timer_id id)
+{
+    const std::scoped_lock lock(m_mutex);
+    const auto it = m_ticks.find(id);
+    if (it == m_ticks.end())
+    {
+        return;
+    }
+    auto &slot = m_slots[it->second % m_slots.size()];
+    slot.erase(std::find_if(slot.begin(), slot.end(), [id](const Timer &timer) { return timer.id == id; }));
+    m_ticks.erase(it);
+}
+
+void TimerWheel::run()
+{
+    std::vector<Timer> due;
+    while (true)
+    {
+        {
+            std::unique_lock lock(m_mutex);
+            m_cv.wait(lock, [this]() { return !m_ticks.empty(); });
+            // No timer is due before the earliest one, so the ticks up to it are skipped
+            const auto tick = std::max(earliest_tick(), m_next_tick);
+            const auto tick_time = m_start + m_tick * static_cast<clock::rep>(tick);
+            if (clock::now() < tick_time)
+            {
+                // Woken up early by a timer scheduled or cancelled meanwhile
+                m_cv.wait_until(lock, tick_time);
+                continue;
+            }
+
+            auto &slot = m_slots[tick % m_slots.size()];
+            const auto first_due =
+                std::partition(slot.begin(), slot.end(), [tick](const Timer &timer) { return timer.tick > tick; });
+            std::move(first_due, slot.end(), std::back_inserter(due));
+            slot.erase(first_due, slot.end());
+            for (const auto &timer: due)
+            {
+                m_ticks.erase(timer.id);
+            }
+            m_next_tick = tick + 1;
+        }
+
+        // Callbacks may schedule or cancel timers
+        for (auto &timer: due)
+        {
+            timer.fn();
+        }
+        due.clear();
+    }
+}
+
+uint64_t TimerWheel::tick_at(const clock::time_point time) const noexcept
+{
+    if (time <= m_start)
+    {
+        return 0;
+    }
+    const auto ticks = (time - m_start + m_tick - clock::duration(1)) / m_tick;
+    return static_cast<uint64_t>(ticks);
+}
+
+uint64_t TimerWheel::earliest_tick() const
+{
+    // The slots of the next turn are visited in tick order, so the first timer due within the turn is the earliest.
+    // Only if there is none, all timers are further away and the earliest of them is looked up.
+    const auto num_slots = static_cast<uint64_t>(m_slots.size());
+    for (uint64_t tick = m_next_tick; tick < m_next_tick + num_slots; ++tick)
+    {
+        for (const auto &timer: m_slots[tick % num_slots])
+        {
+            if (timer.tick <= tick)
+            {
+                return timer.tick;
+            }
+        }
+    }
+    auto earliest = std::numeric_limits<uint64_t>::max();
+    for (const auto &[id, tick]: m_ticks)
+    {
+        earliest = std::min(earliest, tick);
+    }
+    return earliest;
+}
+
+} // namespace json_server::impl
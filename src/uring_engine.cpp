@@ -0,0 +1,696 @@
+#include "uring_engine.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <mutex>
+#include <thread>
+#include <utility>
+
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+
+#include "details.hpp"
+#include "exceptions.hpp"
+
+
+namespace json_server::impl
+{
+
+// Multishot receives are the newest feature used, older kernel headers lack the required definitions
+#if defined(IORING_RECV_MULTISHOT)
+
+namespace
+{
+    constexpr unsigned RING_ENTRIES = 256;
+
+    // Receive buffers provided to the kernel, multishot receives pick one per completion
+    constexpr uint16_t RECV_BUFFER_GROUP = 0;
+    constexpr unsigned RECV_BUFFER_COUNT = 128;
+    constexpr std::size_t RECV_BUFFER_SIZE = 8 * 1024;
+    static_assert(RECV_BUFFER_SIZE >= ::details::MAX_DATAGRAM_SIZE, "Receive buffers must hold whole datagrams");
+
+    // Registered memory for reply writes, split into one slot per write in flight
+    constexpr std::size_t SEND_SLOT_COUNT = 64;
+    constexpr std::size_t SEND_SLOT_SIZE = 16 * 1024;
+
+    // Kind of operation, encoded into the user data of a submission together with the connection slot
+    enum class op_type : uint8_t
+    {
+        accept,
+        recv,
+        write,
+        wakeup
+    };
+
+    uint64_t encode_user_data(const op_type type, const uint32_t id = 0, const uint32_t generation = 0)
+    {
+        return (uint64_t{generation} << 32U) | (uint64_t{id} << 8U) | static_cast<uint8_t>(type);
+    }
+
+    int io_uring_setup(const unsigned entries, io_uring_params *params)
+    {
+        return static_cast<int>(::syscall(__NR_io_uring_setup, entries, params));
+    }
+
+    int io_uring_enter(const int ring_fd, const unsigned to_submit, const unsigned min_complete, const unsigned flags)
+    {
+        return static_cast<int>(::syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, nullptr, 0));
+    }
+
+    int io_uring_register(const int ring_fd, const unsigned opcode, const void *arg, const unsigned nr_args)
+    {
+        return static_cast<int>(::syscall(__NR_io_uring_register, ring_fd, opcode, arg, nr_args));
+    }
+
+    // Ring indices are shared with the kernel
+    template <typename T>
+    T load_acquire(const T *ptr)
+    {
+        return __atomic_load_n(ptr, __ATOMIC_ACQUIRE);
+    }
+
+    template <typename T>
+    void store_release(T *ptr, const T val)
+    {
+        __atomic_store_n(ptr, val, __ATOMIC_RELEASE);
+    }
+
+    // A memory mapping, unmapped on destruction.
+    class Mapping
+    {
+    public:
+        Mapping() = default;
+        Mapping(const Mapping &) = delete;
+        Mapping &operator=(const Mapping &) = delete;
+        ~Mapping()
+        {
+            if (m_addr != MAP_FAILED)
+            {
+                ::munmap(m_addr, m_size);
+            }
+        }
+
+        // Map `size` bytes of the ring at `offset`, or anonymous memory if `fd` is -1. Returns false on failure.
+        bool map(const std::size_t size, const int fd = -1, const off_t offset = 0)
+        {
+            const int flags = fd < 0 ? (MAP_PRIVATE | MAP_ANONYMOUS) : (MAP_SHARED | MAP_POPULATE);
+            m_addr = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, flags, fd, offset);
+            m_size = size;
+            return m_addr != MAP_FAILED;
+        }
+
+        template <typename T = uint8_t>
+        [[nodiscard]] T *at(const std::size_t offset = 0) const
+        {
+            return reinterpret_cast<T *>(static_cast<uint8_t *>(m_addr) + offset);
+        }
+
+    private:
+        void *m_addr{MAP_FAILED};
+        std::size_t m_size{0};
+    };
+} // namespace
+
+struct UringEngine::State
+{
+    // Engine side state of a client connection
+    struct Slot
+    {
+        std::shared_ptr<Connection> conn{};
+        uint32_t generation{0};
+        bool is_receiving{false};
+        bool is_writing{false};
+        // Output of the write in flight
+        std::vector<uint8_t> output{};
+        std::size_t output_offset{0};
+        int send_slot{-1};
+    };
+
+    int listen_fd;
+    request_handler on_requests;
+
+    // Submission and completion queues shared with the kernel
+    int ring_fd{-1};
+    io_uring_params params{};
+    Mapping sq_ring{};
+    Mapping cq_ring{};
+    Mapping sqe_array{};
+    uint8_t *cq_base{nullptr};
+    unsigned sq_tail{0};
+
+    // Provided receive buffers
+    Mapping recv_ring{};
+    Mapping recv_buffers{};
+    bool is_recv_multishot{true};
+
+    // Registered send buffers
+    Mapping send_buffers{};
+    bool has_fixed_writes{false};
+    std::vector<int> free_send_slots{};
+
+    std::vector<Slot> slots{};
+    std::vector<uint32_t> free_slots{};
+
+    // Connections with output to write or paused requests to resume, scheduled by any thread. Other threads wake up
+    // the engine via eventfd.
+    std::thread::id engine_thread{};
+    std::mutex write_mutex{};
+    std::vector<std::pair<uint32_t, uint32_t>> write_queue{};
+    std::vector<std::pair<uint32_t, uint32_t>> resume_queue{};
+    int wakeup_fd{-1};
+    uint64_t wakeup_value{0};
+
+    State(const int listen_socket, request_handler handler) : listen_fd(listen_socket), on_requests(std::move(handler))
+    {
+        setup_ring();
+        setup_buffers();
+
+        wakeup_fd = ::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (wakeup_fd < 0)
+        {
+            throw json_server::InternalException(lh::nostd::source_location::current(), "eventfd failed: {}", errno);
+        }
+    }
+
+    State(const State &) = delete;
+    State &operator=(const State &) = delete;
+
+    ~State()
+    {
+        if (wakeup_fd >= 0)
+        {
+            ::close(wakeup_fd);
+        }
+        if (ring_fd >= 0)
+        {
+            ::close(ring_fd);
+        }
+    }
+
+    void setup_ring()
+    {
+        // Deferred task work avoids interrupting the engine thread, but needs kernel 5.19
+        params.flags = IORING_SETUP_COOP_TASKRUN;
+        ring_fd = io_uring_setup(RING_ENTRIES, &params);
+        if (ring_fd < 0 && errno == EINVAL)
+        {
+            params = {};
+            ring_fd = io_uring_setup(RING_ENTRIES, &params);
+        }
+        if (ring_fd < 0)
+        {
+            throw json_server::InternalException(lh::nostd::source_location::current(), "io_uring_setup failed: {}",
+                                                 errno);
+        }
+
+        auto sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        auto cq_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        const bool is_single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+        if (is_single_mmap)
+        {
+            sq_size = cq_size = std::max(sq_size, cq_size);
+        }
+
+        bool is_mapped = sq_ring.map(sq_size, ring_fd, IORING_OFF_SQ_RING) &&
+                         sqe_array.map(params.sq_entries * sizeof(io_uring_sqe), ring_fd, IORING_OFF_SQES);
+        if (is_mapped && !is_single_mmap)
+        {
+            is_mapped = cq_ring.map(cq_size, ring_fd, IORING_OFF_CQ_RING);
+        }
+        if (!is_mapped)
+        {
+            throw json_server::InternalException(lh::nostd::source_location::current(), "io_uring mmap failed: {}",
+                                                 errno);
+        }
+        cq_base = is_single_mmap ? sq_ring.at() : cq_ring.at();
+    }
+
+    void setup_buffers()
+    {
+        // Provided buffer rings need kernel 5.19, which also brings multishot accept
+        if (!recv_ring.map(RECV_BUFFER_COUNT * sizeof(io_uring_buf)) ||
+            !recv_buffers.map(RECV_BUFFER_COUNT * RECV_BUFFER_SIZE))
+        {
+            throw json_server::InternalException(lh::nostd::source_location::current(), "mmap failed: {}", errno);
+        }
+        io_uring_buf_reg reg{};
+        reg.ring_addr = reinterpret_cast<uint64_t>(recv_ring.at());
+        reg.ring_entries = RECV_BUFFER_COUNT;
+        reg.bgid = RECV_BUFFER_GROUP;
+        if (io_uring_register(ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0)
+        {
+            throw json_server::InternalException(lh::nostd::source_location::current(),
+                                                 "Registering receive buffers failed: {}", errno);
+        }
+        for (uint16_t bid = 0; bid < RECV_BUFFER_COUNT; ++bid)
+        {
+            recycle_buffer(bid);
+        }
+
+        // Without registered send buffers (e.g. due to memory limits), replies are sent from regular memory
+        if (send_buffers.map(SEND_SLOT_COUNT * SEND_SLOT_SIZE))
+        {
+            iovec iov{send_buffers.at(), SEND_SLOT_COUNT * SEND_SLOT_SIZE};
+            has_fixed_writes = io_uring_register(ring_fd, IORING_REGISTER_BUFFERS, &iov, 1) == 0;
+        }
+        if (has_fixed_writes)
+        {
+            for (std::size_t i = SEND_SLOT_COUNT; i > 0; --i)
+            {
+                free_send_slots.push_back(static_cast<int>(i - 1));
+            }
+        }
+    }
+
+    //
+    // Submission and completion queue handling
+    //
+
+    io_uring_sqe *get_sqe()
+    {
+        while (sq_tail - load_acquire(sq_ring.at<unsigned>(params.sq_off.head)) >= params.sq_entries)
+        {
+            // Queue full: hand the pending submissions to the kernel
+            submit_and_wait(0);
+        }
+        const auto idx = sq_tail & *sq_ring.at<unsigned>(params.sq_off.ring_mask);
+        sq_ring.at<unsigned>(params.sq_off.array)[idx] = idx;
+        ++sq_tail;
+
+        auto *const sqe = &sqe_array.at<io_uring_sqe>()[idx];
+        std::memset(sqe, 0, sizeof(io_uring_sqe));
+        return sqe;
+    }
+
+    // Submit all queued operations and wait for at least `wait_nr` completions with a single system call.
+    void submit_and_wait(const unsigned wait_nr)
+    {
+        store_release(sq_ring.at<unsigned>(params.sq_off.tail), sq_tail);
+        const auto to_submit = sq_tail - load_acquire(sq_ring.at<unsigned>(params.sq_off.head));
+        // Errors (e.g. EINTR) leave the submissions queued for the next call
+        io_uring_enter(ring_fd, to_submit, wait_nr, wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0U);
+    }
+
+    void reap_completions()
+    {
+        auto *const cq_head = reinterpret_cast<unsigned *>(cq_base + params.cq_off.head);
+        const auto *const cq_tail = reinterpret_cast<const unsigned *>(cq_base + params.cq_off.tail);
+        const auto cq_mask = *reinterpret_cast<const unsigned *>(cq_base + params.cq_off.ring_mask);
+        const auto *const cqes = reinterpret_cast<const io_uring_cqe *>(cq_base + params.cq_off.cqes);
+
+        auto head = *cq_head;
+        while (head != load_acquire(cq_tail))
+        {
+            const auto cqe = cqes[head & cq_mask];
+            store_release(cq_head, ++head);
+            handle_completion(cqe);
+        }
+    }
+
+    //
+    // Operations
+    //
+
+    void arm_accept()
+    {
+        auto *const sqe = get_sqe();
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->fd = listen_fd;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe->accept_flags = SOCK_CLOEXEC;
+        sqe->user_data = encode_user_data(op_type::accept);
+    }
+
+    void arm_wakeup()
+    {
+        auto *const sqe = get_sqe();
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = wakeup_fd;
+        sqe->addr = reinterpret_cast<uint64_t>(&wakeup_value);
+        sqe->len = sizeof(wakeup_value);
+        sqe->user_data = encode_user_data(op_type::wakeup);
+    }
+
+    void arm_recv(const uint32_t id)
+    {
+        auto &slot = slots[id];
+        auto *const sqe = get_sqe();
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = slot.conn->handle();
+        sqe->ioprio = is_recv_multishot ? IORING_RECV_MULTISHOT : 0U;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = RECV_BUFFER_GROUP;
+        sqe->user_data = encode_user_data(op_type::recv, id, slot.generation);
+        slot.is_receiving = true;
+    }
+
+    // Start writing the pending output of a connection, unless a write is in flight already.
+    void start_write(const uint32_t id)
+    {
+        auto &slot = slots[id];
+        if (!slot.conn || slot.is_writing || !slot.conn->take_output(slot.output))
+        {
+            return;
+        }
+        slot.output_offset = 0;
+        submit_write(id);
+    }
+
+    void submit_write(const uint32_t id)
+    {
+        auto &slot = slots[id];
+        const auto remaining = std::min(slot.output.size() - slot.output_offset, slot.conn->max_write_size());
+        auto *const sqe = get_sqe();
+        sqe->fd = slot.conn->handle();
+        sqe->user_data = encode_user_data(op_type::write, id, slot.generation);
+
+        if (slot.send_slot < 0 && remaining <= SEND_SLOT_SIZE && !free_send_slots.empty())
+        {
+            slot.send_slot = free_send_slots.back();
+            free_send_slots.pop_back();
+        }
+        if (slot.send_slot >= 0 && remaining <= SEND_SLOT_SIZE)
+        {
+            auto *const buffer = send_buffers.at(static_cast<std::size_t>(slot.send_slot) * SEND_SLOT_SIZE);
+            std::memcpy(buffer, slot.output.data() + slot.output_offset, remaining);
+            sqe->opcode = IORING_OP_WRITE_FIXED;
+            sqe->addr = reinterpret_cast<uint64_t>(buffer);
+            sqe->buf_index = 0;
+        }
+        else
+        {
+            sqe->opcode = IORING_OP_SEND;
+            sqe->addr = reinterpret_cast<uint64_t>(slot.output.data() + slot.output_offset);
+            sqe->msg_flags = MSG_NOSIGNAL;
+        }
+        sqe->len = static_cast<uint32_t>(remaining);
+        slot.is_writing = true;
+    }
+
+    // Hand a receive buffer back to the kernel.
+    void recycle_buffer(const uint16_t bid)
+    {
+        // Note: The ring entries are not accessed via io_uring_buf_ring::bufs, since its flexible array declaration
+        // has a different offset in C++ (empty structs are not empty there). The tail overlays the first entry.
+        auto *const tail = &recv_ring.at<io_uring_buf_ring>()->tail;
+        auto &buf = recv_ring.at<io_uring_buf>()[*tail & (RECV_BUFFER_COUNT - 1)];
+        buf.addr = reinterpret_cast<uint64_t>(recv_buffers.at(bid * RECV_BUFFER_SIZE));
+        buf.len = static_cast<uint32_t>(RECV_BUFFER_SIZE);
+        buf.bid = bid;
+        store_release(tail, static_cast<uint16_t>(*tail + 1));
+    }
+
+    //
+    // Connections
+    //
+
+    void add_connection(std::shared_ptr<Connection> conn)
+    {
+        uint32_t id = 0;
+        if (free_slots.empty())
+        {
+            id = static_cast<uint32_t>(slots.size());
+            slots.emplace_back();
+        }
+        else
+        {
+            id = free_slots.back();
+            free_slots.pop_back();
+        }
+
+        auto &slot = slots[id];
+        const auto generation = slot.generation;
+        conn->defer_writes([this, id, generation](const std::shared_ptr<Connection> &) {
+            schedule_write(id, generation);
+        });
+        conn->defer_resume([this, id, generation](const std::shared_ptr<Connection> &) {
+            schedule_resume(id, generation);
+        });
+        slot.conn = std::move(conn);
+        arm_recv(id);
+    }
+
+    // Release the connection in a slot once no operation refers to it anymore.
+    void release_if_done(const uint32_t id)
+    {
+        auto &slot = slots[id];
+        if (slot.is_receiving || slot.is_writing)
+        {
+            return;
+        }
+        if (slot.send_slot >= 0)
+        {
+            free_send_slots.push_back(slot.send_slot);
+        }
+        slot = Slot{{}, slot.generation + 1};
+        free_slots.push_back(id);
+    }
+
+    // Queue a write for a connection slot (thread-safe).
+    void schedule_write(const uint32_t id, const uint32_t generation)
+    {
+        {
+            const std::scoped_lock lock(write_mutex);
+            write_queue.emplace_back(id, generation);
+        }
+        wake_up();
+    }
+
+    // Queue processing the remaining requests of a connection slot (thread-safe). Even on the engine thread they are
+    // processed by the event loop, not nested into the request handler that resumed them.
+    void schedule_resume(const uint32_t id, const uint32_t generation)
+    {
+        {
+            const std::scoped_lock lock(write_mutex);
+            resume_queue.emplace_back(id, generation);
+        }
+        wake_up();
+    }
+
+    // Wake up the engine waiting for completions, unless called by the engine itself.
+    void wake_up()
+    {
+        if (std::this_thread::get_id() != engine_thread)
+        {
+            const uint64_t one{1};
+            [[maybe_unused]] const auto ret = ::write(wakeup_fd, &one, sizeof(one));
+        }
+    }
+
+    //
+    // Completions
+    //
+
+    void handle_completion(const io_uring_cqe &cqe)
+    {
+        const auto type = static_cast<op_type>(cqe.user_data & 0xFFU);
+        const auto id = static_cast<uint32_t>((cqe.user_data >> 8U) & 0xFFFFFFU);
+        const auto generation = static_cast<uint32_t>(cqe.user_data >> 32U);
+        const bool has_more = (cqe.flags & IORING_CQE_F_MORE) != 0;
+
+        switch (type)
+        {
+            case op_type::accept:
+            {
+                if (cqe.res >= 0)
+                {
+                    try
+                    {
+                        add_connection(std::make_shared<Connection>(sockpp::unix_socket(cqe.res)));
+                    }
+                    catch (const json_server::InternalException &)
+                    {
+                        // Drop the connection
+                    }
+                }
+                if (!has_more)
+                {
+                    arm_accept();
+                }
+                break;
+            }
+            case op_type::wakeup:
+            {
+                arm_wakeup();
+                break;
+            }
+            case op_type::recv:
+            {
+                if (id < slots.size() && slots[id].generation == generation)
+                {
+                    on_recv(id, cqe, has_more);
+                }
+                break;
+            }
+            case op_type::write:
+            {
+                if (id < slots.size() && slots[id].generation == generation)
+                {
+                    on_write(id, cqe.res);
+                }
+                break;
+            }
+        }
+    }
+
+    void on_recv(const uint32_t id, const io_uring_cqe &cqe, const bool has_more)
+    {
+        if (cqe.res > 0 && (cqe.flags & IORING_CQE_F_BUFFER) != 0)
+        {
+            const auto bid = static_cast<uint16_t>(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+            const auto conn = slots[id].conn;
+
+            const auto must_process =
+                conn->consume(recv_buffers.at(bid * RECV_BUFFER_SIZE), static_cast<std::size_t>(cqe.res));
+            recycle_buffer(bid);
+            if (must_process)
+            {
+                on_requests(conn);
+            }
+            if (!has_more)
+            {
+                arm_recv(id);
+            }
+            return;
+        }
+
+        if (cqe.res == -ENOBUFS)
+        {
+            // All buffers were in use, they have been recycled in the meantime
+            if (!has_more)
+            {
+                arm_recv(id);
+            }
+            return;
+        }
+        if (cqe.res == -EINVAL && is_recv_multishot)
+        {
+            // Kernel older than 6.0: fall back to single shot receives
+            is_recv_multishot = false;
+            arm_recv(id);
+            return;
+        }
+
+        // Peer closed the connection or the socket failed
+        if (!has_more)
+        {
+            slots[id].is_receiving = false;
+            release_if_done(id);
+        }
+    }
+
+    void on_write(const uint32_t id, const int res)
+    {
+        auto &slot = slots[id];
+        slot.is_writing = false;
+        if (res > 0)
+        {
+            slot.output_offset += static_cast<std::size_t>(res);
+            if (slot.output_offset < slot.output.size())
+            {
+                submit_write(id);
+                return;
+            }
+        }
+        // Done, or the connection broke (which also terminates its receive)
+        if (slot.send_slot >= 0)
+        {
+            free_send_slots.push_back(slot.send_slot);
+            slot.send_slot = -1;
+        }
+        if (!slot.is_receiving)
+        {
+            release_if_done(id);
+            return;
+        }
+        start_write(id);
+    }
+
+    [[noreturn]] void run()
+    {
+        engine_thread = std::this_thread::get_id();
+        arm_accept();
+        arm_wakeup();
+
+        std::vector<std::pair<uint32_t, uint32_t>> scheduled;
+        std::vector<std::pair<uint32_t, uint32_t>> resumed;
+        while (true)
+        {
+            {
+                const std::scoped_lock lock(write_mutex);
+                std::swap(resumed, resume_queue);
+            }
+            for (const auto &[id, generation]: resumed)
+            {
+                // Requests of a connection released meanwhile are dropped with it
+                if (id < slots.size() && slots[id].generation == generation)
+                {
+                    on_requests(slots[id].conn);
+                }
+            }
+            resumed.clear();
+
+            // Including the writes of the resumed requests
+            {
+                const std::scoped_lock lock(write_mutex);
+                std::swap(scheduled, write_queue);
+            }
+            for (const auto &[id, generation]: scheduled)
+            {
+                if (id < slots.size() && slots[id].generation == generation)
+                {
+                    start_write(id);
+                }
+            }
+            scheduled.clear();
+
+            submit_and_wait(1);
+            reap_completions();
+        }
+    }
+};
+
+UringEngine::UringEngine(const int listen_fd, request_handler on_requests)
+    : m_state(std::make_unique<State>(listen_fd, std::move(on_requests)))
+{
+}
+
+void UringEngine::run()
+{
+    m_state->run();
+}
+
+#else
+
+struct UringEngine::State
+{
+};
+
+UringEngine::UringEngine(const int, request_handler)
+{
+    throw json_server::InternalException(lh::nostd::source_location::current(),
+                                         "io_uring is not supported by the kernel headers used for building");
+}
+
+void UringEngine::run()
+{
+    while (true)
+    {
+        ::pause();
+    }
+}
+
+#endif
+
+UringEngine::~UringEngine() = default;
+
+} // namespace json_server::impl
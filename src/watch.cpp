@@ -0,0 +1,322 @@
+#include "watch.hpp"
+
+#include <algorithm>
+
+#include "details.hpp"
+#include "exceptions.hpp"
+
+
+namespace json_server::impl
+{
+
+namespace
+{
+    // Number of subscriptions from which on closed connections are swept when the number doubled
+    constexpr std::size_t MIN_PURGE_SIZE = 64;
+    // Delay before trying again to notify a client whose backlog is full
+    constexpr auto BACKLOG_RETRY_DELAY = std::chrono::milliseconds(10);
+} // namespace
+
+WatchRegistry::WatchRegistry(const Model &model) : m_model(model)
+{
+}
+
+void WatchRegistry::watch(const std::shared_ptr<Connection> &conn, const uint32_t id, const PathHandle &path,
+                          const bool version_only, const std::chrono::microseconds min_interval)
+{
+    auto subscription = std::make_shared<Subscription>();
+    subscription->conn = conn;
+    subscription->client = conn.get();
+    subscription->id = id;
+    subscription->path = path.tokens();
+    subscription->is_version_only = version_only;
+    subscription->min_interval = min_interval;
+    // Only changes from now on are notified
+    try
+    {
+        subscription->version = find(*m_model.snapshot(), subscription->path).version();
+    }
+    catch (const json_server::RuntimeException &)
+    {
+        // Missing path
+    }
+
+    const std::scoped_lock lock(m_mutex);
+    auto &entry = m_by_client[{conn.get(), id}];
+    if (entry)
+    {
+        remove(entry);
+    }
+    entry = subscription;
+
+    auto *node = &m_root;
+    for (const auto &token: subscription->path)
+    {
+        auto &child = node->children[token];
+        if (!child)
+        {
+            child = std::make_unique<TreeNode>();
+        }
+        node = child.get();
+    }
+    node->subscriptions.push_back(std::move(subscription));
+
+    const auto num_subscriptions = m_num_subscriptions.fetch_add(1, std::memory_order_release) + 1;
+    if (num_subscriptions >= std::max(MIN_PURGE_SIZE, 2 * m_num_after_purge))
+    {
+        purge();
+    }
+}
+
+void WatchRegistry::unwatch(const Connection &conn, const uint32_t id)
+{
+    const std::scoped_lock lock(m_mutex);
+    const auto it = m_by_client.find({&conn, id});
+    if (it != m_by_client.end())
+    {
+        remove(it->second);
+        m_by_client.erase(it);
+    }
+}
+
+void WatchRegistry::changed(const std::vector<std::string> &path)
+{
+    if (m_num_subscriptions.load(std::memory_order_acquire) == 0)
+    {
+        return;
+    }
+
+    // Subscriptions of the ancestors see the change in their subtree, those of the descendants may see a new value
+    const std::shared_lock lock(m_mutex);
+    const auto *node = &m_root;
+    for (const auto &token: path)
+    {
+        for (const auto &subscription: node->subscriptions)
+        {
+            enqueue(subscription);
+        }
+        const auto it = node->children.find(token);
+        if (it == node->children.end())
+        {
+            return;
+        }
+        node = it->second.get();
+    }
+    enqueue_subtree(*node);
+}
+
+WatchStats WatchRegistry::stats() const
+{
+    WatchStats stats;
+    stats.notifications = m_num_notifications.load(std::memory_order_relaxed);
+    stats.dropped = m_num_dropped.load(std::memory_order_relaxed);
+
+    const std::shared_lock lock(m_mutex);
+    stats.subscriptions = m_by_client.size();
+    stats.conflated = m_removed_conflated;
+    for (const auto &entry: m_by_client)
+    {
+        stats.conflated += entry.second->num_conflated.load(std::memory_order_relaxed);
+    }
+    return stats;
+}
+
+void WatchRegistry::run()
+{
+    std::vector<subscription_ptr> queued;
+    std::vector<subscription_ptr> closed;
+    while (true)
+    {
+        {
+            std::unique_lock lock(m_queue_mutex);
+            const auto has_queued = [this]() { return !m_queue.empty(); };
+            if (m_deferred.empty())
+            {
+                m_queue_cv.wait(lock, has_queued);
+            }
+            else
+            {
+                m_queue_cv.wait_until(lock, m_deferred.begin()->first, has_queued);
+            }
+            queued.swap(m_queue);
+        }
+
+        const auto now = clock::now();
+        while (!m_deferred.empty() && m_deferred.begin()->first <= now)
+        {
+            queued.push_back(std::move(m_deferred.begin()->second));
+            m_deferred.erase(m_deferred.begin());
+        }
+        for (auto &subscription: queued)
+        {
+            if (!notify(subscription, now))
+            {
+                closed.push_back(std::move(subscription));
+            }
+        }
+        queued.clear();
+
+        if (!closed.empty())
+        {
+            const std::scoped_lock lock(m_mutex);
+            for (const auto &subscription: closed)
+            {
+                const auto it = m_by_client.find({subscription->client, subscription->id});
+                if (it != m_by_client.end() && it->second == subscription)
+                {
+                    remove(subscription);
+                    m_by_client.erase(it);
+                }
+            }
+            closed.clear();
+        }
+    }
+}
+
+void WatchRegistry::enqueue(const subscription_ptr &subscription)
+{
+    // Changes until the dispatcher sends the notification are conflated into it
+    if (subscription->is_queued.exchange(true, std::memory_order_acq_rel))
+    {
+        subscription->num_conflated.fetch_add(1, std::memory_order_relaxed);
+        if (subscription->is_held_back.load(std::memory_order_relaxed))
+        {
+            m_num_dropped.fetch_add(1, std::memory_order_relaxed);
+        }
+        return;
+    }
+    {
+        const std::scoped_lock lock(m_queue_mutex);
+        m_queue.push_back(subscription);
+    }
+    m_queue_cv.notify_one();
+}
+
+void WatchRegistry::enqueue_subtree(const TreeNode &node)
+{
+    for (const auto &subscription: node.subscriptions)
+    {
+        enqueue(subscription);
+    }
+    for (const auto &child: node.children)
+    {
+        enqueue_subtree(*child.second);
+    }
+}
+
+void WatchRegistry::remove(const subscription_ptr &subscription)
+{
+    subscription->is_removed.store(true, std::memory_order_relaxed);
+    m_num_subscriptions.fetch_sub(1, std::memory_order_relaxed);
+    m_removed_conflated += subscription->num_conflated.load(std::memory_order_relaxed);
+
+    // Remove the subscription from its node, then the nodes left without subscriptions and children
+    std::vector<std::pair<TreeNode *, const std::string *>> nodes;
+    auto *node = &m_root;
+    for (const auto &token: subscription->path)
+    {
+        nodes.emplace_back(node, &token);
+        node = node->children.at(token).get();
+    }
+    auto &subscriptions = node->subscriptions;
+    subscriptions.erase(std::find(subscriptions.begin(), subscriptions.end(), subscription));
+
+    while (!nodes.empty() && node->subscriptions.empty() && node->children.empty())
+    {
+        const auto [parent, token] = nodes.back();
+        nodes.pop_back();
+        parent->children.erase(*token);
+        node = parent;
+    }
+}
+
+void WatchRegistry::purge()
+{
+    for (auto it = m_by_client.begin(); it != m_by_client.end();)
+    {
+        if (it->second->conn.expired())
+        {
+            remove(it->second);
+            it = m_by_client.erase(it);
+        }
+        else
+        {
+            ++it;
+        }
+    }
+    m_num_after_purge = m_by_client.size();
+}
+
+bool WatchRegistry::notify(const subscription_ptr &queued, const clock::time_point now)
+{
+    auto &subscription = *queued;
+    const auto conn = subscription.conn.lock();
+    if (!conn)
+    {
+        return false;
+    }
+    if (subscription.is_removed.load(std::memory_order_relaxed))
+    {
+        return true;
+    }
+
+    // Held back subscriptions stay queued, so that writers keep conflating their changes
+    const auto next_allowed = subscription.last_sent + subscription.min_interval;
+    if (now < next_allowed)
+    {
+        subscription.is_held_back.store(true, std::memory_order_relaxed);
+        m_deferred.emplace(next_allowed, queued);
+        return true;
+    }
+    if (conn->pending_output() > m_backlog_limit.load(std::memory_order_relaxed))
+    {
+        subscription.is_held_back.store(true, std::memory_order_relaxed);
+        m_deferred.emplace(now + BACKLOG_RETRY_DELAY, queued);
+        return true;
+    }
+    subscription.is_held_back.store(false, std::memory_order_relaxed);
+
+    // Clear the flag before reading the model, so that later changes queue the subscription again
+    subscription.is_queued.store(false, std::memory_order_seq_cst);
+
+    const auto root = m_model.snapshot();
+    const Node *node = nullptr;
+    auto err = json_server::error_code::none;
+    try
+    {
+        node = &find(*root, subscription.path);
+    }
+    catch (const json_server::RuntimeException &e)
+    {
+        err = e.m_err_code;
+    }
+    // The version of the subtree changes with every write to it; 0 while the path is missing
+    const auto version = node != nullptr ? node->version() : 0;
+    if (version == subscription.version)
+    {
+        // Already notified with this version, e.g. for a write above the subtree which left it as it was
+        return true;
+    }
+    subscription.version = version;
+    subscription.last_sent = now;
+
+    const bool has_value = node != nullptr && !subscription.is_version_only;
+    conn->send([&](std::vector<uint8_t> &out) {
+        ::details::ReplyHeader header;
+        header.err_code = err;
+        header.flags = ::details::REPLY_FLAG_VALUE | ::details::REPLY_FLAG_NOTIFICATION;
+        header.request_id = subscription.id;
+        const auto *const header_bytes = reinterpret_cast<const uint8_t *>(&header);
+        out.insert(out.end(), header_bytes, header_bytes + sizeof(header));
+        append_array_header(out, has_value ? 2 : 1);
+        append_unsigned(out, version);
+        if (has_value)
+        {
+            node->to_msgpack(out);
+        }
+    });
+    m_num_notifications.fetch_add(1, std::memory_order_relaxed);
+    return true;
+}
+
+} // namespace json_server::impl
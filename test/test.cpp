@@ -2,19 +2,72 @@
 
 #include <iostream>
 #include <string>
+#include <algorithm>
 #include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <new>
 #include <thread>
+#include <vector>
 
+#include <poll.h>
+
+#include "nlohmann/json.hpp"
 #include "json_server.hpp"
 #include "json_client.hpp"
 
 UTEST_STATE();
 
-using client = json_client::EndpointConnection;
 using basic_type = json_client::types::BasicType;
 using compound_type = json_client::types::CompoundType;
 
 
+// Socket type of the server, selected on the command line
+details::transport g_transport{details::transport::stream};
+
+json_client::EndpointConnection client(const std::string &resource_path, const bool exclusive = false)
+{
+    return json_client::EndpointConnection(resource_path, exclusive, details::DEFAULT_SOCK_FILE, g_transport);
+}
+
+
+// Heap allocations of the server threads are counted, the test threads' (i.e. the clients') are not
+namespace
+{
+    std::atomic<uint64_t> g_server_allocations{0};
+    thread_local bool t_is_test_thread{false};
+} // namespace
+
+void *operator new(std::size_t size)
+{
+    if (!t_is_test_thread)
+    {
+        ++g_server_allocations;
+    }
+    if (void *ptr = std::malloc(size == 0 ? 1 : size))
+    {
+        return ptr;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void *ptr) noexcept
+{
+    std::free(ptr);
+}
+
+void operator delete(void *ptr, std::size_t) noexcept
+{
+    std::free(ptr);
+}
+
+
 //
 // Tests for reading data
 //
@@ -140,6 +193,49 @@ UTEST(Set, vector_hetereogenous)
     ASSERT_TRUE(endpoint.get<compound_type>() == orig_vec);
 }
 
+UTEST(Set, overwrite_subtree)
+{
+    // Overwriting a subtree removes the paths below it which the new value lacks, also from the path index
+    const auto is_path_error = [](json_client::EndpointConnection &endpoint)
+    {
+        try
+        {
+            endpoint.get<int64_t>();
+        }
+        catch (const json_server::RuntimeException &e)
+        {
+            return e.m_err_code == json_server::error_code::json_path_error;
+        }
+        return false;
+    };
+    auto array = client("/array/homogenous");
+    const auto orig_vec = array.get<compound_type>();
+    // Resolved to a handle while the element exists
+    auto element = client("/array/homogenous/15");
+    ASSERT_EQ(element.get<int64_t>(), 6);
+
+    array.set<compound_type>(std::vector<basic_type>{1, 2, 3});
+    ASSERT_TRUE(is_path_error(element));
+    auto removed = client("/array/homogenous/15");
+    ASSERT_TRUE(is_path_error(removed));
+    ASSERT_EQ(client("/array/homogenous/2").get<int64_t>(), 3);
+
+    // The handle finds the element again once it is back
+    array.set<compound_type>(orig_vec);
+    ASSERT_EQ(element.get<int64_t>(), 6);
+
+    // Also when the subtree is replaced by a basic value
+    auto heterogenous = client("/array/heterogenous");
+    const auto orig_heterogenous = heterogenous.get<compound_type>();
+    auto first = client("/array/heterogenous/1");
+    ASSERT_EQ(first.get<int64_t>(), 1);
+    heterogenous.set<int64_t>(42);
+    ASSERT_TRUE(is_path_error(first));
+    heterogenous.set<compound_type>(orig_heterogenous);
+    ASSERT_EQ(first.get<int64_t>(), 1);
+    ASSERT_TRUE(array.get<compound_type>() == orig_vec);
+}
+
 //
 // Test errors
 //
@@ -160,6 +256,24 @@ UTEST(Errors, invalid_path)
     ASSERT_TRUE(is_thrown);
 }
 
+UTEST(Errors, malformed_path)
+{
+    // Cannot be resolved to a handle, requests still fail with a path error
+    auto endpoint = client("basic/int");
+
+    bool is_thrown = false;
+    try
+    {
+        const auto _ = endpoint.get<int64_t>();
+    }
+    catch (const json_server::RuntimeException &e)
+    {
+        ASSERT_EQ(e.m_err_code, json_server::error_code::json_path_error);
+        is_thrown = true;
+    }
+    ASSERT_TRUE(is_thrown);
+}
+
 UTEST(Errors, type_mismatch)
 {
     auto endpoint = client("/basic/string");
@@ -194,6 +308,872 @@ UTEST(Errors, unlock)
     ASSERT_TRUE(is_thrown);
 }
 
+//
+// Wire protocol
+//
+namespace
+{
+    // Connection to the server without the client library.
+    struct RawConnection
+    {
+        sockpp::unix_connector socket{};
+        // Received bytes not returned by `receive` yet
+        std::vector<uint8_t> received{};
+
+        RawConnection()
+        {
+            const sockpp::unix_address addr{std::string(details::DEFAULT_SOCK_FILE)};
+            socket.reset(sockpp::socket::create_handle(AF_UNIX, details::socket_type(g_transport)));
+            ::connect(socket.handle(), addr.sockaddr_ptr(), addr.size());
+        }
+
+        void send(const std::vector<uint8_t> &payload)
+        {
+            const std::array<iovec, 1> parts{iovec{const_cast<uint8_t *>(payload.data()), payload.size()}};
+            details::transmit_frame(socket, parts, details::max_write_size(g_transport));
+        }
+
+        std::vector<uint8_t> receive()
+        {
+            std::array<uint8_t, details::MAX_DATAGRAM_SIZE> chunk{};
+            while (true)
+            {
+                uint32_t size{0};
+                if (received.size() >= sizeof(size))
+                {
+                    std::memcpy(&size, received.data(), sizeof(size));
+                    const auto frame_end = received.begin() + static_cast<std::ptrdiff_t>(sizeof(size) + size);
+                    if (received.size() >= sizeof(size) + size)
+                    {
+                        std::vector<uint8_t> payload(received.begin() + sizeof(size), frame_end);
+                        received.erase(received.begin(), frame_end);
+                        return payload;
+                    }
+                }
+                const auto ret = socket.read(chunk.data(), chunk.size());
+                if (ret <= 0)
+                {
+                    return {};
+                }
+                received.insert(received.end(), chunk.begin(), chunk.begin() + ret);
+            }
+        }
+    };
+} // namespace
+
+UTEST(Protocol, msgpack_map)
+{
+    // Clients of the original protocol are still served
+    RawConnection conn;
+    nlohmann::json req;
+    req["cmd"] = static_cast<uint8_t>(details::request_cmd::read);
+    req["path"] = "/basic/string";
+    conn.send(nlohmann::json::to_msgpack(req));
+
+    const auto reply = nlohmann::json::from_msgpack(conn.receive());
+    ASSERT_EQ(reply.at("err_code").get<int>(), 0);
+    ASSERT_STREQ(reply.at("value").get<std::string>().c_str(), "DEBUG");
+}
+
+UTEST(Protocol, unsupported_version)
+{
+    RawConnection conn;
+    details::RequestHeader header;
+    header.version = details::PROTOCOL_VERSION + 1;
+    header.cmd = details::request_cmd::read;
+    const auto *const header_bytes = reinterpret_cast<const uint8_t *>(&header);
+    conn.send(std::vector<uint8_t>(header_bytes, header_bytes + sizeof(header)));
+
+    const auto reply = conn.receive();
+    ASSERT_EQ(reply.size(), sizeof(details::ReplyHeader));
+    details::ReplyHeader reply_header;
+    std::memcpy(&reply_header, reply.data(), sizeof(reply_header));
+    ASSERT_EQ(reply_header.version, details::PROTOCOL_VERSION);
+    ASSERT_EQ(reply_header.err_code, json_server::error_code::protocol);
+
+    // The connection stays usable with a supported protocol
+    nlohmann::json req;
+    req["cmd"] = static_cast<uint8_t>(details::request_cmd::read);
+    req["path"] = "/basic/float";
+    conn.send(nlohmann::json::to_msgpack(req));
+    ASSERT_NEAR(nlohmann::json::from_msgpack(conn.receive()).at("value").get<float>(), -24.0, 1e-6);
+}
+
+UTEST(Protocol, batched_requests)
+{
+    // Requests sent back to back are answered in order, with the request IDs chosen by the client
+    const std::array<std::string, 3> paths{"/basic/string", "/basic/bool", "/basic/string"};
+    const std::array<uint32_t, 3> request_ids{7, 0xffffffff, 7};
+    std::vector<uint8_t> batch;
+    for (std::size_t i = 0; i < paths.size(); ++i)
+    {
+        const auto &path = paths[i];
+        details::RequestHeader header;
+        header.cmd = details::request_cmd::read;
+        header.path_size = static_cast<uint32_t>(path.size());
+        header.request_id = request_ids[i];
+        const auto frame_size = static_cast<uint32_t>(sizeof(header) + path.size());
+        const auto *const size_bytes = reinterpret_cast<const uint8_t *>(&frame_size);
+        const auto *const header_bytes = reinterpret_cast<const uint8_t *>(&header);
+        batch.insert(batch.end(), size_bytes, size_bytes + sizeof(frame_size));
+        batch.insert(batch.end(), header_bytes, header_bytes + sizeof(header));
+        batch.insert(batch.end(), path.begin(), path.end());
+    }
+    RawConnection conn;
+    conn.socket.write_n(batch.data(), batch.size());
+
+    for (std::size_t i = 0; i < paths.size(); ++i)
+    {
+        const auto reply = conn.receive();
+        ASSERT_GT(reply.size(), sizeof(details::ReplyHeader));
+        details::ReplyHeader reply_header;
+        std::memcpy(&reply_header, reply.data(), sizeof(reply_header));
+        ASSERT_EQ(reply_header.request_id, request_ids[i]);
+        const auto val = nlohmann::json::from_msgpack(reply.begin() + sizeof(details::ReplyHeader), reply.end());
+        if (i == 1)
+        {
+            ASSERT_TRUE(val.is_boolean());
+        }
+        else
+        {
+            ASSERT_STREQ(val.get<std::string>().c_str(), "DEBUG");
+        }
+    }
+}
+
+UTEST(Protocol, large_value)
+{
+    // Values larger than a datagram are split up on seqpacket sockets
+    auto endpoint = client("/basic/string");
+    const std::string large(5 * details::MAX_DATAGRAM_SIZE / 2, 'x');
+    endpoint.set(large);
+    const auto val = endpoint.get<std::string>();
+    endpoint.set(std::string("DEBUG"));
+    ASSERT_TRUE(val == large);
+}
+
+//
+// Pipelining
+//
+UTEST(Pipeline, in_order)
+{
+    const auto orig_val = client("/basic/int").get<int64_t>();
+
+    // Keep many requests in flight; every get sees the set before it
+    json_client::Pipeline pipeline(details::DEFAULT_SOCK_FILE, g_transport);
+    constexpr int64_t NUM_SETS = 100;
+    std::vector<uint32_t> request_ids;
+    for (int64_t i = 0; i < NUM_SETS; ++i)
+    {
+        request_ids.push_back(pipeline.set("/basic/int", i));
+        request_ids.push_back(pipeline.get("/basic/int"));
+        request_ids.push_back(pipeline.get("/array/heterogenous"));
+    }
+    ASSERT_EQ(pipeline.in_flight(), request_ids.size());
+
+    for (std::size_t i = 0; i < request_ids.size(); ++i)
+    {
+        ASSERT_EQ(pipeline.receive(), request_ids[i]);
+        ASSERT_EQ(pipeline.error(), json_server::error_code::none);
+        if (i % 3 == 1)
+        {
+            ASSERT_EQ(pipeline.result<int64_t>(), static_cast<int64_t>(i / 3));
+        }
+        else if (i % 3 == 2)
+        {
+            ASSERT_EQ(pipeline.result<std::vector<json_client::types::BasicType>>().size(), 5);
+        }
+    }
+    ASSERT_EQ(pipeline.in_flight(), 0);
+
+    pipeline.set("/basic/int", orig_val);
+    pipeline.receive();
+    ASSERT_EQ(pipeline.error(), json_server::error_code::none);
+}
+
+UTEST(Pipeline, error)
+{
+    // Every request gets its own reply, also those after a failed one
+    json_client::Pipeline pipeline(details::DEFAULT_SOCK_FILE, g_transport);
+    pipeline.get("/basic/string");
+    pipeline.get("/invalid");
+    pipeline.get("/basic/int");
+    pipeline.get("/basic/missing");
+    pipeline.get("/basic/bool");
+    pipeline.receive();
+    ASSERT_STREQ(pipeline.result<std::string>().c_str(), "DEBUG");
+    pipeline.receive();
+    ASSERT_EQ(pipeline.error(), json_server::error_code::json_path_error);
+
+    bool is_thrown = false;
+    try
+    {
+        const auto _ = pipeline.result<std::string>();
+    }
+    catch (const json_server::RuntimeException &e)
+    {
+        ASSERT_EQ(e.m_err_code, json_server::error_code::json_path_error);
+        is_thrown = true;
+    }
+    ASSERT_TRUE(is_thrown);
+
+    pipeline.receive();
+    ASSERT_EQ(pipeline.result<int64_t>(), client("/basic/int").get<int64_t>());
+    pipeline.receive();
+    ASSERT_EQ(pipeline.error(), json_server::error_code::json_path_error);
+    pipeline.receive();
+    ASSERT_EQ(pipeline.error(), json_server::error_code::none);
+    ASSERT_EQ(pipeline.in_flight(), 0);
+}
+
+//
+// Asynchronous requests
+//
+UTEST(Async, futures)
+{
+    json_client::AsyncConnection conn(details::DEFAULT_SOCK_FILE, g_transport);
+    auto orig_float = conn.get_async<float>("/basic/float");
+    auto set_float = conn.set_async("/basic/float", 2.5F);
+    auto new_float = conn.get_async<float>("/basic/float");
+    auto array = conn.get_async<std::vector<int64_t>>("/array/homogenous");
+    // Values of a wrong type fail the future, but not the connection
+    auto wrong_type = conn.get_async<std::string>("/basic/int");
+    auto string = conn.get_async<std::string>("/basic/string");
+
+    ASSERT_NEAR(orig_float.get(), -24.0, 1e-6);
+    set_float.get();
+    ASSERT_NEAR(new_float.get(), 2.5, 1e-6);
+    ASSERT_EQ(array.get().size(), 19);
+    bool is_thrown = false;
+    try
+    {
+        wrong_type.get();
+    }
+    catch (const json_server::RuntimeException &e)
+    {
+        ASSERT_EQ(e.m_err_code, json_server::error_code::type_error);
+        is_thrown = true;
+    }
+    ASSERT_TRUE(is_thrown);
+    ASSERT_STREQ(string.get().c_str(), "DEBUG");
+
+    conn.set_async("/basic/float", -24.0F).get();
+}
+
+UTEST(Async, callbacks_on_fd)
+{
+    // Without I/O thread, the callbacks run whenever the user processes the replies
+    json_client::AsyncConnection conn(details::DEFAULT_SOCK_FILE, g_transport, false);
+    std::vector<std::string> completed;
+    constexpr std::size_t NUM_GETS = 50;
+    for (std::size_t i = 0; i < NUM_GETS; ++i)
+    {
+        conn.get_async<std::string>("/basic/string",
+                                    [&](const json_server::error_code err, const std::string &val)
+                                    { completed.push_back(err == json_server::error_code::none ? val : "error"); });
+    }
+    json_server::error_code set_err = json_server::error_code::socket_error;
+    conn.set_async("/basic/bool", false, [&](const json_server::error_code err) { set_err = err; });
+
+    pollfd fds{conn.fd(), POLLIN, 0};
+    while (set_err == json_server::error_code::socket_error && ::poll(&fds, 1, 1000) > 0)
+    {
+        conn.process_replies();
+    }
+    ASSERT_EQ(set_err, json_server::error_code::none);
+    ASSERT_EQ(completed.size(), NUM_GETS);
+    for (const auto &val: completed)
+    {
+        ASSERT_STREQ(val.c_str(), "DEBUG");
+    }
+}
+
+UTEST(Async, failed_request)
+{
+    // Every future gets the result of its own request, also those of requests after failed ones
+    json_client::AsyncConnection conn(details::DEFAULT_SOCK_FILE, g_transport);
+    auto valid = conn.get_async<bool>("/basic/bool");
+    auto invalid = conn.get_async<bool>("/invalid");
+    auto string = conn.get_async<std::string>("/basic/string");
+    auto missing = conn.get_async<int64_t>("/basic/missing");
+    auto set = conn.set_async("/basic/bool", false);
+    ASSERT_FALSE(valid.get());
+    bool is_thrown = false;
+    try
+    {
+        invalid.get();
+    }
+    catch (const json_server::RuntimeException &e)
+    {
+        ASSERT_EQ(e.m_err_code, json_server::error_code::json_path_error);
+        is_thrown = true;
+    }
+    ASSERT_TRUE(is_thrown);
+    ASSERT_STREQ(string.get().c_str(), "DEBUG");
+    ASSERT_EXCEPTION(missing.get(), json_server::RuntimeException);
+    set.get();
+}
+
+//
+// Subscriptions
+//
+namespace
+{
+    // Process the replies of a connection without I/O thread until `is_done` or nothing arrives for a while.
+    void process_replies(json_client::AsyncConnection &conn, const std::function<bool()> &is_done)
+    {
+        pollfd fds{conn.fd(), POLLIN, 0};
+        while (!is_done() && ::poll(&fds, 1, 1000) > 0)
+        {
+            conn.process_replies();
+        }
+    }
+} // namespace
+
+UTEST(Watch, notifications)
+{
+    // Outlive the connection, which fails the subscriptions when it closes
+    std::size_t num_errors{0};
+    std::vector<int64_t> int_values;
+    uint64_t int_version{0};
+    std::vector<uint64_t> array_versions;
+    std::vector<int64_t> element_values;
+    json_client::AsyncConnection conn(details::DEFAULT_SOCK_FILE, g_transport, false);
+    const auto process_until = [&conn](const std::function<bool()> &is_done) { process_replies(conn, is_done); };
+
+    const auto int_id = conn.watch<int64_t>(
+        "/basic/int",
+        [&](const json_server::error_code err, const uint64_t version, const int64_t val)
+        {
+            num_errors += err == json_server::error_code::none ? 0 : 1;
+            int_values.push_back(val);
+            int_version = version;
+        });
+    conn.watch_version("/array",
+                       [&](const json_server::error_code err, const uint64_t version)
+                       {
+                           num_errors += err == json_server::error_code::none ? 0 : 1;
+                           array_versions.push_back(version);
+                       });
+    conn.watch<int64_t>("/array/homogenous/0",
+                        [&](const json_server::error_code err, const uint64_t, const int64_t val)
+                        {
+                            num_errors += err == json_server::error_code::none ? 0 : 1;
+                            element_values.push_back(val);
+                        });
+    // The watch requests are processed before the get
+    auto synced = conn.get_async<int64_t>("/basic/int");
+    process_until([&]() { return synced.wait_for(std::chrono::seconds(0)) == std::future_status::ready; });
+    const auto orig_int = synced.get();
+
+    // A write to the path itself
+    auto int_endpoint = client("/basic/int");
+    int_endpoint.set(orig_int + 1);
+    process_until([&]() { return !int_values.empty(); });
+    ASSERT_EQ(int_values.back(), orig_int + 1);
+    ASSERT_TRUE(array_versions.empty());
+    // Notifications carry the version of the watched subtree
+    json_client::Transaction versions(details::DEFAULT_SOCK_FILE, g_transport);
+    versions.check_exists("/basic/int");
+    ASSERT_TRUE(versions.commit());
+    ASSERT_EQ(versions.version(0), int_version);
+
+    // A write above the element and below the array
+    auto array_endpoint = client("/array/homogenous");
+    const auto orig_vec = array_endpoint.get<compound_type>();
+    auto set_vec = orig_vec;
+    set_vec.front() = 100;
+    array_endpoint.set<compound_type>(set_vec);
+    process_until([&]() { return !array_versions.empty() && !element_values.empty(); });
+    ASSERT_GT(array_versions.back(), int_version);
+    ASSERT_EQ(element_values.back(), 100);
+
+    // No more notifications after unwatching
+    conn.unwatch(int_id);
+    int_endpoint.set(orig_int);
+    array_endpoint.set<compound_type>(orig_vec);
+    process_until([&]() { return element_values.size() == 2; });
+    ASSERT_TRUE(basic_type{element_values.back()} == orig_vec.front());
+    ASSERT_EQ(int_values.size(), 1);
+    ASSERT_EQ(num_errors, 0u);
+}
+
+UTEST(Watch, rate_limit)
+{
+    std::vector<int64_t> values;
+    json_client::AsyncConnection conn(details::DEFAULT_SOCK_FILE, g_transport, false);
+    const auto id = conn.watch<int64_t>(
+        "/basic/int", [&](const json_server::error_code, const uint64_t, const int64_t val) { values.push_back(val); },
+        std::chrono::milliseconds(200));
+    auto synced = conn.get_async<int64_t>("/basic/int");
+    process_replies(conn, [&]() { return synced.wait_for(std::chrono::seconds(0)) == std::future_status::ready; });
+    const auto orig_val = synced.get();
+    const auto orig_stats = json_server::watch_stats();
+
+    // The first change is notified right away, the later ones are conflated until the interval passed
+    auto endpoint = client("/basic/int");
+    constexpr int64_t NUM_SETS = 100;
+    for (int64_t i = 1; i <= NUM_SETS; ++i)
+    {
+        endpoint.set(orig_val + i);
+    }
+    process_replies(conn, [&]() { return !values.empty() && values.back() == orig_val + NUM_SETS; });
+    ASSERT_EQ(values.back(), orig_val + NUM_SETS);
+    ASSERT_LT(values.size(), 10u);
+
+    const auto stats = json_server::watch_stats();
+    ASSERT_GE(stats.notifications - orig_stats.notifications, values.size());
+    ASSERT_GT(stats.conflated, orig_stats.conflated);
+    // Every change merged while the notification was held back counts as dropped, which are most of them
+    ASSERT_GE(stats.dropped - orig_stats.dropped, static_cast<uint64_t>(NUM_SETS / 2));
+
+    // Restore the value without leaving a notification held back for later
+    conn.unwatch(id);
+    synced = conn.get_async<int64_t>("/basic/int");
+    process_replies(conn, [&]() { return synced.wait_for(std::chrono::seconds(0)) == std::future_status::ready; });
+    endpoint.set(orig_val);
+}
+
+//
+// Atomic updates
+//
+UTEST(Update, arithmetic)
+{
+    auto endpoint = client("/basic/int");
+    const auto orig_val = endpoint.get<int64_t>();
+
+    endpoint.set<int64_t>(10);
+    ASSERT_EQ(endpoint.fetch_add<int64_t>(5), 10);
+    ASSERT_EQ(endpoint.fetch_sub<int64_t>(3), 15);
+    ASSERT_EQ(endpoint.fetch_min<int64_t>(20), 12);
+    ASSERT_EQ(endpoint.fetch_min<int64_t>(-4), 12);
+    ASSERT_EQ(endpoint.fetch_max<int64_t>(7), -4);
+    ASSERT_EQ(endpoint.exchange<int64_t>(orig_val), 7);
+    ASSERT_EQ(endpoint.get<int64_t>(), orig_val);
+
+    auto float_endpoint = client("/basic/float");
+    const auto orig_float = float_endpoint.get<float>();
+    ASSERT_EQ(float_endpoint.fetch_add(1.5F), orig_float);
+    ASSERT_EQ(float_endpoint.get<float>(), orig_float + 1.5F);
+    float_endpoint.set(orig_float);
+}
+
+UTEST(Update, compare_exchange)
+{
+    auto endpoint = client("/basic/string");
+    std::string expected = "OTHER";
+    ASSERT_FALSE(endpoint.compare_exchange(expected, std::string("NEW")));
+    ASSERT_STREQ(expected.c_str(), "DEBUG");
+    ASSERT_TRUE(endpoint.compare_exchange(expected, std::string("NEW")));
+    ASSERT_STREQ(endpoint.get<std::string>().c_str(), "NEW");
+    ASSERT_STREQ(endpoint.exchange(std::string("DEBUG")).c_str(), "NEW");
+}
+
+UTEST(Update, type_error)
+{
+    // Arithmetic on a string fails on the server, without dropping the connection
+    auto endpoint = client("/basic/string");
+    bool is_thrown = false;
+    try
+    {
+        endpoint.fetch_add<int64_t>(1);
+    }
+    catch (const json_server::RuntimeException &e)
+    {
+        ASSERT_EQ(e.m_err_code, json_server::error_code::type_error);
+        is_thrown = true;
+    }
+    ASSERT_TRUE(is_thrown);
+    ASSERT_STREQ(endpoint.get<std::string>().c_str(), "DEBUG");
+
+    // Arithmetic keeps the type of the value: integers and floats do not mix
+    const auto orig_int = client("/basic/int").get<int64_t>();
+    ASSERT_EXCEPTION(client("/basic/int").fetch_add(1.5F), json_server::RuntimeException);
+    ASSERT_EXCEPTION(client("/basic/int").fetch_max(1000.0F), json_server::RuntimeException);
+    ASSERT_EXCEPTION(client("/basic/float").fetch_add<int64_t>(1), json_server::RuntimeException);
+    ASSERT_EQ(client("/basic/int").get<int64_t>(), orig_int);
+    ASSERT_EQ(client("/basic/float").fetch_add(0.0F), client("/basic/float").get<float>());
+}
+
+//
+// Sessions
+//
+UTEST(Session, endpoints)
+{
+    json_client::Session session(details::DEFAULT_SOCK_FILE, g_transport);
+    const auto string = session.endpoint("/basic/string");
+    const auto array = session.endpoint("/array/heterogenous");
+    ASSERT_STREQ(string.get<std::string>().c_str(), "DEBUG");
+    ASSERT_EQ(array.get<std::vector<json_client::types::BasicType>>().size(), 5);
+    ASSERT_STREQ(session.endpoint("/basic/string").path().c_str(), "/basic/string");
+
+    // Malformed paths fail when creating the endpoint, the session stays usable
+    bool is_thrown = false;
+    try
+    {
+        session.endpoint("basic/string");
+    }
+    catch (const json_server::RuntimeException &e)
+    {
+        ASSERT_EQ(e.m_err_code, json_server::error_code::json_path_error);
+        is_thrown = true;
+    }
+    ASSERT_TRUE(is_thrown);
+
+    session.set("/basic/string", std::string("session"));
+    ASSERT_STREQ(string.get<std::string>().c_str(), "session");
+    string.set(std::string("DEBUG"));
+    ASSERT_STREQ(session.get<std::string>("/basic/string").c_str(), "DEBUG");
+}
+
+UTEST(Session, threads)
+{
+    // Many threads share one session, each on its own endpoints
+    json_client::Session session(details::DEFAULT_SOCK_FILE, g_transport);
+    constexpr std::size_t NUM_THREADS = 8;
+    constexpr int NUM_OPS = 200;
+    std::atomic<int> num_errors{0};
+    std::vector<std::thread> threads;
+    for (std::size_t i = 0; i < NUM_THREADS; ++i)
+    {
+        threads.emplace_back(
+            [&, i]()
+            {
+                const auto string = session.endpoint("/basic/string");
+                const auto element = session.endpoint("/array/homogenous/" + std::to_string(i));
+                const auto orig_val = element.get<int64_t>();
+                for (int op = 0; op < NUM_OPS; ++op)
+                {
+                    if (string.get<std::string>() != "DEBUG")
+                    {
+                        ++num_errors;
+                    }
+                    element.set(static_cast<int64_t>(op));
+                    if (element.get<int64_t>() != op)
+                    {
+                        ++num_errors;
+                    }
+                }
+                element.set(orig_val);
+            });
+    }
+    for (auto &thr: threads)
+    {
+        thr.join();
+    }
+    ASSERT_EQ(num_errors.load(), 0);
+    ASSERT_EQ(session.get<int64_t>("/array/homogenous/0"), -9);
+}
+
+UTEST(Session, failed_request)
+{
+    // A request for a missing path fails on its own: the requests of other threads on the session still succeed
+    json_client::Session session(details::DEFAULT_SOCK_FILE, g_transport);
+    constexpr int NUM_OPS = 200;
+    std::atomic<int> num_errors{0};
+    std::thread missing(
+        [&]()
+        {
+            const auto endpoint = session.endpoint("/basic/missing");
+            for (int op = 0; op < NUM_OPS; ++op)
+            {
+                try
+                {
+                    endpoint.get<int64_t>();
+                    ++num_errors;
+                }
+                catch (const json_server::RuntimeException &e)
+                {
+                    num_errors += e.m_err_code == json_server::error_code::json_path_error ? 0 : 1;
+                }
+            }
+        });
+    const auto string = session.endpoint("/basic/string");
+    for (int op = 0; op < NUM_OPS; ++op)
+    {
+        if (string.get<std::string>() != "DEBUG")
+        {
+            ++num_errors;
+        }
+    }
+    missing.join();
+    ASSERT_EQ(num_errors.load(), 0);
+}
+
+//
+// Connection pools
+//
+UTEST(ConnectionPool, reuse)
+{
+    json_client::ConnectionPool pool(details::DEFAULT_SOCK_FILE, g_transport);
+    for (int i = 0; i < 10; ++i)
+    {
+        ASSERT_STREQ(pool.endpoint("/basic/string").get<std::string>().c_str(), "DEBUG");
+    }
+    ASSERT_EQ(pool.num_open(), 1);
+    ASSERT_EQ(pool.num_idle(), 1);
+    {
+        auto first = pool.endpoint("/basic/string");
+        auto second = pool.endpoint("/basic/bool");
+        ASSERT_EQ(pool.num_open(), 2);
+        ASSERT_EQ(pool.num_idle(), 0);
+        ASSERT_FALSE(second.get<bool>());
+    }
+    ASSERT_EQ(pool.num_idle(), 2);
+
+    // Connections stay in use after a failed request
+    {
+        auto endpoint = pool.endpoint("/invalid");
+        bool is_thrown = false;
+        try
+        {
+            endpoint.get<int64_t>();
+        }
+        catch (const json_server::RuntimeException &e)
+        {
+            ASSERT_EQ(e.m_err_code, json_server::error_code::json_path_error);
+            is_thrown = true;
+        }
+        ASSERT_TRUE(is_thrown);
+    }
+    ASSERT_EQ(pool.num_open(), 2);
+    ASSERT_EQ(pool.num_idle(), 2);
+    ASSERT_STREQ(pool.endpoint("/basic/string").get<std::string>().c_str(), "DEBUG");
+}
+
+UTEST(ConnectionPool, endpoint_connection)
+{
+    // Pooled endpoint connections borrow connections instead of connecting
+    json_client::ConnectionPool pool(details::DEFAULT_SOCK_FILE, g_transport);
+    const auto orig_val = client("/basic/int").get<int64_t>();
+    for (int64_t i = 0; i < 10; ++i)
+    {
+        json_client::EndpointConnection(pool, "/basic/int").set(orig_val + i);
+        ASSERT_EQ(json_client::EndpointConnection(pool, "/basic/int").get<int64_t>(), orig_val + i);
+    }
+    ASSERT_EQ(pool.num_open(), 1);
+
+    // They take no locks, since the next borrower of the connection would own them
+    json_client::EndpointConnection endpoint(pool, "/basic/int");
+    bool is_thrown = false;
+    try
+    {
+        endpoint.lock();
+    }
+    catch (const json_server::RuntimeException &e)
+    {
+        ASSERT_EQ(e.m_err_code, json_server::error_code::lock);
+        is_thrown = true;
+    }
+    ASSERT_TRUE(is_thrown);
+    ASSERT_EXCEPTION(json_client::EndpointConnection(pool, "/invalid").get<int64_t>(), json_server::RuntimeException);
+    endpoint.set(orig_val);
+
+    // Moving returns the connection the target held
+    endpoint = json_client::EndpointConnection(pool, "/basic/string");
+    ASSERT_STREQ(endpoint.get<std::string>().c_str(), "DEBUG");
+    ASSERT_EQ(pool.num_open(), 2);
+    ASSERT_EQ(pool.num_idle(), 1);
+}
+
+UTEST(ConnectionPool, limits)
+{
+    json_client::PoolLimits limits;
+    limits.max_connections = 2;
+    limits.max_idle = 1;
+    json_client::ConnectionPool pool(details::DEFAULT_SOCK_FILE, g_transport, limits);
+
+    std::atomic<bool> is_borrowed{false};
+    std::thread borrower;
+    {
+        auto first = pool.endpoint("/basic/string");
+        auto second = pool.endpoint("/basic/string");
+        // A third borrower waits for a returned connection
+        borrower = std::thread(
+            [&]()
+            {
+                auto third = pool.endpoint("/basic/string");
+                is_borrowed = true;
+            });
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        ASSERT_FALSE(is_borrowed.load());
+        ASSERT_EQ(pool.num_open(), 2);
+    }
+    borrower.join();
+    ASSERT_TRUE(is_borrowed.load());
+    // Only one connection is kept idle
+    ASSERT_EQ(pool.num_open(), 1);
+    ASSERT_EQ(pool.num_idle(), 1);
+
+    // Connections idle for too long are closed
+    limits.max_idle_time = std::chrono::milliseconds(0);
+    json_client::ConnectionPool short_lived(details::DEFAULT_SOCK_FILE, g_transport, limits);
+    short_lived.endpoint("/basic/string").get<std::string>();
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    auto endpoint = short_lived.endpoint("/basic/string");
+    ASSERT_EQ(short_lived.num_open(), 1);
+    ASSERT_STREQ(endpoint.get<std::string>().c_str(), "DEBUG");
+}
+
+//
+// Batches
+//
+UTEST(Batch, get_and_set)
+{
+    json_client::Batch batch(details::DEFAULT_SOCK_FILE, g_transport);
+    const auto get_string = batch.get("/basic/string");
+    const auto set_float = batch.set("/basic/float", 1.5F);
+    const auto get_float = batch.get("/basic/float");
+    const auto get_invalid = batch.get("/invalid");
+    const auto set_invalid = batch.set("/invalid", int64_t{1});
+    const auto get_array = batch.get("/array/homogenous");
+    batch.execute();
+
+    ASSERT_STREQ(batch.result<std::string>(get_string).c_str(), "DEBUG");
+    ASSERT_EQ(batch.error(set_float), json_server::error_code::none);
+    // Gets see the sets before them
+    ASSERT_NEAR(batch.result<float>(get_float), 1.5, 1e-6);
+    ASSERT_EQ(batch.error(get_invalid), json_server::error_code::json_path_error);
+    ASSERT_EQ(batch.error(set_invalid), json_server::error_code::json_path_error);
+    ASSERT_EQ(batch.result<std::vector<int64_t>>(get_array).size(), 19);
+
+    bool is_thrown = false;
+    try
+    {
+        const auto _ = batch.result<int64_t>(get_invalid);
+    }
+    catch (const json_server::RuntimeException &e)
+    {
+        ASSERT_EQ(e.m_err_code, json_server::error_code::json_path_error);
+        is_thrown = true;
+    }
+    ASSERT_TRUE(is_thrown);
+
+    batch.clear();
+    batch.set("/basic/float", -24.0F);
+    batch.execute();
+    ASSERT_EQ(batch.error(0), json_server::error_code::none);
+    ASSERT_NEAR(client("/basic/float").get<float>(), -24.0, 1e-6);
+}
+
+UTEST(Batch, atomic)
+{
+    // Values of different subtrees, which the writer always sets to the same value
+    const std::array<std::string, 2> paths{"/basic/int", "/array/homogenous/0"};
+    json_client::Batch reader(details::DEFAULT_SOCK_FILE, g_transport);
+    for (const auto &path: paths)
+    {
+        reader.get(path);
+    }
+    reader.execute();
+    const auto orig_vals = std::make_pair(reader.result<int64_t>(0), reader.result<int64_t>(1));
+    client(paths[1]).set(orig_vals.first);
+
+    std::atomic<bool> is_done{false};
+    std::thread writer(
+        [&]()
+        {
+            json_client::Batch batch(details::DEFAULT_SOCK_FILE, g_transport);
+            for (int64_t i = 0; i < 200; ++i)
+            {
+                batch.clear();
+                for (const auto &path: paths)
+                {
+                    batch.set(path, i);
+                }
+                batch.execute();
+            }
+            is_done = true;
+        });
+
+    // Executing the same batch again reads the current values
+    uint32_t num_torn = 0;
+    while (!is_done)
+    {
+        reader.execute();
+        if (reader.result<int64_t>(0) != reader.result<int64_t>(1))
+        {
+            ++num_torn;
+        }
+    }
+    writer.join();
+    ASSERT_EQ(num_torn, 0);
+
+    json_client::Batch restore(details::DEFAULT_SOCK_FILE, g_transport);
+    restore.set(paths[0], orig_vals.first);
+    restore.set(paths[1], orig_vals.second);
+    restore.execute();
+}
+
+//
+// Transactions
+//
+UTEST(Transaction, preconditions)
+{
+    json_client::Transaction transaction(details::DEFAULT_SOCK_FILE, g_transport);
+    transaction.check_equals("/basic/string", std::string("DEBUG"));
+    transaction.check_exists("/basic/int");
+    transaction.set("/basic/int", int64_t{5});
+    transaction.set("/basic/bool", true);
+    ASSERT_TRUE(transaction.commit());
+    ASSERT_FALSE(transaction.failed_check().has_value());
+    ASSERT_EQ(client("/basic/int").get<int64_t>(), 5);
+    ASSERT_TRUE(client("/basic/bool").get<bool>());
+
+    // No set takes effect if a check fails
+    transaction.clear();
+    transaction.check_exists("/basic/int");
+    transaction.check_equals("/basic/string", std::string("OTHER"));
+    transaction.check_exists("/invalid");
+    transaction.set("/basic/int", int64_t{7});
+    ASSERT_FALSE(transaction.commit());
+    ASSERT_EQ(*transaction.failed_check(), 1);
+    ASSERT_NE(transaction.version(0), 0);
+    ASSERT_EQ(transaction.version(2), 0);
+    ASSERT_EQ(client("/basic/int").get<int64_t>(), 5);
+
+    // Versions change with every write to the subtree, but not with writes elsewhere
+    transaction.clear();
+    transaction.check_exists("/basic");
+    transaction.commit();
+    const auto version = transaction.version(0);
+    client("/array/homogenous/0").set(int64_t{-9});
+
+    transaction.clear();
+    transaction.check_version("/basic", version);
+    transaction.check_version("/invalid", 0);
+    transaction.set("/basic/int", int64_t{3});
+    transaction.set("/basic/bool", false);
+    ASSERT_TRUE(transaction.commit());
+    ASSERT_FALSE(transaction.commit());
+    ASSERT_EQ(*transaction.failed_check(), 0);
+    ASSERT_NE(transaction.version(0), version);
+}
+
+UTEST(Transaction, missing_path)
+{
+    // A set of a missing path fails the whole transaction, but keeps the connection
+    json_client::Transaction transaction(details::DEFAULT_SOCK_FILE, g_transport);
+    transaction.set("/basic/int", int64_t{7});
+    transaction.set("/invalid", int64_t{7});
+    bool is_thrown = false;
+    try
+    {
+        transaction.commit();
+    }
+    catch (const json_server::RuntimeException &e)
+    {
+        ASSERT_EQ(e.m_err_code, json_server::error_code::json_path_error);
+        is_thrown = true;
+    }
+    ASSERT_TRUE(is_thrown);
+    ASSERT_EQ(client("/basic/int").get<int64_t>(), 3);
+
+    transaction.clear();
+    transaction.check_equals("/basic/int", int64_t{3});
+    ASSERT_TRUE(transaction.commit());
+}
+
 //
 // Lock and unlock
 //
@@ -223,6 +1203,459 @@ UTEST(Concurrency, lock)
     ASSERT_EQ(client_1.get<int64_t>(), 5050);
 }
 
+UTEST(Concurrency, lock_order)
+{
+    // Waiting clients are granted the lock in the order of their requests
+    auto holder = client("/basic/int", true);
+    std::mutex order_mutex;
+    std::vector<int> order;
+    std::vector<std::thread> threads;
+    for (int i = 0; i < 3; ++i)
+    {
+        threads.emplace_back(
+            [&order_mutex, &order, i]()
+            {
+                auto waiter = client("/basic/int", true);
+                const std::scoped_lock lock(order_mutex);
+                order.push_back(i);
+            });
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    }
+    {
+        const std::scoped_lock lock(order_mutex);
+        ASSERT_TRUE(order.empty());
+    }
+    // The lock does not block other requests, not even on the locked path
+    ASSERT_EQ(client("/basic/int").get<int64_t>(), holder.get<int64_t>());
+
+    holder.unlock();
+    for (auto &thr: threads)
+    {
+        thr.join();
+    }
+    ASSERT_TRUE(order == std::vector<int>({0, 1, 2}));
+}
+
+UTEST(Concurrency, lock_release_on_disconnect)
+{
+    // A client that disconnects without unlocking releases its lock
+    auto holder = std::make_unique<RawConnection>();
+    nlohmann::json req;
+    req["cmd"] = static_cast<uint8_t>(details::request_cmd::lock);
+    req["path"] = "/basic/int";
+    holder->send(nlohmann::json::to_msgpack(req));
+    ASSERT_EQ(nlohmann::json::from_msgpack(holder->receive()).at("err_code").get<int>(), 0);
+
+    std::atomic<bool> is_granted{false};
+    std::thread waiter(
+        [&is_granted]()
+        {
+            auto endpoint = client("/basic/int", true);
+            is_granted = true;
+        });
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    ASSERT_FALSE(is_granted);
+
+    holder.reset();
+    waiter.join();
+    ASSERT_TRUE(is_granted);
+
+    // Unlocking a path locked by nobody fails
+    RawConnection other;
+    req["cmd"] = static_cast<uint8_t>(details::request_cmd::unlock);
+    other.send(nlohmann::json::to_msgpack(req));
+    ASSERT_EQ(nlohmann::json::from_msgpack(other.receive()).at("err_code").get<int>(),
+              static_cast<int>(json_server::error_code::lock));
+}
+
+UTEST(Concurrency, hierarchical_lock)
+{
+    // A lock on a subtree conflicts with locks on the paths below and above it, but not with those of other subtrees
+    auto parent = client("/basic", true);
+    std::atomic<bool> is_granted{false};
+    std::thread child(
+        [&is_granted]()
+        {
+            auto endpoint = client("/basic/int", true);
+            is_granted = true;
+        });
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    ASSERT_FALSE(is_granted);
+    client("/array/homogenous", true);
+    parent.unlock();
+    child.join();
+    ASSERT_TRUE(is_granted);
+
+    auto leaf = client("/basic/int", true);
+    is_granted = false;
+    std::thread ancestor(
+        [&is_granted]()
+        {
+            auto endpoint = client("", true);
+            is_granted = true;
+        });
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    ASSERT_FALSE(is_granted);
+    leaf.unlock();
+    ancestor.join();
+    ASSERT_TRUE(is_granted);
+}
+
+UTEST(Concurrency, shared_lock)
+{
+    // Shared locks overlap with each other, but not with exclusive ones
+    auto reader_1 = client("/basic");
+    reader_1.lock(details::lock_mode::shared);
+    auto reader_2 = client("/basic/int");
+    reader_2.lock(details::lock_mode::shared);
+
+    std::mutex order_mutex;
+    std::vector<std::string> order;
+    std::thread writer(
+        [&order_mutex, &order]()
+        {
+            auto endpoint = client("/basic/string", true);
+            const std::scoped_lock lock(order_mutex);
+            order.emplace_back("writer");
+        });
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+
+    // Later shared locks of the subtree queue up behind the waiting writer instead of starving it, those of other
+    // subtrees do not
+    std::thread reader_3(
+        [&order_mutex, &order]()
+        {
+            auto endpoint = client("/basic");
+            endpoint.lock(details::lock_mode::shared);
+            const std::scoped_lock lock(order_mutex);
+            order.emplace_back("reader");
+        });
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    client("/basic/bool").lock(details::lock_mode::shared);
+    {
+        const std::scoped_lock lock(order_mutex);
+        ASSERT_TRUE(order.empty());
+    }
+
+    reader_1.unlock();
+    reader_2.unlock();
+    writer.join();
+    reader_3.join();
+    ASSERT_TRUE(order == std::vector<std::string>({"writer", "reader"}));
+}
+
+UTEST(Concurrency, try_lock)
+{
+    // A contended lock request gives up after its timeout, without dropping the client
+    auto holder = client("/basic", true);
+    auto other = client("/basic/int");
+    const auto start = std::chrono::steady_clock::now();
+    ASSERT_FALSE(other.try_lock(std::chrono::milliseconds(30)));
+    ASSERT_TRUE(std::chrono::steady_clock::now() - start >= std::chrono::milliseconds(30));
+    ASSERT_FALSE(other.try_lock(std::chrono::milliseconds(0)));
+    ASSERT_EQ(other.get<int64_t>(), client("/basic/int").get<int64_t>());
+
+    // A request queued behind one which timed out is granted then
+    holder.unlock();
+    holder.lock(details::lock_mode::shared);
+    std::atomic<bool> is_timed_out{false};
+    std::thread writer(
+        [&is_timed_out]()
+        {
+            auto endpoint = client("/basic");
+            is_timed_out = !endpoint.try_lock(std::chrono::milliseconds(100));
+        });
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    std::atomic<bool> is_granted{false};
+    std::thread reader(
+        [&is_granted]()
+        {
+            auto endpoint = client("/basic/int");
+            endpoint.lock(details::lock_mode::shared);
+            is_granted = true;
+        });
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    ASSERT_FALSE(is_granted);
+    writer.join();
+    reader.join();
+    ASSERT_TRUE(is_timed_out);
+    ASSERT_TRUE(is_granted);
+
+    // and a request that waits long enough gets the lock once it is released
+    std::thread releaser(
+        [&holder]()
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+            holder.unlock();
+        });
+    ASSERT_TRUE(other.try_lock(std::chrono::milliseconds(10000)));
+    releaser.join();
+}
+
+UTEST(Concurrency, lock_lease)
+{
+    // By default, locks are kept until they are unlocked
+    ASSERT_EQ(json_server::Options().lock_lease_time.count(), 0);
+    auto holder = client("/basic/int", true);
+    auto other = client("/basic/int");
+    std::this_thread::sleep_for(std::chrono::milliseconds(600));
+    ASSERT_FALSE(other.try_lock(std::chrono::milliseconds(0)));
+    holder.renew();
+    holder.unlock();
+
+    // With leases, locks which are not renewed are released once their lease passed
+    json_server::set_lock_lease_time(std::chrono::milliseconds(500));
+    holder.lock();
+    std::this_thread::sleep_for(std::chrono::milliseconds(300));
+    holder.renew();
+    std::this_thread::sleep_for(std::chrono::milliseconds(300));
+    ASSERT_FALSE(other.try_lock(std::chrono::milliseconds(0)));
+
+    ASSERT_TRUE(other.try_lock(std::chrono::milliseconds(10000)));
+    ASSERT_EXCEPTION(holder.renew(), json_server::RuntimeException);
+    other.unlock();
+    json_server::set_lock_lease_time(std::chrono::milliseconds(0));
+}
+
+UTEST(Concurrency, deadlock)
+{
+    // Two clients which each wait for the lock of the other one: the second request is refused
+    const auto lock_request = [](const char *path)
+    {
+        nlohmann::json req;
+        req["cmd"] = static_cast<uint8_t>(details::request_cmd::lock);
+        req["path"] = path;
+        return nlohmann::json::to_msgpack(req);
+    };
+    const auto err_code = [](const std::vector<uint8_t> &reply)
+    { return nlohmann::json::from_msgpack(reply).at("err_code").get<int>(); };
+
+    RawConnection first;
+    auto second = std::make_unique<RawConnection>();
+    first.send(lock_request("/basic/int"));
+    ASSERT_EQ(err_code(first.receive()), 0);
+    second->send(lock_request("/basic/float"));
+    ASSERT_EQ(err_code(second->receive()), 0);
+
+    first.send(lock_request("/basic/float"));
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    second->send(lock_request("/basic/int"));
+    ASSERT_EQ(err_code(second->receive()), static_cast<int>(json_server::error_code::deadlock));
+
+    // The refused client keeps its lock until it releases it
+    second.reset();
+    ASSERT_EQ(err_code(first.receive()), 0);
+}
+
+UTEST(Concurrency, fetch_add)
+{
+    // The same counting as above, without locking: every increment sees a distinct previous value
+    auto endpoint = client("/basic/int");
+    endpoint.set<int64_t>(0);
+
+    constexpr int64_t NUM_THREADS = 4;
+    constexpr int64_t NUM_INCREMENTS = 250;
+    std::vector<std::vector<int64_t>> previous(NUM_THREADS);
+    std::vector<std::thread> threads;
+    for (auto &thread_previous: previous)
+    {
+        threads.emplace_back(
+            [&thread_previous]()
+            {
+                auto counter = client("/basic/int");
+                for (int64_t i = 0; i < NUM_INCREMENTS; ++i)
+                {
+                    thread_previous.push_back(counter.fetch_add<int64_t>(1));
+                }
+            });
+    }
+    for (auto &thr: threads)
+    {
+        thr.join();
+    }
+
+    ASSERT_EQ(endpoint.get<int64_t>(), NUM_THREADS * NUM_INCREMENTS);
+    std::vector<int64_t> all_previous;
+    for (const auto &thread_previous: previous)
+    {
+        all_previous.insert(all_previous.end(), thread_previous.begin(), thread_previous.end());
+    }
+    std::sort(all_previous.begin(), all_previous.end());
+    for (int64_t i = 0; i < NUM_THREADS * NUM_INCREMENTS; ++i)
+    {
+        ASSERT_EQ(all_previous[static_cast<std::size_t>(i)], i);
+    }
+}
+
+UTEST(Concurrency, transaction)
+{
+    // The same counting once more, with optimistic transactions that retry when another client got in between
+    auto endpoint = client("/basic/int");
+    endpoint.set<int64_t>(0);
+
+    constexpr int64_t NUM_THREADS = 4;
+    constexpr int64_t NUM_INCREMENTS = 100;
+    std::vector<std::thread> threads;
+    for (int64_t thread = 0; thread < NUM_THREADS; ++thread)
+    {
+        threads.emplace_back(
+            []()
+            {
+                auto counter = client("/basic/int");
+                json_client::Transaction transaction(details::DEFAULT_SOCK_FILE, g_transport);
+                for (int64_t i = 0; i < NUM_INCREMENTS; ++i)
+                {
+                    do
+                    {
+                        const auto value = counter.get<int64_t>();
+                        transaction.clear();
+                        transaction.check_equals("/basic/int", value);
+                        transaction.set("/basic/int", value + 1);
+                    } while (!transaction.commit());
+                }
+            });
+    }
+    for (auto &thr: threads)
+    {
+        thr.join();
+    }
+    ASSERT_EQ(endpoint.get<int64_t>(), NUM_THREADS * NUM_INCREMENTS);
+    endpoint.set<int64_t>(3);
+}
+
+UTEST(Concurrency, many_connections)
+{
+    // Idle connections must not pin the server's worker threads
+    std::vector<json_client::EndpointConnection> endpoints;
+    for (uint32_t i = 0; i < 64; ++i)
+    {
+        endpoints.push_back(client("/basic/string"));
+    }
+    for (auto &endpoint: endpoints)
+    {
+        ASSERT_STREQ(endpoint.get<std::string>().c_str(), "DEBUG");
+    }
+}
+
+UTEST(Concurrency, read_during_write)
+{
+    // Readers must always see either the old or the new value, never a partially written one
+    auto writer = client("/array/homogenous");
+    const auto orig_vec = writer.get<compound_type>();
+    const std::vector<basic_type> set_vec{-1, 0, 1, 2, 3, 4, 5};
+
+    std::atomic<bool> stop{false};
+    std::atomic<bool> is_consistent{true};
+    auto t = std::thread(
+        [&]()
+        {
+            auto reader = client("/array/homogenous");
+            while (!stop)
+            {
+                const auto vec = reader.get<compound_type>();
+                if (vec != orig_vec && vec != set_vec)
+                {
+                    is_consistent = false;
+                }
+            }
+        });
+
+    for (uint32_t i = 0; i < 200; ++i)
+    {
+        writer.set<compound_type>(i % 2 == 0 ? set_vec : orig_vec);
+    }
+    writer.set<compound_type>(orig_vec);
+    stop = true;
+    t.join();
+
+    ASSERT_TRUE(is_consistent);
+    ASSERT_TRUE(writer.get<compound_type>() == orig_vec);
+}
+
+UTEST(Concurrency, handle_during_set)
+{
+    // A resolved handle reads the element of the latest value of its parent while writers replace the parent: values
+    // never go back to a stale element, and a write is seen once it completed
+    json_client::Session session(details::DEFAULT_SOCK_FILE, g_transport);
+    const auto element = session.endpoint("/array/homogenous/4");
+    auto writer = client("/array/homogenous");
+    const auto orig_vec = writer.get<compound_type>();
+    constexpr int64_t NUM_SETS = 200;
+
+    std::atomic<bool> stop{false};
+    std::atomic<bool> is_consistent{true};
+    auto reader = std::thread(
+        [&]()
+        {
+            auto last = element.get<int64_t>();
+            while (!stop)
+            {
+                const auto val = element.get<int64_t>();
+                if (val < last)
+                {
+                    is_consistent = false;
+                }
+                last = val;
+            }
+        });
+
+    for (int64_t i = 0; i < NUM_SETS; ++i)
+    {
+        writer.set<compound_type>(compound_type(orig_vec.size(), basic_type{i}));
+        if (element.get<int64_t>() < i)
+        {
+            is_consistent = false;
+        }
+    }
+    stop = true;
+    reader.join();
+
+    ASSERT_TRUE(is_consistent);
+    ASSERT_EQ(element.get<int64_t>(), NUM_SETS - 1);
+    writer.set<compound_type>(orig_vec);
+    ASSERT_EQ(element.get<int64_t>(), -5);
+}
+
+UTEST(Concurrency, stripe_stats)
+{
+    const auto count_acquisitions = []()
+    {
+        uint64_t acquisitions = 0;
+        for (const auto &stripe: json_server::stripe_stats())
+        {
+            acquisitions += stripe.acquisitions;
+        }
+        return acquisitions;
+    };
+    const auto before = count_acquisitions();
+
+    // Writers of different subtrees
+    std::vector<std::thread> threads;
+    for (const auto *const path: {"/basic/int", "/array/homogenous/0", "/array/homogenous/1"})
+    {
+        threads.emplace_back(
+            [path]()
+            {
+                auto endpoint = client(path);
+                const auto orig_val = endpoint.get<int64_t>();
+                for (uint32_t i = 0; i < 50; ++i)
+                {
+                    endpoint.set(orig_val);
+                }
+            });
+    }
+    for (auto &thr: threads)
+    {
+        thr.join();
+    }
+
+    ASSERT_EQ(count_acquisitions() - before, 150);
+    for (const auto &stripe: json_server::stripe_stats())
+    {
+        ASSERT_LE(stripe.contentions, stripe.acquisitions);
+    }
+}
+
 UTEST(Performance, read)
 {
     auto endpoint = client("/basic/int");
@@ -234,8 +1667,43 @@ UTEST(Performance, read)
     }
 }
 
+UTEST(Performance, zero_allocation_get)
+{
+    auto endpoint = client("/basic/int");
+    const auto expected = endpoint.get<int64_t>();
+
+    // Warm up, so that all buffers on the way have grown to their final size
+    for (uint32_t i = 0; i < 100; ++i)
+    {
+        ASSERT_EQ(endpoint.get<int64_t>(), expected);
+    }
+
+    const auto before = g_server_allocations.load();
+    for (uint32_t i = 0; i < 1000; ++i)
+    {
+        ASSERT_EQ(endpoint.get<int64_t>(), expected);
+    }
+    ASSERT_EQ(g_server_allocations.load() - before, 0);
+}
+
 int main(int argc, char **argv)
 {
-    json_server::init("test_data.json");
+    t_is_test_thread = true;
+
+    // Run the tests against the io_uring backend with --io-uring, over seqpacket sockets with --seqpacket
+    json_server::Options options;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (std::string(argv[i]) == "--io-uring")
+        {
+            options.backend = json_server::io_backend::io_uring;
+        }
+        if (std::string(argv[i]) == "--seqpacket")
+        {
+            options.transport = details::transport::seqpacket;
+            g_transport = details::transport::seqpacket;
+        }
+    }
+    json_server::init("test_data.json", options);
     return utest_main(argc, argv);
 }